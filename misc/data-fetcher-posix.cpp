@@ -2,147 +2,496 @@
 
 #include <string>
 #include <cstring>
+#include <mutex>
 #include <esp_log.h>
 
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <stdio.h>
+#include <stdlib.h>
+
 #include "common.h"
 
+extern "C" {
+extern char trs_retrostore_host[];
+extern char trs_retrostore_cache[];
+extern int trs_retrostore_cache_size;
+}
+
 namespace {
 
 #include <strings.h>
 
 #include "defs.h"
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <netdb.h>
-#include <unistd.h>
 
-#define RETROSTORE_HOST "retrostore.org"
-#define RETROSTORE_PORT 80
+#define RETROSTORE_PORT "80"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 
 #define LOG(msg) printf("%s\n", msg)
 
+/*
+ * The connection to the server is kept open between requests.  Fetch
+ * is called from the TRS-IO worker as well as from XRAY, so requests
+ * are serialized by fetch_lock.
+ */
+std::mutex fetch_lock;
+int server_fd = -1;
+
+/* Bytes received but not yet consumed */
+char rx_buf[16384];
+int rx_len = 0;
+int rx_pos = 0;
 
-bool connect_server(int* fd)
+/* Split trs_retrostore_host into host and port */
+void server_address(std::string* host, std::string* port)
 {
-  const char* host = RETROSTORE_HOST;
-  const int port = RETROSTORE_PORT;
-  
-  struct sockaddr_in serv_addr;
-  struct hostent* server;
-
-  
-  *fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (*fd < 0) {
-    // Error opening socket
-    return false;
+  const char* colon = strrchr(trs_retrostore_host, ':');
+
+  if (colon == NULL) {
+    *host = trs_retrostore_host;
+    *port = RETROSTORE_PORT;
+  } else {
+    host->assign(trs_retrostore_host, colon - trs_retrostore_host);
+    *port = colon + 1;
+  }
+}
+
+void disconnect_server()
+{
+  if (server_fd >= 0) {
+    close(server_fd);
+    server_fd = -1;
   }
-  server = gethostbyname(host);
-  if (server == NULL) {
+  rx_len = rx_pos = 0;
+}
+
+bool connect_server()
+{
+  std::string host, port;
+  struct addrinfo hints, *res, *ai;
+
+  disconnect_server();
+  server_address(&host, &port);
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0) {
     // No such host
     return false;
   }
-  bzero((char*) &serv_addr, sizeof(serv_addr));
-  serv_addr.sin_family = AF_INET;
-  bcopy((char*) server->h_addr,
-        (char*) &serv_addr.sin_addr.s_addr,
-        server->h_length);
-  serv_addr.sin_port = htons(port);
-  if (connect(*fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-    // Error connecting
-    return false;
+  for (ai = res; ai != NULL; ai = ai->ai_next) {
+    server_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (server_fd < 0) {
+      continue;
+    }
+    if (connect(server_fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+    close(server_fd);
+    server_fd = -1;
   }
-  return true;
+  freeaddrinfo(res);
+  return server_fd >= 0;
 }
-  
-bool skip_to_body(int fd)
+
+bool send_all(const void* data, int len)
 {
-  char buf[4];
-  buf[3] = 0;
+  const char* p = (const char*) data;
 
-  while (true) {
-    int result = recv(fd, buf, 1, MSG_WAITALL);
-    if (result < 1) {
+  while (len > 0) {
+    int n = send(server_fd, p, len, MSG_NOSIGNAL);
+    if (n <= 0) {
       return false;
     }
-    if (buf[0] != '\r') {
-      continue;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+/* Make sure there is received data, return false on EOF or error */
+bool fill_rx()
+{
+  if (rx_pos < rx_len) {
+    return true;
+  }
+  rx_pos = 0;
+  rx_len = recv(server_fd, rx_buf, sizeof(rx_buf), 0);
+  if (rx_len <= 0) {
+    rx_len = 0;
+    return false;
+  }
+  return true;
+}
+
+bool read_line(std::string* line)
+{
+  line->clear();
+  while (fill_rx()) {
+    char* start = rx_buf + rx_pos;
+    char* nl = (char*) memchr(start, '\n', rx_len - rx_pos);
+
+    if (nl != NULL) {
+      line->append(start, nl - start);
+      rx_pos += nl - start + 1;
+      if (!line->empty() && (*line)[line->size() - 1] == '\r') {
+        line->erase(line->size() - 1);
+      }
+      return true;
     }
-    result = recv(fd, buf, 3, MSG_WAITALL);
-    if (result < 3) {
+    line->append(start, rx_len - rx_pos);
+    rx_pos = rx_len;
+  }
+  return false;
+}
+
+/* Append len bytes of the body to the buffer, growing it geometrically */
+bool read_body(uint8_t** buf, int* size, int* br, int len)
+{
+  while (len > 0) {
+    if (!fill_rx()) {
       return false;
     }
-    if (buf[0] == '\n' && buf[1] == '\r' && buf[2] == '\n') {
-      break;
+    int n = rx_len - rx_pos;
+    if (n > len) {
+      n = len;
+    }
+    if (*br + n > *size) {
+      int new_size = *size ? *size : 4096;
+      while (new_size < *br + n) {
+        new_size *= 2;
+      }
+      uint8_t* p = (uint8_t*) realloc(*buf, new_size);
+      if (p == NULL) {
+        return false;
+      }
+      *buf = p;
+      *size = new_size;
     }
+    memcpy(*buf + *br, rx_buf + rx_pos, n);
+    rx_pos += n;
+    *br += n;
+    len -= n;
   }
   return true;
 }
 
+/*
+ * Read one response.  The body length comes from Content-Length,
+ * chunked transfer encoding, or else the server closing the
+ * connection.  Sets keep_alive if the connection can be reused, and
+ * status to the HTTP status, or 0 if no response arrived at all.
+ * Returns false if the response couldn't be read.
+ */
+bool read_response(uint8_t** buf, int* br, bool* keep_alive, int* status)
+{
+  std::string line;
+  long length = -1;
+  bool chunked = false;
+  int size = 0;
 
-};  // namespace
-
-namespace retrostore {
-
-bool DataFetcherEsp::Fetch(const std::string& path,
-                           const RsData& params,
-                           RsData* data) const {
-  if (data->len > 0 || data->data != NULL) {
-    LOG("Given `data` should be empty!");
+  *keep_alive = true;
+  *status = 0;
+  if (!read_line(&line)) {
     return false;
   }
-
-  int fd;
-
-  if (!connect_server(&fd)) {
-    LOG("ERROR: Connection failed");
+  if (sscanf(line.c_str(), "HTTP/%*d.%*d %d", status) != 1 || *status == 0) {
+    *status = -1;
     return false;
   }
+  if (line.compare(0, 8, "HTTP/1.0") == 0) {
+    *keep_alive = false;
+  }
+  while (true) {
+    if (!read_line(&line)) {
+      return false;
+    }
+    if (line.empty()) {
+      break;
+    }
+    const char* h = line.c_str();
+    if (strncasecmp(h, "Content-Length:", 15) == 0) {
+      length = atol(h + 15);
+    } else if (strncasecmp(h, "Transfer-Encoding:", 18) == 0) {
+      chunked = strcasestr(h + 18, "chunked") != NULL;
+    } else if (strncasecmp(h, "Connection:", 11) == 0) {
+      if (strcasestr(h + 11, "close") != NULL) {
+        *keep_alive = false;
+      } else if (strcasestr(h + 11, "keep-alive") != NULL) {
+        *keep_alive = true;
+      }
+    }
+  }
 
-  char* header = (char*) malloc(512);
-  snprintf(header, 512, "POST %s HTTP/1.1\r\n"
+  *buf = NULL;
+  *br = 0;
+  if (chunked) {
+    while (true) {
+      if (!read_line(&line)) {
+        return false;
+      }
+      long chunk = strtol(line.c_str(), NULL, 16);
+      if (chunk <= 0) {
+        // Skip any trailers
+        while (read_line(&line) && !line.empty()) {
+        }
+        break;
+      }
+      if (!read_body(buf, &size, br, chunk) || !read_line(&line)) {
+        return false;
+      }
+    }
+  } else if (length >= 0) {
+    if (!read_body(buf, &size, br, length)) {
+      return false;
+    }
+  } else {
+    *keep_alive = false;
+    while (fill_rx()) {
+      if (!read_body(buf, &size, br, rx_len - rx_pos)) {
+        return false;
+      }
+    }
+  }
+  if (*buf == NULL) {
+    *buf = (uint8_t*) malloc(1);
+  }
+  return *buf != NULL;
+}
+
+bool post(const std::string& path, const retrostore::RsData& params,
+          uint8_t** buf, int* br)
+{
+  std::string host, port;
+  char header[512];
+  bool keep_alive;
+  int status;
+
+  server_address(&host, &port);
+  snprintf(header, sizeof(header), "POST %s HTTP/1.1\r\n"
            "Host: %s\r\n"
            "Content-type: application/octet-stream\r\n"
            "Content-Length: %d\r\n"
-           "Connection: close\r\n\r\n", path.c_str(), RETROSTORE_HOST,
+           "Connection: keep-alive\r\n\r\n", path.c_str(), host.c_str(),
            params.len);
-  write(fd, header, strlen(header));
-  write(fd, (const char*) params.data, params.len);
-  free(header);
 
-  if (!skip_to_body(fd)) {
+  /*
+   * A kept connection may have been closed by the server: retry once,
+   * but only if the request couldn't be sent or nothing came back.
+   * Once the server has answered, the request must not be repeated.
+   */
+  for (int attempt = 0; attempt < 2; attempt++) {
+    bool reused = server_fd >= 0;
+    bool ok;
+
+    if (!reused && !connect_server()) {
+      LOG("ERROR: Connection failed");
+      return false;
+    }
+    status = 0;
+    ok = send_all(header, strlen(header)) &&
+         send_all(params.data, params.len) &&
+         read_response(buf, br, &keep_alive, &status);
+    if (ok && status == 200) {
+      if (!keep_alive) {
+        disconnect_server();
+      }
+      return true;
+    }
+    free(*buf);
+    *buf = NULL;
+    if (ok && keep_alive) {
+      // An HTTP error: the connection is still good
+      return false;
+    }
+    disconnect_server();
+    if (!reused || status != 0) {
+      break;
+    }
+  }
+  return false;
+}
+
+/*
+ * On-disk cache of fetched apps and media images, in
+ * trs_retrostore_cache.  Each response is stored in a file named by a
+ * hash of the request, and the least recently used files are removed
+ * once the cache grows beyond trs_retrostore_cache_size megabytes.
+ * Only apps and their media are cached, as they don't change once
+ * published.  States are downloaded by tokens that get reused for
+ * other states, and listings change, so those are always requested.
+ */
+bool cacheable(const std::string& path)
+{
+  static const char* const immutable[] = { "getApp", "fetchMediaImages" };
+  size_t slash = path.rfind('/');
+  std::string name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+
+  if (trs_retrostore_cache[0] == 0 || trs_retrostore_cache_size <= 0) {
     return false;
   }
+  for (size_t i = 0; i < sizeof(immutable) / sizeof(immutable[0]); i++) {
+    if (name == immutable[i]) {
+      return true;
+    }
+  }
+  return false;
+}
 
-  uint8_t* buf;
-  int br = 0;
+/* The option ends the directory with a slash unless it fell back to "." */
+std::string cache_path(const char* name)
+{
+  std::string dir(trs_retrostore_cache);
+
+  if (dir[dir.size() - 1] != '/') {
+    dir += '/';
+  }
+  return dir + name;
+}
+
+std::string cache_file(const std::string& path,
+                       const retrostore::RsData& params)
+{
+  /* 64-bit FNV-1a */
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  const uint8_t* p = (const uint8_t*) path.c_str();
+  char name[24];
+
+  for (size_t i = 0; i <= path.size(); i++) {
+    hash = (hash ^ p[i]) * 0x100000001b3ULL;
+  }
+  p = (const uint8_t*) params.data;
+  for (int i = 0; i < params.len; i++) {
+    hash = (hash ^ p[i]) * 0x100000001b3ULL;
+  }
+  snprintf(name, sizeof(name), "%016llx.rs", (unsigned long long) hash);
+  return cache_path(name);
+}
 
-  const int buf_size_incr = 100;
-  int buf_size = buf_size_incr;
+bool cache_read(const std::string& file, uint8_t** buf, int* br)
+{
+  FILE* f = fopen(file.c_str(), "rb");
+  struct stat st;
 
-  buf = (uint8_t*) malloc(buf_size);
-  if (buf == NULL) {
+  if (f == NULL) {
+    return false;
+  }
+  if (fstat(fileno(f), &st) != 0 ||
+      (*buf = (uint8_t*) malloc(st.st_size + 1)) == NULL) {
+    fclose(f);
+    return false;
+  }
+  if (fread(*buf, 1, st.st_size, f) != (size_t) st.st_size) {
+    free(*buf);
+    fclose(f);
     return false;
   }
+  fclose(f);
+  *br = st.st_size;
+  // Mark as recently used
+  utime(file.c_str(), NULL);
+  return true;
+}
+
+/* Remove the oldest cache files until the cache fits its size */
+void cache_trim()
+{
+  long long limit = (long long) trs_retrostore_cache_size << 20;
 
-  int result;
+  while (true) {
+    DIR* dir = opendir(trs_retrostore_cache);
+    struct dirent* ent;
+    std::string oldest;
+    time_t oldest_time = 0;
+    long long total = 0;
 
-  do {
-    result = recv(fd, buf + br, buf_size_incr, MSG_WAITALL);
-    if (result < 0) {
-      free(buf);
-      return false;
+    if (dir == NULL) {
+      return;
     }
-    br += result;
-    if (result == buf_size_incr) {
-      buf_size += buf_size_incr;
-      buf = (uint8_t*) realloc(buf, buf_size);
-      if (buf == NULL) {
-        return false;
+    while ((ent = readdir(dir)) != NULL) {
+      size_t len = strlen(ent->d_name);
+      struct stat st;
+
+      if (len < 3 || strcmp(ent->d_name + len - 3, ".rs") != 0) {
+        continue;
+      }
+      std::string file = cache_path(ent->d_name);
+      if (stat(file.c_str(), &st) != 0) {
+        continue;
       }
+      total += st.st_size;
+      if (oldest.empty() || st.st_mtime < oldest_time) {
+        oldest = file;
+        oldest_time = st.st_mtime;
+      }
+    }
+    closedir(dir);
+    if (total <= limit || oldest.empty()) {
+      return;
     }
-  }  while (result != 0);
- 
-  close(fd);
+    unlink(oldest.c_str());
+  }
+}
+
+void cache_write(const std::string& file, const uint8_t* buf, int br)
+{
+  std::string tmp = file + ".tmp";
+  FILE* f = fopen(tmp.c_str(), "wb");
+
+  if (f == NULL) {
+    return;
+  }
+  if (fwrite(buf, 1, br, f) != (size_t) br) {
+    fclose(f);
+    unlink(tmp.c_str());
+    return;
+  }
+  if (fclose(f) != 0 || rename(tmp.c_str(), file.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return;
+  }
+  cache_trim();
+}
+
+};  // namespace
+
+namespace retrostore {
+
+bool DataFetcherEsp::Fetch(const std::string& path,
+                           const RsData& params,
+                           RsData* data) const {
+  if (data->len > 0 || data->data != NULL) {
+    LOG("Given `data` should be empty!");
+    return false;
+  }
+
+  std::lock_guard<std::mutex> guard(fetch_lock);
+  uint8_t* buf = NULL;
+  int br = 0;
+  std::string file;
+
+  if (cacheable(path)) {
+    file = cache_file(path, params);
+    if (cache_read(file, &buf, &br)) {
+      data->data = buf;
+      data->len = br;
+      return true;
+    }
+  }
+
+  if (!post(path, params, &buf, &br)) {
+    return false;
+  }
+  if (!file.empty()) {
+    cache_write(file, buf, br);
+  }
 
   data->data = buf;
   data->len = br;
@@ -4,13 +4,75 @@
 #include "fileio.h"
 #include <string.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <assert.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
 
 #define AM_DIR 0x10
 
+/* stdio buffer for each open file */
+#define FILE_BUFFER_SIZE 0x10000
+
+/*
+ * Files opened for reading, or for update like the FreHD disk images,
+ * are mapped into memory if they are at least this size.  Reads and
+ * writes inside the file are then a memcpy, and the host writes dirty
+ * pages back; a write that extends the file drops the mapping.  So
+ * does finding the file shorter than the mapping, as touching a page
+ * past its end would raise SIGBUS.  FIL only holds the FILE pointer,
+ * so the mappings are kept in a small table next to it.
+ */
+#define MAP_MIN_SIZE 0x10000
+#define MAX_MAPPED 16
+
+typedef struct {
+  FILE* f;
+  BYTE* base;
+  size_t size;
+  size_t pos;
+  size_t dirty_lo;  /* range written since the last sync */
+  size_t dirty_hi;
+} mapped_file;
+
+static mapped_file mapped[MAX_MAPPED];
+
+/*
+ * The directory is read once and kept until its modification time
+ * changes, or a file is written through this shim.  Each open DIR_
+ * has a cursor into the snapshot that was current when it was opened,
+ * and keeps it until the listing ends or f_closedir is called, even if
+ * a newer one has replaced it meanwhile.
+ */
+#define MAX_DIR_CURSORS 4
+
+typedef struct {
+  char fname[13];
+  FSIZE_t fsize;
+} dir_entry;
+
+typedef struct {
+  dir_entry* entries;
+  int count;
+  int refs;  /* cursors using it, plus one while it is current */
+} dir_snapshot;
+
+static dir_snapshot* dir_cache;
+static int dir_valid;
+static time_t dir_mtime;
+static ino_t dir_ino;
+
+static struct {
+  DIR* dir;
+  dir_snapshot* snap;
+  int index;
+} dir_cursor[MAX_DIR_CURSORS];
+
 int trs_fs_mounted() {
   return 1;
 }
@@ -22,6 +84,95 @@ void f_log(const char* format, ...) {
   va_end(args);
 }
 
+static mapped_file* find_mapped(FILE* f) {
+  int i;
+
+  for (i = 0; i < MAX_MAPPED; i++) {
+    if (mapped[i].f == f) {
+      return &mapped[i];
+    }
+  }
+  return NULL;
+}
+
+static void map_file(FILE* f, int writable) {
+#ifndef _WIN32
+  mapped_file* m = find_mapped(NULL);
+  struct stat st;
+  void* base;
+
+  if (m == NULL || fstat(fileno(f), &st) != 0 || st.st_size < MAP_MIN_SIZE) {
+    return;
+  }
+  if (writable) {
+    base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                fileno(f), 0);
+  } else {
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+  }
+  if (base == MAP_FAILED) {
+    return;
+  }
+  m->f = f;
+  m->base = base;
+  m->size = st.st_size;
+  m->pos = 0;
+  m->dirty_lo = m->dirty_hi = 0;
+#endif
+}
+
+/* Whether the file still covers the whole mapping */
+static int map_intact(mapped_file* m) {
+#ifndef _WIN32
+  struct stat st;
+
+  return fstat(fileno(m->f), &st) == 0 && (size_t)st.st_size >= m->size;
+#else
+  return 1;
+#endif
+}
+
+static void mark_dirty(mapped_file* m, size_t pos, size_t len) {
+  if (m->dirty_lo >= m->dirty_hi) {
+    m->dirty_lo = pos;
+    m->dirty_hi = pos + len;
+  } else {
+    if (pos < m->dirty_lo) {
+      m->dirty_lo = pos;
+    }
+    if (pos + len > m->dirty_hi) {
+      m->dirty_hi = pos + len;
+    }
+  }
+}
+
+/* Write back the pages touched since the last sync, waiting if asked */
+static int sync_file(mapped_file* m, int wait) {
+#ifndef _WIN32
+  if (m->dirty_lo < m->dirty_hi) {
+    size_t const page = sysconf(_SC_PAGESIZE);
+    size_t const lo = m->dirty_lo - m->dirty_lo % page;
+    size_t const hi = m->dirty_hi;
+
+    m->dirty_lo = m->dirty_hi = 0;
+    return msync(m->base + lo, hi - lo, wait ? MS_SYNC : MS_ASYNC);
+  }
+#endif
+  return 0;
+}
+
+/* Drop the mapping, leaving the file at the mapped position */
+static void unmap_file(mapped_file* m) {
+#ifndef _WIN32
+  /* The host writes the pages back in its own time */
+  sync_file(m, 0);
+  munmap(m->base, m->size);
+#endif
+  fseek(m->f, m->pos, SEEK_SET);
+  m->f = NULL;
+  m->base = NULL;
+}
+
 FRESULT f_open (
   FIL* fp,           /* [OUT] Pointer to the file object structure */
   const TCHAR* path, /* [IN] File name */
@@ -57,16 +208,130 @@ FRESULT f_open (
     assert(0);
   }
   fp->f = fopen(path, m);
-  return (fp->f == NULL) ? FR_NO_FILE : FR_OK;
+  if (fp->f == NULL) {
+    return FR_NO_FILE;
+  }
+  setvbuf(fp->f, NULL, _IOFBF, FILE_BUFFER_SIZE);
+  if (mode == FA_READ || mode == (FA_READ | FA_WRITE)) {
+    map_file(fp->f, mode & FA_WRITE);
+  } else if (mode & (FA_CREATE_ALWAYS | FA_CREATE_NEW)) {
+    dir_valid = 0;
+  }
+  return FR_OK;
+}
+
+static void release_snapshot(dir_snapshot* snap) {
+  if (snap != NULL && --snap->refs == 0) {
+    free(snap->entries);
+    free(snap);
+  }
+}
+
+/* Read the names and sizes of the files in the current directory */
+static void read_dir() {
+  struct stat st;
+  struct dirent* entry;
+  dir_snapshot* snap;
+  DIR* dir;
+  int alloc = 0;
+
+  if (stat(".", &st) != 0) {
+    dir_valid = 0;
+    return;
+  }
+  if (dir_valid && st.st_mtime == dir_mtime && st.st_ino == dir_ino) {
+    return;
+  }
+  dir_valid = 0;
+  release_snapshot(dir_cache);
+  dir_cache = NULL;
+  if ((snap = calloc(1, sizeof(dir_snapshot))) == NULL) {
+    return;
+  }
+  if ((dir = opendir(".")) == NULL) {
+    free(snap);
+    return;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    struct stat file_stat;
+
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    if (strlen(entry->d_name) > 12) {
+      continue;
+    }
+    if (snap->count == alloc) {
+      dir_entry* p;
+
+      alloc = alloc ? alloc * 2 : 64;
+      p = realloc(snap->entries, alloc * sizeof(dir_entry));
+      if (p == NULL) {
+        break;
+      }
+      snap->entries = p;
+    }
+    strcpy(snap->entries[snap->count].fname, entry->d_name);
+    snap->entries[snap->count].fsize =
+      (stat(entry->d_name, &file_stat) == 0) ? file_stat.st_size : 0;
+    snap->count++;
+  }
+  closedir(dir);
+  snap->refs = 1;
+  dir_cache = snap;
+  dir_mtime = st.st_mtime;
+  dir_ino = st.st_ino;
+  dir_valid = 1;
+}
+
+static int find_cursor(DIR* dir) {
+  int i;
+
+  for (i = 0; i < MAX_DIR_CURSORS; i++) {
+    if (dir_cursor[i].dir == dir) {
+      break;
+    }
+  }
+  return i;
 }
 
 FRESULT f_opendir (
   DIR_* dp,           /* [OUT] Pointer to the directory object structure */
   const TCHAR* path  /* [IN] Directory name */
                    ) {
+  int i;
+
   path = "."; // XXX
   dp->dir = opendir(path);
-  return (dp->dir != NULL) ? FR_OK : FR_DISK_ERR;
+  if (dp->dir == NULL) {
+    return FR_DISK_ERR;
+  }
+  read_dir();
+  if (dir_valid && (i = find_cursor(NULL)) < MAX_DIR_CURSORS) {
+    dir_cursor[i].dir = dp->dir;
+    dir_cursor[i].snap = dir_cache;
+    dir_cursor[i].index = 0;
+    dir_cache->refs++;
+  }
+  return FR_OK;
+}
+
+FRESULT f_closedir (
+  DIR_* dp     /* [IN] Pointer to the directory object */
+                   ) {
+  int i;
+
+  if (dp->dir == NULL) {
+    return FR_OK;
+  }
+  if ((i = find_cursor(dp->dir)) < MAX_DIR_CURSORS) {
+    release_snapshot(dir_cursor[i].snap);
+    dir_cursor[i].dir = NULL;
+    dir_cursor[i].snap = NULL;
+  }
+  closedir(dp->dir);
+  dp->dir = NULL;
+  return FR_OK;
 }
 
 FRESULT f_write (
@@ -75,7 +340,20 @@ FRESULT f_write (
   UINT btw,         /* [IN] Number of bytes to write */
   UINT* bw          /* [OUT] Pointer to the variable to return number of bytes written */
                  ) {
+  mapped_file* m = find_mapped(fp->f);
+
+  if (m != NULL) {
+    if (m->pos <= m->size && btw <= m->size - m->pos && map_intact(m)) {
+      memcpy(m->base + m->pos, buff, btw);
+      mark_dirty(m, m->pos, btw);
+      m->pos += btw;
+      *bw = btw;
+      return FR_OK;
+    }
+    unmap_file(m);
+  }
   *bw = fwrite(buff, 1, btw, fp->f);
+  dir_valid = 0;
   return FR_OK;
 }
 
@@ -85,7 +363,24 @@ FRESULT f_read (
   UINT btr,    /* [IN] Number of bytes to read */
   UINT* br     /* [OUT] Number of bytes read */
                 ) {
-  *br = fread(buff, 1, btr, fp->f);
+  mapped_file* m = find_mapped(fp->f);
+
+  if (m != NULL && !map_intact(m)) {
+    unmap_file(m);
+    m = NULL;
+  }
+  if (m != NULL) {
+    if (m->pos >= m->size) {
+      btr = 0;
+    } else if (btr > m->size - m->pos) {
+      btr = m->size - m->pos;
+    }
+    memcpy(buff, m->base + m->pos, btr);
+    m->pos += btr;
+    *br = btr;
+  } else {
+    *br = fread(buff, 1, btr, fp->f);
+  }
 
   return FR_OK;
 }
@@ -94,55 +389,126 @@ FRESULT f_readdir (
   DIR_* dp,      /* [IN] Directory object */
   FILINFO* fno  /* [OUT] File information structure */
                    ) {
-  FILE* f;
+  dir_snapshot* snap;
+  int i;
+
+  if (dp->dir == NULL) {
+    fno->fname[0] = '\0';
+    return FR_OK;
+  }
+  i = find_cursor(dp->dir);
+  if (i == MAX_DIR_CURSORS) {
+    // No cursor left: read the directory itself
+    while (1) {
+      struct dirent* entry = readdir(dp->dir);
+      struct stat st;
 
-  while (1) {
-    struct dirent* entry = readdir(dp->dir);
-    if (entry == NULL) {
-      closedir(dp->dir);
-      fno->fname[0] = '\0';
+      if (entry == NULL) {
+        f_closedir(dp);
+        fno->fname[0] = '\0';
+        break;
+      }
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+        continue;
+      }
+      if (strlen(entry->d_name) > 12) {
+        continue;
+      }
+      strcpy(fno->fname, entry->d_name);
+      fno->fsize = (stat(fno->fname, &st) == 0) ? st.st_size : 0;
+      fno->fattrib = 1;
       break;
     }
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-      continue;
-    }
-    if (strlen(entry->d_name) > 12) {
-      continue;
-    }
-    strcpy(fno->fname, entry->d_name);
-    f = fopen(fno->fname, "rb");
-    fseek(f, 0L, SEEK_END);
-    fno->fsize = ftell(f);
-    fclose(f);
-    fno->fattrib = 1;
-    break;
+    return FR_OK;
   }
+
+  snap = dir_cursor[i].snap;
+  if (dir_cursor[i].index >= snap->count) {
+    f_closedir(dp);
+    fno->fname[0] = '\0';
+    return FR_OK;
+  }
+  strcpy(fno->fname, snap->entries[dir_cursor[i].index].fname);
+  fno->fsize = snap->entries[dir_cursor[i].index].fsize;
+  fno->fattrib = 1;
+  dir_cursor[i].index++;
   return FR_OK;
 }
 
 FSIZE_t f_tell (
   FIL* fp   /* [IN] File object */
                 ) {
-  assert(0);
+  mapped_file* m = find_mapped(fp->f);
+
+  return (m != NULL) ? m->pos : ftell(fp->f);
 }
 
 FRESULT f_sync (
   FIL* fp     /* [IN] File object */
                 ) {
-  assert(0);
+  mapped_file* m = find_mapped(fp->f);
+
+  if (m != NULL) {
+    return (sync_file(m, 1) == 0) ? FR_OK : FR_DISK_ERR;
+  }
+  return (fflush(fp->f) == 0) ? FR_OK : FR_DISK_ERR;
 }
 
 FRESULT f_lseek (
   FIL*    fp,  /* [IN] File object */
   FSIZE_t ofs  /* [IN] File read/write pointer */
                  ) {
-  fseek(fp->f, ofs, SEEK_SET);
+  mapped_file* m = find_mapped(fp->f);
+
+  if (m != NULL) {
+    /* May be past the end; a write there drops the mapping */
+    m->pos = ofs;
+  } else {
+    fseek(fp->f, ofs, SEEK_SET);
+  }
   return FR_OK;
 }
 
+/*
+ * Allocate fsz bytes for a file about to be written, so it doesn't
+ * grow piecemeal.  As with FatFS, the file size becomes fsz; opt 0
+ * only sets the size, leaving the host to allocate lazily.
+ */
+FRESULT f_expand (
+  FIL*    fp,  /* [IN] File object */
+  FSIZE_t fsz, /* [IN] File size expanded to */
+  BYTE    opt  /* [IN] Allocation mode */
+                 ) {
+  mapped_file* m = find_mapped(fp->f);
+  int result;
+
+  if (m != NULL) {
+    unmap_file(m);
+  }
+  if (fflush(fp->f) != 0) {
+    return FR_DISK_ERR;
+  }
+#if defined(_WIN32) || defined(__APPLE__)
+  result = ftruncate(fileno(fp->f), fsz);
+#else
+  if (opt) {
+    result = posix_fallocate(fileno(fp->f), 0, fsz);
+  } else {
+    result = ftruncate(fileno(fp->f), fsz);
+  }
+#endif
+  dir_valid = 0;
+  return (result == 0) ? FR_OK : FR_DISK_ERR;
+}
+
 FRESULT f_close (
   FIL* fp     /* [IN] Pointer to the file object */
                  ) {
+  mapped_file* m = find_mapped(fp->f);
+
+  if (m != NULL) {
+    unmap_file(m);
+  }
   fclose(fp->f);
   return FR_OK;
 }
@@ -150,6 +516,7 @@ FRESULT f_close (
 FRESULT f_unlink (
         const TCHAR* path  /* [IN] Object name */
 ) {
+    dir_valid = 0;
     return (remove(path) == 0) ? FR_OK : FR_NO_FILE;
 }
 
@@ -157,16 +524,13 @@ FRESULT f_stat (
         const TCHAR* path,  /* [IN] Object name */
         FILINFO* fno        /* [OUT] FILINFO structure */
 ) {
-  FILE* f = fopen(path, "r");
-  if (f == NULL) {
+  struct stat path_stat;
+
+  if (stat(path, &path_stat) != 0) {
     return FR_NO_FILE;
   }
   strcpy(fno->fname, path);
-  fseek(f, 0L, SEEK_END);
-  fno->fsize = ftell(f);
-  fclose(f);
-  struct stat path_stat;
-  stat(path, &path_stat);
+  fno->fsize = path_stat.st_size;
   fno->fattrib = 0;
   if (S_ISDIR(path_stat.st_mode)) {
     fno->fattrib |= AM_DIR;
@@ -179,4 +543,3 @@ void init_socket_io() {
 }
 
 #endif
-
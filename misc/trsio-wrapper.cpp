@@ -13,6 +13,23 @@ uint8_t trsio_z80_in() {
   return TrsIO::inZ80();
 }
 
+int trsio_z80_out_block(const uint8_t *buf, int count, bool *complete) {
+  for (int i = 0; i < count; i++) {
+    if (!TrsIO::outZ80(buf[i])) {
+      *complete = true;
+      return i + 1;
+    }
+  }
+  *complete = false;
+  return count;
+}
+
+void trsio_z80_in_block(uint8_t *buf, int count) {
+  for (int i = 0; i < count; i++) {
+    buf[i] = TrsIO::inZ80();
+  }
+}
+
 void trsio_process_in_background() {
   TrsIO::processInBackground();
 }
@@ -12,6 +12,8 @@ extern "C" {
 
 bool trsio_z80_out(uint8_t byte);
 uint8_t trsio_z80_in();
+int trsio_z80_out_block(const uint8_t *buf, int count, bool *complete);
+void trsio_z80_in_block(uint8_t *buf, int count);
 void trsio_process_in_background();
 
 #ifdef __cplusplus
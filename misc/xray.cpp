@@ -3,6 +3,8 @@
 #include "spi.h"
 #include "retrostore.h"
 #include <assert.h>
+#include <string.h>
+#include <future>
 
 #define MAX_BREAKPOINTS 16
 
@@ -23,11 +25,36 @@ static uint16_t xray_base_addr;
 
 static int breakpoint_idx;
 
+// TRS-IO commands run on a worker thread (see trs_io.c) and change the
+// breakpoints and XRAM through the spi_* calls, while the emulator reads
+// them in xray_mem_read/xray_mem_write.  So the spi_* calls only work on
+// a staged copy, which xray_snapshot() takes before a command starts and
+// xray_publish() merges back once it is done.  Both run on the emulator
+// thread while the worker is idle.
+static struct {
+  uint16_t breakpoints[MAX_BREAKPOINTS];
+  uint16_t set;
+  uint16_t cleared;
+  uint8_t xram_data[256];
+  uint8_t xram_code[256];
+  bool data_dirty[256];
+  bool code_dirty[256];
+} staged;
+
 extern retrostore::RetroStore rs;
 extern retrostore::RsSystemState trs_state;
 extern int trs_state_token;
 
-extern "C" void mem_write(int address, int value);
+extern "C" void mem_write_block(int address, const uint8_t* buf, int count);
+
+// Download a fragment of the state memory in the background
+static std::future<void> fetch_fragment(retrostore::RsMemoryRegion* r,
+                                        int start, int length)
+{
+  return std::async(std::launch::async, [=] {
+    rs.DownloadStateMemoryRange(trs_state_token, start, length, r);
+  });
+}
 
 bool xray_mem_read(uint16_t addr, uint8_t* byte)
 {
@@ -59,7 +86,7 @@ bool xray_mem_read(uint16_t addr, uint8_t* byte)
   if (addr == xray_base_addr) {
     // XRAY debug stub ran once. Now we can copy the memory regions
     state_xray = STATE_XRAY_RUN;
-    spi_clear_breakpoint(breakpoint_idx);
+    active_breakpoints &= ~(1 << breakpoint_idx);
     for (int i = 0; i < trs_state.regions.size(); i++) {
       retrostore::RsMemoryRegion* region = &trs_state.regions[i];
       if (region->start == 0x3c00) {
@@ -69,17 +96,24 @@ bool xray_mem_read(uint16_t addr, uint8_t* byte)
       int start = region->start;
       int left = region->length;
       const int fragment_size = 4096;
+      // Fetch the next fragment while the current one is copied
+      retrostore::RsMemoryRegion fragment[2];
+      int current = 0;
+      std::future<void> pending =
+        fetch_fragment(&fragment[current], start, fragment_size);
       do {
-        retrostore::RsMemoryRegion r;
-        rs.DownloadStateMemoryRange(trs_state_token, start, fragment_size, &r);
-        uint8_t* buf = r.data.get();
-        assert(r.start == start);
-        assert(r.length <= fragment_size);
-        for (int j = 0; j < r.length; j++) {
-          mem_write(start + j, *buf++);
+        retrostore::RsMemoryRegion* r = &fragment[current];
+        pending.get();
+        assert(r->start == start);
+        assert(r->length <= fragment_size);
+        if (left - r->length > 0) {
+          pending = fetch_fragment(&fragment[current ^ 1],
+                                   start + r->length, fragment_size);
         }
-        start += r.length;
-        left -= r.length;
+        mem_write_block(start, r->data.get(), r->length);
+        start += r->length;
+        left -= r->length;
+        current ^= 1;
       } while (left > 0);
     }
     trs_state.regions.clear();
@@ -89,6 +123,12 @@ bool xray_mem_read(uint16_t addr, uint8_t* byte)
   return true;
 }
 
+// Whether xray_mem_read may intercept a read
+bool xray_mem_active(void)
+{
+  return state_xray != STATE_XRAY_RUN || active_breakpoints != 0;
+}
+
 bool xray_mem_write(uint16_t addr, uint8_t byte)
 {
     if (state_xray == STATE_XRAY_RUN) {
@@ -99,33 +139,66 @@ bool xray_mem_write(uint16_t addr, uint8_t byte)
     return true;
 }
 
+void xray_snapshot(void)
+{
+  memcpy(staged.xram_data, xram_data, sizeof(xram_data));
+  memcpy(staged.xram_code, xram_code, sizeof(xram_code));
+  memset(staged.data_dirty, 0, sizeof(staged.data_dirty));
+  memset(staged.code_dirty, 0, sizeof(staged.code_dirty));
+  staged.set = 0;
+  staged.cleared = 0;
+}
+
+void xray_publish(void)
+{
+  for (int i = 0; i < 256; i++) {
+    if (staged.data_dirty[i]) {
+      xram_data[i] = staged.xram_data[i];
+    }
+    if (staged.code_dirty[i]) {
+      xram_code[i] = staged.xram_code[i];
+    }
+  }
+  for (int i = 0; i < MAX_BREAKPOINTS; i++) {
+    if (staged.set & (1 << i)) {
+      breakpoints[i] = staged.breakpoints[i];
+    }
+  }
+  active_breakpoints = (active_breakpoints & ~staged.cleared) | staged.set;
+  xray_snapshot();
+}
+
 void spi_xram_poke_code(uint8_t addr, uint8_t data)
 {
   assert(addr < 256);
-  xram_code[addr] = data;
+  staged.xram_code[addr] = data;
+  staged.code_dirty[addr] = true;
 }
 
 void spi_xram_poke_data(uint8_t addr, uint8_t data)
 {
   assert(addr < 256);
-  xram_data[addr] = data;
+  staged.xram_data[addr] = data;
+  staged.data_dirty[addr] = true;
 }
 
 uint8_t spi_xram_peek_data(uint8_t addr)
 {
   assert(addr < 256);
-  return xram_code[addr];
+  return staged.xram_code[addr];
 }
 
 void spi_set_breakpoint(uint8_t n, uint16_t addr)
 {
   assert(n < MAX_BREAKPOINTS);
-  breakpoints[n] = addr;
-  active_breakpoints |= 1 << n;
+  staged.breakpoints[n] = addr;
+  staged.set |= 1 << n;
+  staged.cleared &= ~(1 << n);
 }
 
 void spi_clear_breakpoint(uint8_t n)
 {
   assert(n < MAX_BREAKPOINTS);
-  active_breakpoints &= ~(1 << n);
+  staged.cleared |= 1 << n;
+  staged.set &= ~(1 << n);
 }
@@ -26,6 +26,9 @@ extern "C" {
 #endif
 bool xray_mem_read(uint16_t addr, uint8_t* byte);
 bool xray_mem_write(uint16_t addr, uint8_t byte);
+bool xray_mem_active(void);
+void xray_snapshot(void);
+void xray_publish(void);
 #ifdef __cplusplus
 }
 #endif
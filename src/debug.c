@@ -50,23 +50,25 @@
 
 #include "error.h"
 #include "trs.h"
+#include "trs_hard.h"
 
 #define MAXLINE		(256)
 #define ADDRESS_SPACE	(0x10000)
 #define MAX_TRAPS	(100)
 
-#define BREAKPOINT_FLAG		(0x1)
-#define TRACE_FLAG		(0x2)
-#define DISASSEMBLE_ON_FLAG	(0x4)
-#define DISASSEMBLE_OFF_FLAG	(0x8)
-#define BREAK_ONCE_FLAG		(0x10)
-#define WATCHPOINT_FLAG		(0x20)
+#define WATCH_READ		(0x1)
+#define WATCH_WRITE		(0x2)
 
-static Uchar *traps;
+Ushort *debug_traps;
+Uchar *debug_read_watch;
+Uchar *debug_write_watch;
+static Uchar read_watch_map[ADDRESS_SPACE / 8];
+static Uchar write_watch_map[ADDRESS_SPACE / 8];
 static int num_traps;
 static int print_instructions;
 static int stop_signaled;
-static unsigned int num_watchpoints = 0;
+static int watch_triggered;
+static int z80_running;
 
 static const char help_message[] =
 
@@ -95,6 +97,10 @@ Running:\n\
         Press the system reset button.  On Model I/III, softreset resets the\n\
         devices and posts a nonmaskable interrupt to the CPU; on Model 4/4P,\n\
         softreset is the same as hard reset.\n\
+    rew(ind)\n\
+    rew(ind) <seconds>\n\
+        Show how many seconds of execution can be undone, or go back the\n\
+        given number of seconds.  Needs the -rewind option.\n\
 Printing:\n\
     (dum)p\n\
         Print the values of the Z80 registers.\n\
@@ -114,8 +120,30 @@ Printing:\n\
         Enable tracing of all instructions.\n\
     tr(ace)off\n\
         Disable tracing.\n\
+    rec(ord) [<entries>] [once]\n\
+        Start recording a binary trace of all instructions into a ring\n\
+        buffer of the given number of entries (default 65536, or the size\n\
+        used before).  With \"once\", recording stops when it is full.\n\
+    rec(ord) off\n\
+    rec(ord) st(atus)\n\
+    rec(ord) save <file>\n\
+        Stop recording, show the recorded entries, or write them to a file\n\
+        to be decoded with the tracedump utility.\n\
     d(isk)d(ump)\n\
         Print the state of the floppy disk controller emulation.\n\
+    h(ard)d(ump)\n\
+        Print the state of the hard disk controller emulation and the\n\
+        statistics of its sector cache.\n\
+    s(ound)d(ump)\n\
+        Print the state of the sound output ring, including underrun and\n\
+        overrun counts and the current latency target.\n\
+    ios(tats)\n\
+    ios(tats) on|off|clear\n\
+    ios(tats) save <file>\n\
+        Print the access counts of the I/O ports and Model I memory mapped\n\
+        devices with the average and shortest T-states between accesses,\n\
+        and the counts of device events; enable, disable or reset counting,\n\
+        or write the counts to a file as JSON.\n\
 Traps:\n\
     st(atus)\n\
         Show all traps (breakpoints, tracepoints, watchpoints).\n\
@@ -135,8 +163,19 @@ Traps:\n\
     traceoff at <address>\n\
     troff <address>\n\
         Set a trap to disable tracing at the specified hex address.\n\
-    w(atch) <address>\n\
-        Set a trap to watch specified hex address for changes.\n\
+    recordon at <address>\n\
+    recon <address>\n\
+        Set a trap to start recording at the specified hex address.\n\
+    recordoff at <address>\n\
+    recoff <address>\n\
+        Set a trap to stop recording at the specified hex address.\n\
+    w(atch) <addr> [r|w|rw] [= <value>]\n\
+    w(atch) <start addr> , <end addr> [r|w|rw] [= <value>]\n\
+        Set a watchpoint on the hex address or range of addresses.  Stops\n\
+        after an instruction reads (r), writes (w, the default) or accesses\n\
+        (rw) it, or only when the byte read or written has the given hex\n\
+        value, and reports the address of that instruction.  Reads include\n\
+        opcode fetches.\n\
 Miscellaneous:\n\
     a(ssign) $<reg> = <value>\n\
     a(ssign) I<port> = <value>\n\
@@ -167,7 +206,9 @@ static struct
     int   valid;
     int   address;
     int   flag;
-    Uchar byte; /* used only by watchpoints */
+    int   end;    /* the following used only by watchpoints */
+    int   access;
+    int   value;  /* -1 = any */
 } trap_table[MAX_TRAPS];
 
 static char *trap_name(int flag)
@@ -182,6 +223,10 @@ static char *trap_name(int flag)
 	return "traceon";
       case DISASSEMBLE_OFF_FLAG:
 	return "traceoff";
+      case RECORD_ON_FLAG:
+	return "recordon";
+      case RECORD_OFF_FLAG:
+	return "recordoff";
       case BREAK_ONCE_FLAG:
 	return "temporary breakpoint";
       case WATCHPOINT_FLAG:
@@ -206,6 +251,36 @@ static void show_zbxinfo(void)
 #endif
 }
 
+/* Rebuild the watchpoint bitmaps from the trap table */
+static void update_watch_maps(void)
+{
+    int i, address;
+
+    memset(read_watch_map, 0, sizeof(read_watch_map));
+    memset(write_watch_map, 0, sizeof(write_watch_map));
+    debug_read_watch = debug_write_watch = NULL;
+
+    for(i = 0; i < MAX_TRAPS; ++i)
+    {
+	if(!trap_table[i].valid || trap_table[i].flag != WATCHPOINT_FLAG)
+	    continue;
+	for(address = trap_table[i].address; address <= trap_table[i].end;
+	    ++address)
+	{
+	    if(trap_table[i].access & WATCH_READ)
+	    {
+		read_watch_map[address >> 3] |= 1 << (address & 7);
+		debug_read_watch = read_watch_map;
+	    }
+	    if(trap_table[i].access & WATCH_WRITE)
+	    {
+		write_watch_map[address >> 3] |= 1 << (address & 7);
+		debug_write_watch = write_watch_map;
+	    }
+	}
+    }
+}
+
 static void clear_all_traps(void)
 {
     int i;
@@ -213,12 +288,12 @@ static void clear_all_traps(void)
     {
 	if(trap_table[i].valid)
 	{
-	    traps[trap_table[i].address] &= ~(trap_table[i].flag);
+	    debug_traps[trap_table[i].address] &= ~(trap_table[i].flag);
 	    trap_table[i].valid = 0;
 	}
     }
     num_traps = 0;
-    num_watchpoints = 0;
+    update_watch_maps();
 }
 
 static void print_traps(void)
@@ -229,7 +304,19 @@ static void print_traps(void)
     {
 	for(i = 0; i < MAX_TRAPS; ++i)
 	{
-	    if(trap_table[i].valid)
+	    if(trap_table[i].valid && trap_table[i].flag == WATCHPOINT_FLAG)
+	    {
+		printf("[%d] %.4x", i, trap_table[i].address);
+		if(trap_table[i].end != trap_table[i].address)
+		    printf("-%.4x", trap_table[i].end);
+		printf(" (%s, %s", trap_name(trap_table[i].flag),
+		       trap_table[i].access == WATCH_READ ? "r" :
+		       trap_table[i].access == WATCH_WRITE ? "w" : "rw");
+		if(trap_table[i].value >= 0)
+		    printf(" = %.2x", trap_table[i].value);
+		printf(")\n");
+	    }
+	    else if(trap_table[i].valid)
 	    {
 		printf("[%d] %.4x (%s)\n", i, trap_table[i].address,
 		       trap_name(trap_table[i].flag));
@@ -258,19 +345,40 @@ static void set_trap(int address, int flag)
 	trap_table[i].valid = 1;
 	trap_table[i].address = address;
 	trap_table[i].flag = flag;
-	if (trap_table[i].flag == WATCHPOINT_FLAG) {
-	    /* Initialize the byte field to current memory contents. */
-	    trap_table[i].byte = mem_read(address);
-	    /* Increment number of set watchpoints. */
-	    num_watchpoints++;
-	}
-	traps[address] |= flag;
+	debug_traps[address] |= flag;
 	num_traps++;
 
 	printf("Set %s [%d] at %.4x\n", trap_name(flag), i, address);
     }
 }
 
+static void set_watch(int start, int end, int access, int value)
+{
+    int i;
+
+    if(num_traps == MAX_TRAPS)
+    {
+	printf("Cannot set more than %d traps.\n", MAX_TRAPS);
+    }
+    else
+    {
+	i = 0;
+	while(trap_table[i].valid) ++i;
+
+	trap_table[i].valid = 1;
+	trap_table[i].address = start;
+	trap_table[i].flag = WATCHPOINT_FLAG;
+	trap_table[i].end = end;
+	trap_table[i].access = access;
+	trap_table[i].value = value;
+	num_traps++;
+	update_watch_maps();
+
+	printf("Set %s [%d] at %.4x-%.4x\n", trap_name(WATCHPOINT_FLAG), i,
+	       start, end);
+    }
+}
+
 static void clear_trap(int i)
 {
     if((i < 0) || (i > MAX_TRAPS) || !trap_table[i].valid)
@@ -279,12 +387,9 @@ static void clear_trap(int i)
     }
     else
     {
-	traps[trap_table[i].address] &= ~(trap_table[i].flag);
+	debug_traps[trap_table[i].address] &= ~(trap_table[i].flag);
 	trap_table[i].valid = 0;
-	if (trap_table[i].flag == WATCHPOINT_FLAG) {
-	    /* Decrement number of set watchpoints. */
-	    num_watchpoints--;
-	}
+	if (trap_table[i].flag == WATCHPOINT_FLAG) update_watch_maps();
 	num_traps--;
 	printf("Cleared %s [%d] at %.4x\n",
 	       trap_name(trap_table[i].flag), i, trap_table[i].address);
@@ -339,16 +444,59 @@ void trs_debug(void)
     if (trs_continuous > 0) trs_continuous = 0;
 }
 
+/*
+ * Called by mem_read and mem_write on accessing a watched address.
+ * Reports the first matching watchpoint and stops after the current
+ * instruction.
+ */
+void debug_watch(int address, int value, int writing)
+{
+    int i;
+
+    /* Ignore the debugger's own accesses */
+    if(!z80_running) return;
+
+    for(i = 0; i < MAX_TRAPS; ++i)
+    {
+	if(trap_table[i].valid && trap_table[i].flag == WATCHPOINT_FLAG &&
+	   address >= trap_table[i].address && address <= trap_table[i].end &&
+	   (trap_table[i].access & (writing ? WATCH_WRITE : WATCH_READ)) &&
+	   (trap_table[i].value < 0 || trap_table[i].value == value))
+	{
+	    printf("Watchpoint [%d]: instruction at %.4x %s %.2x %s %.4x\n",
+		   i, z80_state.op_pc, writing ? "wrote" : "read", value,
+		   writing ? "to" : "from", address);
+	    watch_triggered = 1;
+	    if (trs_continuous > 0) trs_continuous = 0;
+	    return;
+	}
+    }
+}
+
+/* Run the Z80, with watchpoints enabled */
+static int debug_z80_run(int continuous)
+{
+    int ret;
+
+    z80_running = 1;
+    ret = z80_run(continuous);
+    z80_running = 0;
+    return ret;
+}
+
 void debug_init(void)
 {
     int i;
 
-    traps = (Uchar *) malloc(ADDRESS_SPACE * sizeof(Uchar));
-    if (traps == NULL) {
-      trs_sdl_cleanup();
-      fatal("debug_init: failed to allocate traps");
+    /* May have been allocated by the gdb stub already */
+    if (debug_traps == NULL) {
+      debug_traps = (Ushort *) malloc(ADDRESS_SPACE * sizeof(Ushort));
+      if (debug_traps == NULL) {
+	trs_sdl_cleanup();
+	fatal("debug_init: failed to allocate traps");
+      }
+      memset(debug_traps, 0, ADDRESS_SPACE * sizeof(Ushort));
     }
-    memset(traps, 0, ADDRESS_SPACE * sizeof(Uchar));
 
     for(i = 0; i < MAX_TRAPS; ++i) trap_table[i].valid = 0;
 
@@ -395,15 +543,13 @@ static void print_memory(Ushort address, int num_bytes)
 
 static void debug_run(void)
 {
-    Uchar t;
-    Uchar byte;
+    Ushort t;
     int continuous;
-    int i;
-    int watch_triggered = 0;
 
     stop_signaled = 0;
+    watch_triggered = 0;
 
-    t = traps[Z80_PC];
+    t = debug_traps[Z80_PC];
     while(!stop_signaled)
     {
 	if(t)
@@ -421,17 +567,29 @@ static void debug_run(void)
 	    {
 		print_instructions = 0;
 	    }
+	    if(t & RECORD_ON_FLAG)
+	    {
+		debug_trace_resume();
+	    }
+	    if(t & RECORD_OFF_FLAG)
+	    {
+		debug_trace_stop();
+	    }
 	}
 
 	if(print_instructions) disassemble(Z80_PC);
 
-	continuous = (!print_instructions && num_traps == 0);
-	if (z80_run(continuous)) {
+	/*
+	 * z80_run stops by itself at the next breakpoint or trace trap,
+	 * and after an access to a watched address.
+	 */
+	continuous = !print_instructions;
+	if (debug_z80_run(continuous)) {
 	  printf("emt_debug instruction executed.\n");
 	  stop_signaled = 1;
 	}
 
-	t = traps[Z80_PC];
+	t = debug_traps[Z80_PC];
 	if(t & BREAKPOINT_FLAG)
 	{
 	    stop_signaled = 1;
@@ -442,41 +600,10 @@ static void debug_run(void)
 	    clear_trap_address(Z80_PC, BREAK_ONCE_FLAG);
 	}
 
-	/*
-	 * Iterate over the trap list looking for watchpoints only if we
-	 * know there are any to be found.
-	 */
-	if (num_watchpoints)
+	if(watch_triggered)
 	{
-	    for (i = 0; i < MAX_TRAPS; ++i)
-	    {
-		if (trap_table[i].valid &&
-		    trap_table[i].flag == WATCHPOINT_FLAG)
-		{
-		    byte = mem_read(trap_table[i].address);
-		    if (byte != trap_table[i].byte)
-		    {
-			/*
-			 * If a watched memory location has changed, report
-			 * it, update the watch entry in the trap table to
-			 * reflect the new value, and set the
-			 * watch_triggered flag so that we stop after all
-			 * watchpoints have been processed.
-			 */
-			printf("Memory location 0x%.4x changed value from "
-			       "0x%.2x to 0x%.2x.\n", trap_table[i].address,
-			       trap_table[i].byte, byte);
-			trap_table[i].byte = byte;
-			watch_triggered = 1;
-		    }
-		}
-	    }
-	    if (watch_triggered)
-	    {
-		stop_signaled = 1;
-	    }
+	    stop_signaled = 1;
 	}
-
     }
     printf("Stopped at %.4x\n", Z80_PC);
 }
@@ -686,7 +813,7 @@ void debug_shell(void)
 		    set_trap((Z80_PC + 2) % ADDRESS_SPACE, BREAK_ONCE_FLAG);
 		    debug_run();
 		} else {
-		    z80_run((!strcmp(command, "nextint") || !strcmp(command, "ni")) ? 0 : -1);
+		    debug_z80_run((!strcmp(command, "nextint") || !strcmp(command, "ni")) ? 0 : -1);
 		}
 	    }
 	    else if(!strcmp(command, "quit") || !strcmp(command, "q"))
@@ -703,6 +830,24 @@ void debug_shell(void)
 		printf("Pressing reset button.");
 		trs_reset(0);
 	    }
+	    else if(!strcmp(command, "rewind") || !strcmp(command, "rew"))
+	    {
+		int seconds;
+
+		if(sscanf(input, "%*s %d", &seconds) != 1)
+		{
+		    printf("%d seconds available.\n", trs_rewind_available());
+		}
+		else if((seconds = trs_rewind_back(seconds)) < 0)
+		{
+		    printf("Nothing to rewind.\n");
+		}
+		else
+		{
+		    printf("Rewound %d seconds.\n", seconds);
+		    disassemble(Z80_PC);
+		}
+	    }
 	    else if(!strcmp(command, "run") || !strcmp(command, "r"))
 	    {
 		printf("Performing hard reset and running.\n");
@@ -785,11 +930,11 @@ void debug_shell(void)
 	    }
 	    else if(!strcmp(command, "step") || !strcmp(command, "s"))
 	    {
-		z80_run(-1);
+		debug_z80_run(-1);
 	    }
 	    else if(!strcmp(command, "stepint") || !strcmp(command, "si"))
 	    {
-		z80_run(0);
+		debug_z80_run(0);
 	    }
 	    else if(!strcmp(command, "stop") || !strcmp(command, "break") ||
 		    !strcmp(command, "b"))
@@ -849,14 +994,110 @@ void debug_shell(void)
 		    printf("Tracing disabled.\n");
 		}
 	    }
-	    else if(!strcmp(command, "watch") || !strcmp(command, "w"))
+	    else if(!strcmp(command, "record") || !strcmp(command, "rec"))
+	    {
+		char arg[MAXLINE], file[MAXLINE];
+		int entries = 0;
+
+		if(sscanf(input, "%*s %s", arg) != 1 || !strcmp(arg, "once") ||
+		   sscanf(arg, "%d", &entries) == 1)
+		{
+		    if(debug_trace_start(entries, strstr(input, "once") != NULL)
+		       == 0)
+			printf("Recording enabled.\n");
+		}
+		else if(!strcmp(arg, "off"))
+		{
+		    debug_trace_stop();
+		    printf("Recording disabled.\n");
+		}
+		else if(!strcmp(arg, "status") || !strcmp(arg, "st"))
+		{
+		    debug_trace_status();
+		}
+		else if(!strcmp(arg, "save"))
+		{
+		    if(sscanf(input, "%*s %*s %s", file) == 1)
+		    {
+			if(debug_trace_save(file) == 0)
+			    printf("Trace written to %s.\n", file);
+		    }
+		    else
+		    {
+			printf("Syntax error.  (Type \"h(elp)\" for commands.)\n");
+		    }
+		}
+		else
+		{
+		    printf("Syntax error.  (Type \"h(elp)\" for commands.)\n");
+		}
+	    }
+	    else if(!strcmp(command, "recordon") || !strcmp(command, "recon"))
 	    {
 		unsigned int address;
 
-		if(sscanf(input, "%*s %x", &address) == 1)
+		if(sscanf(input, "recordon at %x", &address) == 1 ||
+		   sscanf(input, "recon %x", &address) == 1)
+		{
+		    set_trap(address, RECORD_ON_FLAG);
+		}
+		else
 		{
-		    address %= ADDRESS_SPACE;
-		    set_trap(address, WATCHPOINT_FLAG);
+		    printf("Syntax error.  (Type \"h(elp)\" for commands.)\n");
+		}
+	    }
+	    else if(!strcmp(command, "recordoff") || !strcmp(command, "recoff"))
+	    {
+		unsigned int address;
+
+		if(sscanf(input, "recordoff at %x", &address) == 1 ||
+		   sscanf(input, "recoff %x", &address) == 1)
+		{
+		    set_trap(address, RECORD_OFF_FLAG);
+		}
+		else
+		{
+		    printf("Syntax error.  (Type \"h(elp)\" for commands.)\n");
+		}
+	    }
+	    else if(!strcmp(command, "watch") || !strcmp(command, "w"))
+	    {
+		char *p = input, *args;
+		unsigned int start, end;
+		int access = WATCH_WRITE, value = -1;
+
+		while(isspace((unsigned char)*p)) ++p;
+		while(*p && !isspace((unsigned char)*p)) ++p;
+		args = p;
+		start = end = strtoul(args, &p, 16) % ADDRESS_SPACE;
+		while(isspace((unsigned char)*p)) ++p;
+		if(*p == ',')
+		{
+		    end = strtoul(p + 1, &p, 16) % ADDRESS_SPACE;
+		    while(isspace((unsigned char)*p)) ++p;
+		}
+		if(!strncmp(p, "rw", 2))
+		{
+		    access = WATCH_READ | WATCH_WRITE;
+		    p += 2;
+		}
+		else if(*p == 'r' || *p == 'w')
+		{
+		    access = (*p++ == 'r') ? WATCH_READ : WATCH_WRITE;
+		}
+		while(isspace((unsigned char)*p)) ++p;
+		if(*p == '=')
+		{
+		    value = strtoul(p + 1, &p, 16) & 0xFF;
+		    while(isspace((unsigned char)*p)) ++p;
+		}
+		if(p == args || *p || end < start)
+		{
+		    printf("Syntax error.  (Type \"h(elp)\" for commands.)\n");
+		}
+		else
+		{
+		    set_watch(start, end, access, value);
 		}
 	    }
 	    else if(!strcmp(command, "timeroff"))
@@ -873,6 +1114,48 @@ void debug_shell(void)
 	    {
 		trs_disk_debug();
 	    }
+	    else if(!strcmp(command, "harddump") || !strcmp(command, "hd"))
+	    {
+		trs_hard_debug();
+	    }
+	    else if(!strcmp(command, "sounddump") || !strcmp(command, "sd"))
+	    {
+		trs_sound_debug();
+	    }
+	    else if(!strcmp(command, "iostats") || !strcmp(command, "ios"))
+	    {
+		char arg[MAXLINE], file[MAXLINE];
+
+		if(sscanf(input, "%*s %s", arg) != 1)
+		{
+		    trs_iostats_debug();
+		}
+		else if(!strcmp(arg, "on"))
+		{
+		    trs_iostats = 1;
+		    printf("I/O statistics enabled.\n");
+		}
+		else if(!strcmp(arg, "off"))
+		{
+		    trs_iostats = 0;
+		    printf("I/O statistics disabled.\n");
+		}
+		else if(!strcmp(arg, "clear"))
+		{
+		    trs_iostats_clear();
+		    printf("I/O statistics cleared.\n");
+		}
+		else if(!strcmp(arg, "save") &&
+			sscanf(input, "%*s %*s %s", file) == 1)
+		{
+		    if(trs_iostats_save(file) == 0)
+			printf("I/O statistics written to %s.\n", file);
+		}
+		else
+		{
+		    printf("Syntax error.  (Type \"h(elp)\" for commands.)\n");
+		}
+	    }
 	    else if(!strcmp(command, "diskdebug"))
 	    {
 		trs_disk_debug_flags = 0;
@@ -0,0 +1,568 @@
+/*
+ * Copyright (C) 2006-2011, Mark Grebe
+ * Copyright (C) 2018-2021, Jens Guenther
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * debug_gdb.c -- GDB remote serial protocol stub
+ *
+ * With -gdb <port> or -gdb <socket> the emulator waits for a debugger
+ * on the TCP port of localhost or on the Unix domain socket before
+ * running.  Supported are reading and writing registers and memory,
+ * continue, single step and breakpoints (Z0/Z1), which use the trap
+ * array of zbx with a flag of their own.  A break character from the
+ * debugger stops the running emulator at the next timer interrupt.
+ *
+ * The registers are 16 bits each, in the order of the Z80 target of
+ * GDB: AF, BC, DE, HL, SP, PC, IX, IY, AF', BC', DE', HL' and IR.
+ */
+
+#ifdef ZBX
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#include "error.h"
+#include "trs.h"
+
+#define GDB_BUFFER	(4096)
+#define GDB_REGS	(13)
+#define SIGINT_STOP	"S02"
+#define SIGTRAP_STOP	"S05"
+
+char debug_gdb_socket[FILENAME_MAX];
+
+#ifndef _WIN32
+static int gdb_fd = -1;
+static int gdb_running;
+static int gdb_interrupted;
+static char packet[GDB_BUFFER];
+static char reply[GDB_BUFFER];
+static Uchar input[GDB_BUFFER]; /* read while the Z80 was running */
+static int input_start, input_end;
+static const char hex[] = "0123456789abcdef";
+
+static Ushort *gdb_reg(int n)
+{
+  switch (n) {
+    case 0:  return &Z80_AF;
+    case 1:  return &Z80_BC;
+    case 2:  return &Z80_DE;
+    case 3:  return &Z80_HL;
+    case 4:  return &Z80_SP;
+    case 5:  return &Z80_PC;
+    case 6:  return &Z80_IX;
+    case 7:  return &Z80_IY;
+    case 8:  return &Z80_AF_PRIME;
+    case 9:  return &Z80_BC_PRIME;
+    case 10: return &Z80_DE_PRIME;
+    case 11: return &Z80_HL_PRIME;
+    default: return NULL;
+  }
+}
+
+static int get_reg(int n)
+{
+  if (n == 12)
+    return (Z80_I << 8) | Z80_R7 | (Z80_R & 0x7F);
+  return *gdb_reg(n);
+}
+
+static void set_reg(int n, int value)
+{
+  if (n == 12) {
+    Z80_I = value >> 8;
+    Z80_R = value & 0xFF;
+    Z80_R7 = value & 0x80;
+  } else {
+    *gdb_reg(n) = value;
+  }
+}
+
+static int hex_digit(int c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c = tolower(c);
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+/* Parse up to count hex bytes, return the number parsed */
+static int get_bytes(const char *p, Uchar *bytes, int count)
+{
+  int n;
+
+  for (n = 0; n < count; n++) {
+    int const high = hex_digit(p[2 * n]);
+    int const low = high < 0 ? -1 : hex_digit(p[2 * n + 1]);
+
+    if (low < 0)
+      break;
+    bytes[n] = (high << 4) | low;
+  }
+  return n;
+}
+
+static char *put_byte(char *p, int byte)
+{
+  *p++ = hex[(byte >> 4) & 0xF];
+  *p++ = hex[byte & 0xF];
+  return p;
+}
+
+/* Registers are sent in target byte order, little-endian */
+static char *put_word(char *p, int word)
+{
+  return put_byte(put_byte(p, word), word >> 8);
+}
+
+static int get_word(const char *p, int *word)
+{
+  Uchar bytes[2];
+
+  if (get_bytes(p, bytes, 2) != 2)
+    return -1;
+  *word = bytes[0] | (bytes[1] << 8);
+  return 0;
+}
+
+static int get_char(void)
+{
+  Uchar c;
+
+  if (input_start < input_end)
+    return input[input_start++];
+  for (;;) {
+    int const n = read(gdb_fd, &c, 1);
+
+    if (n == 1)
+      return c;
+    if (n < 0 && errno == EINTR)
+      continue;
+    return -1;
+  }
+}
+
+static int put_data(const char *data, int len)
+{
+  while (len > 0) {
+    int const n = write(gdb_fd, data, len);
+
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Send a packet and wait for it to be acknowledged */
+static int put_packet(const char *data)
+{
+  char trailer[3];
+  int sum = 0, len = strlen(data), i;
+
+  for (i = 0; i < len; i++)
+    sum += (Uchar)data[i];
+  trailer[0] = '#';
+  put_byte(trailer + 1, sum);
+
+  for (;;) {
+    int c;
+
+    if (put_data("$", 1) < 0 || put_data(data, len) < 0 ||
+        put_data(trailer, 3) < 0)
+      return -1;
+    do {
+      if ((c = get_char()) < 0)
+        return -1;
+    } while (c != '+' && c != '-');
+    if (c == '+')
+      return 0;
+  }
+}
+
+/* Receive a packet into the buffer; break characters are ignored */
+static int get_packet(void)
+{
+  for (;;) {
+    int c, len = 0, sum = 0;
+    char digits[2];
+    Uchar check;
+
+    do {
+      if ((c = get_char()) < 0)
+        return -1;
+    } while (c != '$');
+
+    while ((c = get_char()) != '#') {
+      if (c < 0)
+        return -1;
+      if (len < GDB_BUFFER - 1)
+        packet[len++] = c;
+      sum += c;
+    }
+    packet[len] = 0;
+    for (c = 0; c < 2; c++) {
+      int const digit = get_char();
+
+      if (digit < 0)
+        return -1;
+      digits[c] = digit;
+    }
+    if (get_bytes(digits, &check, 1) == 1 && check == (sum & 0xFF))
+      return put_data("+", 1);
+    if (put_data("-", 1) < 0)
+      return -1;
+  }
+}
+
+static void set_breakpoint(int address, int set)
+{
+  if (set)
+    debug_traps[address & 0xFFFF] |= GDB_BREAK_FLAG;
+  else
+    debug_traps[address & 0xFFFF] &= ~GDB_BREAK_FLAG;
+}
+
+/*
+ * Read what the debugger sent while the Z80 was running into input,
+ * for get_packet.  Return 1 on a break character, -1 on hangup.
+ */
+static int gdb_drain(void)
+{
+  struct pollfd pfd;
+
+  if (input_start == input_end)
+    input_start = input_end = 0;
+  pfd.fd = gdb_fd;
+  pfd.events = POLLIN;
+  while (poll(&pfd, 1, 0) > 0) {
+    int n;
+
+    if (input_end == GDB_BUFFER)
+      return 1;  /* stop to make room */
+    n = read(gdb_fd, input + input_end, GDB_BUFFER - input_end);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    for (; n > 0; n--, input_end++) {
+      if (input[input_end] == 0x03) {
+        /* Whatever came before it is stale */
+        input_start = input_end = 0;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Run until a trap, emt_debug or a break from the debugger.  Return
+ * NULL if the debugger hung up.
+ */
+static const char *gdb_continue(void)
+{
+  for (;;) {
+    gdb_interrupted = 0;
+    gdb_running = 1;
+    if (z80_run(TRUE)) {
+      gdb_running = 0;
+      return SIGTRAP_STOP;
+    }
+    gdb_running = 0;
+    if (!gdb_interrupted)
+      return SIGTRAP_STOP;
+    switch (gdb_drain()) {
+      case 1:
+        return SIGINT_STOP;
+      case -1:
+        return NULL;
+    }
+  }
+}
+
+/* Handle the packet in the buffer, return 1 to leave the stub */
+static int gdb_command(void)
+{
+  char *p = reply;
+  char *args = packet + 1;
+  unsigned long address, length, reg;
+  int n, value;
+
+  reply[0] = 0;
+  switch (packet[0]) {
+    case '?':
+      strcpy(reply, SIGTRAP_STOP);
+      break;
+
+    case 'g':
+      for (n = 0; n < GDB_REGS; n++)
+        p = put_word(p, get_reg(n));
+      *p = 0;
+      break;
+
+    case 'G':
+      for (n = 0; n < GDB_REGS; n++) {
+        if (get_word(args + 4 * n, &value) < 0)
+          break;
+        set_reg(n, value);
+      }
+      strcpy(reply, "OK");
+      break;
+
+    case 'p':
+      reg = strtoul(args, NULL, 16);
+      if (reg < GDB_REGS) {
+        *put_word(p, get_reg(reg)) = 0;
+      } else {
+        strcpy(reply, "E01");
+      }
+      break;
+
+    case 'P':
+      reg = strtoul(args, &args, 16);
+      if (reg < GDB_REGS && *args == '=' && get_word(args + 1, &value) == 0) {
+        set_reg(reg, value);
+        strcpy(reply, "OK");
+      } else {
+        strcpy(reply, "E01");
+      }
+      break;
+
+    case 'm':
+      address = strtoul(args, &args, 16);
+      length = (*args == ',') ? strtoul(args + 1, NULL, 16) : 0;
+      if (length > (GDB_BUFFER - 8) / 2)
+        length = (GDB_BUFFER - 8) / 2;
+      while (length--)
+        p = put_byte(p, mem_read(address++));
+      *p = 0;
+      break;
+
+    case 'M':
+      address = strtoul(args, &args, 16);
+      length = (*args == ',') ? strtoul(args + 1, &args, 16) : 0;
+      if (*args != ':') {
+        strcpy(reply, "E01");
+        break;
+      }
+      for (args++; length > 0; length--, args += 2) {
+        Uchar byte;
+
+        if (get_bytes(args, &byte, 1) != 1)
+          break;
+        mem_write(address++, byte);
+      }
+      strcpy(reply, "OK");
+      break;
+
+    case 'c':
+    case 's':
+      if (*args)
+        Z80_PC = strtoul(args, NULL, 16);
+      if (packet[0] == 's') {
+        z80_run(-1);
+        strcpy(reply, SIGTRAP_STOP);
+      } else {
+        const char *stop = gdb_continue();
+
+        /* On hangup detach, and the emulator carries on */
+        if (stop == NULL)
+          return 1;
+        strcpy(reply, stop);
+      }
+      break;
+
+    case 'Z':
+    case 'z':
+      /* Software and hardware breakpoints are the same here */
+      if ((args[0] == '0' || args[0] == '1') && args[1] == ',') {
+        set_breakpoint(strtoul(args + 2, NULL, 16), packet[0] == 'Z');
+        strcpy(reply, "OK");
+      }
+      break;
+
+    case 'H':
+      strcpy(reply, "OK");
+      break;
+
+    case 'q':
+      if (!strncmp(args, "Supported", 9))
+        snprintf(reply, sizeof(reply), "PacketSize=%x", GDB_BUFFER - 8);
+      else if (!strcmp(args, "Attached"))
+        strcpy(reply, "1");
+      else if (!strcmp(args, "C"))
+        strcpy(reply, "QC1");
+      break;
+
+    case 'D':
+      put_packet("OK");
+      return 1;
+
+    case 'k':
+      trs_exit(0);
+      break;
+
+    default:
+      break;
+  }
+  return put_packet(reply) < 0;
+}
+
+static int gdb_listen(void)
+{
+  char *end;
+  long const port = strtol(debug_gdb_socket, &end, 10);
+  int fd;
+
+  if (*end == 0) {
+    struct sockaddr_in addr;
+    int const on = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+      return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+      goto fail;
+  } else {
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(debug_gdb_socket) >= sizeof(addr.sun_path))
+      return -1;
+    strcpy(addr.sun_path, debug_gdb_socket);
+    unlink(debug_gdb_socket);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+      return -1;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+      goto fail;
+  }
+  if (listen(fd, 1) < 0)
+    goto fail;
+  return fd;
+
+fail:
+  {
+    /* Keep the reason for the caller's message */
+    int const saved = errno;
+
+    close(fd);
+    errno = saved;
+  }
+  return -1;
+}
+
+/*
+ * Wait for a debugger to connect and serve it until it detaches.  The
+ * emulator then continues normally.
+ */
+void debug_gdb_serve(void)
+{
+  int const listen_fd = gdb_listen();
+  int address;
+
+  if (listen_fd < 0) {
+    error("gdb: failed to listen on %s: %s", debug_gdb_socket,
+          strerror(errno));
+    return;
+  }
+  if (debug_traps == NULL &&
+      (debug_traps = (Ushort *)calloc(Z80_ADDRESS_LIMIT,
+                                       sizeof(Ushort))) == NULL) {
+    trs_sdl_cleanup();
+    fatal("debug_gdb_serve: failed to allocate traps");
+  }
+
+  printf("Waiting for gdb on %s.\n", debug_gdb_socket);
+  while ((gdb_fd = accept(listen_fd, NULL, NULL)) < 0) {
+    if (errno != EINTR) {
+      error("gdb: accept failed: %s", strerror(errno));
+      close(listen_fd);
+      return;
+    }
+  }
+  close(listen_fd);
+
+  while (get_packet() == 0 && gdb_command() == 0)
+    ;
+
+  close(gdb_fd);
+  gdb_fd = -1;
+  input_start = input_end = 0;
+  for (address = 0; address < Z80_ADDRESS_LIMIT; address++)
+    debug_traps[address] &= ~GDB_BREAK_FLAG;
+  printf("gdb detached.\n");
+}
+
+/* Stop a continue on a break character, checked once per timer interrupt */
+void debug_gdb_tick(void)
+{
+  struct pollfd pfd;
+
+  if (!gdb_running)
+    return;
+  pfd.fd = gdb_fd;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, 0) > 0) {
+    gdb_interrupted = 1;
+    if (trs_continuous > 0) trs_continuous = 0;
+  }
+}
+
+#else /* _WIN32 */
+
+void debug_gdb_serve(void)
+{
+  error("gdb stub not supported on this platform");
+}
+
+void debug_gdb_tick(void)
+{
+}
+
+#endif
+#endif
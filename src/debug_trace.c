@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2006-2011, Mark Grebe
+ * Copyright (C) 2018-2021, Jens Guenther
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * debug_trace.c -- binary instruction trace ring for zbx
+ *
+ * While recording, z80_run stores one fixed size entry per instruction
+ * in the ring buffer (see debug_trace.h).  The opcode bytes are taken
+ * through mem_pointer, so recording neither triggers watchpoints nor
+ * touches memory mapped I/O.
+ */
+
+#ifdef ZBX
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "error.h"
+#include "trs.h"
+#include "debug_trace.h"
+
+#define TRACE_DEFAULT	(65536)
+
+int debug_tracing;
+
+static Uchar *trace_ring;
+static int trace_size;	/* entries */
+static int trace_next;
+static int trace_count;
+static int trace_once;	/* stop when full instead of wrapping */
+static tstate_t trace_last;
+
+#define PUT16(p, v)	((p)[0] = (v), (p)[1] = (v) >> 8)
+
+void debug_trace_record(void)
+{
+  Uchar *entry = trace_ring + trace_next * TRACE_ENTRY_SIZE;
+  unsigned int const pc = Z80_PC;
+  unsigned int const delta = z80_state.t_count - trace_last;
+  Uchar const *op;
+
+  /* The memory map changes on 32 byte boundaries at most */
+  if ((pc & 0x1F) <= 0x1C && (op = mem_pointer(pc, 0)) != NULL) {
+    memcpy(entry + TRACE_OP, op, 4);
+  } else {
+    int i;
+
+    for (i = 0; i < 4; i++) {
+      op = mem_pointer(pc + i, 0);
+      entry[TRACE_OP + i] = op ? *op : 0xFF;
+    }
+  }
+  PUT16(entry + TRACE_PC, pc);
+  PUT16(entry + TRACE_AF, Z80_AF);
+  PUT16(entry + TRACE_BC, Z80_BC);
+  PUT16(entry + TRACE_DE, Z80_DE);
+  PUT16(entry + TRACE_HL, Z80_HL);
+  PUT16(entry + TRACE_SP, Z80_SP);
+  PUT16(entry + TRACE_TSTATES, delta);
+  PUT16(entry + TRACE_TSTATES + 2, delta >> 16);
+  trace_last = z80_state.t_count;
+
+  if (trace_count < trace_size)
+    trace_count++;
+  if (++trace_next == trace_size) {
+    trace_next = 0;
+    if (trace_once)
+      debug_tracing = 0;
+  }
+}
+
+/* Start recording into an empty ring, of the previous size if entries is 0 */
+int debug_trace_start(int entries, int once)
+{
+  if (entries <= 0)
+    entries = trace_size ? trace_size : TRACE_DEFAULT;
+  if (entries != trace_size) {
+    Uchar *ring = (Uchar *)realloc(trace_ring,
+                                   (size_t)entries * TRACE_ENTRY_SIZE);
+
+    if (ring == NULL) {
+      error("failed to allocate trace of %d entries", entries);
+      return -1;
+    }
+    trace_ring = ring;
+    trace_size = entries;
+  }
+  trace_once = once;
+  trace_next = trace_count = 0;
+  trace_last = z80_state.t_count;
+  debug_tracing = 1;
+  return 0;
+}
+
+/* Continue recording into the ring, e.g. at a recordon trap */
+int debug_trace_resume(void)
+{
+  if (trace_ring == NULL)
+    return debug_trace_start(0, 0);
+  trace_last = z80_state.t_count;
+  debug_tracing = 1;
+  return 0;
+}
+
+void debug_trace_stop(void)
+{
+  debug_tracing = 0;
+}
+
+void debug_trace_status(void)
+{
+  if (trace_ring == NULL) {
+    printf("No trace recorded.\n");
+    return;
+  }
+  printf("Trace %s: %d of %d entries%s.\n",
+         debug_tracing ? "recording" : "stopped", trace_count, trace_size,
+         trace_once ? ", stops when full" : "");
+}
+
+int debug_trace_save(const char *filename)
+{
+  FILE *file;
+  Uchar header[TRACE_HEADER_SIZE];
+  int const first = trace_count < trace_size ? 0 : trace_next;
+  int const tail = trace_count - first;
+
+  if ((file = fopen(filename, "wb")) == NULL) {
+    error("failed to open %s: %s", filename, strerror(errno));
+    return -1;
+  }
+  memcpy(header, TRACE_MAGIC, 4);
+  PUT16(header + 4, trace_count);
+  PUT16(header + 6, trace_count >> 16);
+  if (fwrite(header, sizeof(header), 1, file) != 1 ||
+      (tail > 0 && fwrite(trace_ring + first * TRACE_ENTRY_SIZE,
+                          TRACE_ENTRY_SIZE, tail, file) != (size_t)tail) ||
+      (first > 0 && fwrite(trace_ring, TRACE_ENTRY_SIZE, first, file) !=
+                    (size_t)first)) {
+    error("failed to write %s: %s", filename, strerror(errno));
+    fclose(file);
+    return -1;
+  }
+  fclose(file);
+  return 0;
+}
+#endif
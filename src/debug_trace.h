@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2006-2011, Mark Grebe
+ * Copyright (C) 2018-2021, Jens Guenther
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Binary instruction trace, recorded by zbx and decoded by tracedump.
+ *
+ * A trace file starts with the magic "ZTR1" and the number of entries
+ * as 32-bit little-endian value.  Each entry has a fixed size and holds
+ * the state before the instruction; all values are little-endian.
+ */
+
+#ifndef _DEBUG_TRACE_H
+#define _DEBUG_TRACE_H
+
+#define TRACE_MAGIC		"ZTR1"
+#define TRACE_HEADER_SIZE	(8)
+
+#define TRACE_PC		(0)	/* program counter */
+#define TRACE_OP		(2)	/* 4 bytes at the program counter */
+#define TRACE_AF		(6)
+#define TRACE_BC		(8)
+#define TRACE_DE		(10)
+#define TRACE_HL		(12)
+#define TRACE_SP		(14)
+#define TRACE_TSTATES		(16)	/* 32 bits, since the previous entry */
+#define TRACE_ENTRY_SIZE	(20)
+
+#define TRACE_GET16(p)	((p)[0] | ((p)[1] << 8))
+#define TRACE_GET32(p)	((p)[0] | ((p)[1] << 8) | ((p)[2] << 16) | \
+			 ((unsigned int)(p)[3] << 24))
+
+#endif /* _DEBUG_TRACE_H */
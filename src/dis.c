@@ -43,6 +43,8 @@
  */
 
 #ifdef ZBX
+#include <stdlib.h>
+#include <string.h>
 #include "z80.h"
 
 /* Argument printing */
@@ -2094,24 +2096,27 @@ static struct opcode minor[6][256] = {
     }
 };
 
-int disassemble(unsigned short pc)
+/*
+ * Decode the instruction in buf, which holds at least 4 bytes from pc.
+ * Reentrant; returns the length of the instruction.
+ */
+int dis_decode(const Uchar *buf, int pc, struct dis_insn *insn)
 {
-    int	i, j;
-    struct opcode	*code;
-    int	addr;
+    int	i, j, n = 0;
+    const struct opcode	*code;
+    const char	*p;
 
-    addr = pc;
-    i = mem_read(pc++);
+    i = buf[n++];
     if (!major[i].name)
     {
 	j = major[i].args;
-	i = mem_read(pc++);
+	i = buf[n++];
 	if (!minor[j][i].name)
 	{
 	    /* dd cb or fd cb; offset comes *before* instruction */
 	    j = minor[j][i].args;
-            pc++; /* skip over offset */
-	    i = mem_read(pc++);
+	    n++; /* skip over offset */
+	    i = buf[n++];
 	}
 	code = &minor[j][i];
     }
@@ -2119,35 +2124,174 @@ int disassemble(unsigned short pc)
     {
 	code = &major[i];
     }
-    printf ("%04x  ", addr);
-    for (i = 0; i < ((pc + arglen(code->args) - addr) & 0xffff); i++)
-	printf("%02x ", mem_read(addr + i));
-    for (; i < 4; i++)
-	printf("   ");
-    printf(" ");
+
+    insn->pc = pc & 0xffff;
+    insn->target = -1;
     switch (code->args) {
       case A_16: /* 16-bit number */
-	printf (code->name, mem_read(pc + 1), mem_read(pc));
+	snprintf(insn->text, sizeof(insn->text), code->name, buf[n + 1],
+		 buf[n]);
+	if (!strncmp(code->name, "jp\t", 3) ||
+	    !strncmp(code->name, "call\t", 5))
+	    insn->target = buf[n] | (buf[n + 1] << 8);
 	break;
       case A_8X2: /* Two 8-bit numbers */
-	printf (code->name, mem_read(pc), mem_read(pc + 1));
+	snprintf(insn->text, sizeof(insn->text), code->name, buf[n],
+		 buf[n + 1]);
 	break;
       case A_8:  /* One 8-bit number */
-	printf (code->name, mem_read(pc));
+	snprintf(insn->text, sizeof(insn->text), code->name, buf[n]);
 	break;
       case A_8P: /* One 8-bit number before last opcode byte */
-	printf (code->name, mem_read(pc - 2));
+	snprintf(insn->text, sizeof(insn->text), code->name, buf[n - 2]);
 	break;
       case A_0:  /* No args */
       case A_0B: /* No args, backskip over last opcode byte */
-	fputs (code->name, stdout);
+	snprintf(insn->text, sizeof(insn->text), "%s", code->name);
+	if (!strncmp(code->name, "rst\t", 4))
+	    insn->target = i & 0x38;
 	break;
       case A_8R: /* One 8-bit relative address */
-	printf (code->name, (pc + 1 + (signed char) mem_read(pc)) & 0xffff);
+	insn->target = (pc + n + 1 + (signed char) buf[n]) & 0xffff;
+	snprintf(insn->text, sizeof(insn->text), code->name, insn->target);
 	break;
     }
-    putchar ('\n');
-    pc += arglen(code->args);
-    return pc;  /* return the location of the next instruction */
+    insn->length = (n + arglen(code->args)) & 0xffff;
+    memcpy(insn->bytes, buf, 4);
+
+    /* Split off the mnemonic and the operands, without comment */
+    for (p = insn->text, i = 0; *p && *p != '\t'; p++)
+	if (i < (int)sizeof(insn->mnemonic) - 1)
+	    insn->mnemonic[i++] = *p;
+    insn->mnemonic[i] = 0;
+    if (*p == '\t')
+	p++;
+    for (i = 0; *p && *p != '\t'; p++)
+	if (i < (int)sizeof(insn->operands) - 1)
+	    insn->operands[i++] = *p;
+    insn->operands[i] = 0;
+    return insn->length;
+}
+
+/* Format a listing line of the instruction, as printed by disassemble */
+int dis_format(const struct dis_insn *insn, char *out, int size)
+{
+    char	bytes[16];
+    int	i;
+
+    for (i = 0; i < 4; i++)
+    {
+	if (i < insn->length)
+	    snprintf(bytes + 3 * i, 4, "%02x ", insn->bytes[i]);
+	else
+	    strcpy(bytes + 3 * i, "   ");
+    }
+    return snprintf(out, size, "%04x  %s %s", insn->pc, bytes, insn->text);
+}
+
+/*
+ * Decode cache for the debugger.  Up to DIS_CACHE_PAGES pages of 256
+ * entries are allocated as needed, and reused in turn once they run
+ * out.  A page is kept for as long as the generation counter of the
+ * memory behind it stays the same, and dropped whenever mem_epoch
+ * changes.  Pages that aren't plain RAM or ROM aren't cached.
+ */
+#define DIS_CACHE_PAGES	16
+
+struct dis_page
+{
+    int	z80_page;	/* -1 if unused */
+    unsigned	epoch;
+    const unsigned	*gen;
+    unsigned	gen_seen;
+    Uchar	valid[256 / 8];
+    struct dis_insn	insn[256];
+};
+
+static struct dis_page	*dis_pages[DIS_CACHE_PAGES];
+static Uchar	dis_slot[256];	/* index into dis_pages + 1, 0 if none */
+static int	dis_next;
+
+static struct dis_page *dis_page_alloc(int z80_page)
+{
+    struct dis_page	*page;
+    int	i = dis_next;
+
+    dis_next = (dis_next + 1) % DIS_CACHE_PAGES;
+    if (dis_pages[i] == NULL)
+    {
+	dis_pages[i] = (struct dis_page *) malloc(sizeof(struct dis_page));
+	if (dis_pages[i] == NULL)
+	    return NULL;
+    }
+    else if (dis_pages[i]->z80_page >= 0)
+	dis_slot[dis_pages[i]->z80_page] = 0;
+    page = dis_pages[i];
+    page->z80_page = z80_page;
+    dis_slot[z80_page] = i + 1;
+    return page;
+}
+
+const struct dis_insn *dis_decode_cached(unsigned short pc)
+{
+    static struct dis_insn	temp;
+    struct dis_page	*page = NULL;
+    struct dis_insn	*insn = &temp;
+    Uchar	buf[4];
+    int	i;
+
+    /* The last few may run into the next page */
+    if ((pc & 0xff) <= 0xfc)
+    {
+	if (dis_slot[pc >> 8])
+	{
+	    page = dis_pages[dis_slot[pc >> 8] - 1];
+	    if (page->epoch != mem_epoch)
+	    {
+		dis_slot[pc >> 8] = 0;
+		page->z80_page = -1;
+		page = NULL;
+	    }
+	}
+	if (page == NULL)
+	{
+	    const unsigned	*gen = mem_page_gen(pc);
+
+	    if (gen != NULL && (page = dis_page_alloc(pc >> 8)) != NULL)
+	    {
+		page->epoch = mem_epoch;
+		page->gen = gen;
+		page->gen_seen = *gen;
+		memset(page->valid, 0, sizeof(page->valid));
+	    }
+	}
+	else if (*page->gen != page->gen_seen)
+	{
+	    page->gen_seen = *page->gen;
+	    memset(page->valid, 0, sizeof(page->valid));
+	}
+    }
+
+    if (page != NULL)
+    {
+	insn = &page->insn[pc & 0xff];
+	if (page->valid[(pc & 0xff) >> 3] & (1 << (pc & 7)))
+	    return insn;
+	page->valid[(pc & 0xff) >> 3] |= 1 << (pc & 7);
+    }
+    for (i = 0; i < 4; i++)
+	buf[i] = mem_read(pc + i);
+    dis_decode(buf, pc, insn);
+    return insn;
+}
+
+int disassemble(unsigned short pc)
+{
+    const struct dis_insn	*insn = dis_decode_cached(pc);
+    char	line[64];
+
+    dis_format(insn, line, sizeof(line));
+    puts(line);
+    return (pc + insn->length) & 0xffff;  /* the location of the next instruction */
 }
 #endif
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2006-2011, Mark Grebe
+ * Copyright (C) 2018-2021, Jens Guenther
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * hdsparse: convert hard disk images between Matthew Reed's format
+ * and the sparse container format (see trs_sparse.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "error.h"
+#include "trs_sparse.h"
+
+char *program_name;
+
+static void usage(void)
+{
+  fprintf(stderr,
+          "Usage: %s [-z] [-f fill] reed-image sparse-image\n"
+          "       %s -x sparse-image reed-image\n"
+          "  -z       compress stored blocks\n"
+          "  -f fill  byte value of unwritten sectors (default 0x00)\n"
+          "  -x       convert sparse image back to Reed format\n",
+          program_name, program_name);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+  int c, extract = 0, flags = 0, fill = 0;
+
+  program_name = strrchr(argv[0], '/');
+  if (program_name)
+    program_name++;
+  else
+    program_name = argv[0];
+
+  while ((c = getopt(argc, argv, "f:xz")) != -1) {
+    switch (c) {
+      case 'f':
+        fill = strtol(optarg, NULL, 0) & 0xff;
+        break;
+      case 'x':
+        extract = 1;
+        break;
+      case 'z':
+        flags |= TRS_SPARSE_COMPRESS;
+        break;
+      default:
+        usage();
+    }
+  }
+  if (argc - optind != 2)
+    usage();
+
+  if (extract)
+    return trs_sparse_to_reed(argv[optind], argv[optind + 1]) < 0
+      ? EXIT_FAILURE : EXIT_SUCCESS;
+  return trs_sparse_from_reed(argv[optind], argv[optind + 1], fill, flags) < 0
+    ? EXIT_FAILURE : EXIT_SUCCESS;
+}
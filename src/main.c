@@ -79,6 +79,8 @@ int trs_load_cmd(const char *filename)
     debug("entry point of %s: 0x%x (%d) ...\n", filename, entry, entry);
     if (entry >= 0)
       Z80_PC = entry;
+    mem_contents_changed();
+    trs_rewind_reset();
   } else {
     error("unknown CMD format");
     fclose(program);
@@ -211,6 +213,8 @@ int SDLmain(int argc, char *argv[])
 #endif
 
   trs_parse_command_line(argc, argv, &debug);
+  if (trs_forkserver_socket[0])
+    trs_forkserver_init();
   trs_set_keypad_joystick();
   trs_open_joystick();
   screen_init();
@@ -224,6 +228,11 @@ int SDLmain(int argc, char *argv[])
   if (trs_cmd_file[0])
     trs_load_cmd(trs_cmd_file);
 
+#ifdef ZBX
+  if (debug_gdb_socket[0])
+    debug_gdb_serve();
+#endif
+
   if (!debug || fullscreen) {
     /* Run continuously until exit or request to enter debugger */
     z80_run(TRUE);
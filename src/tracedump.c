@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2006-2011, Mark Grebe
+ * Copyright (C) 2018-2021, Jens Guenther
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * tracedump: print a binary instruction trace recorded by zbx (see
+ * debug_trace.h), disassembled with the tables of dis.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "z80.h"
+#include "debug_trace.h"
+
+char *program_name;
+
+/* Needed by the debugger functions of dis.c, not used here */
+int mem_read(int address)
+{
+  return 0xFF;
+}
+
+static void usage(void)
+{
+  fprintf(stderr,
+          "Usage: %s [-r] [-a start,end] [-m mnemonic] trace-file\n"
+          "  -a start,end  only show instructions in this hex address range\n"
+          "  -m mnemonic   only show instructions with this mnemonic\n"
+          "  -r            do not show registers and T-states\n",
+          program_name);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+  FILE *file;
+  Uchar entry[TRACE_ENTRY_SIZE];
+  struct dis_insn insn;
+  char line[64];
+  const char *mnemonic = NULL;
+  unsigned long n, count, tstates = 0;
+  unsigned int start = 0, end = 0xFFFF, pc;
+  int c, registers = 1;
+
+  program_name = strrchr(argv[0], '/');
+  if (program_name)
+    program_name++;
+  else
+    program_name = argv[0];
+
+  while ((c = getopt(argc, argv, "a:m:r")) != -1) {
+    switch (c) {
+      case 'a':
+        if (sscanf(optarg, "%x,%x", &start, &end) != 2)
+          usage();
+        break;
+      case 'm':
+        mnemonic = optarg;
+        break;
+      case 'r':
+        registers = 0;
+        break;
+      default:
+        usage();
+    }
+  }
+  if (optind != argc - 1)
+    usage();
+
+  if ((file = fopen(argv[optind], "rb")) == NULL) {
+    perror(argv[optind]);
+    return EXIT_FAILURE;
+  }
+  if (fread(entry, TRACE_HEADER_SIZE, 1, file) != 1 ||
+      memcmp(entry, TRACE_MAGIC, 4) != 0) {
+    fprintf(stderr, "%s: %s is not a trace file\n", program_name,
+            argv[optind]);
+    return EXIT_FAILURE;
+  }
+  count = TRACE_GET32(entry + 4);
+
+  for (n = 0; n < count; n++) {
+    if (fread(entry, TRACE_ENTRY_SIZE, 1, file) != 1) {
+      fprintf(stderr, "%s: %s is truncated\n", program_name, argv[optind]);
+      return EXIT_FAILURE;
+    }
+    tstates += TRACE_GET32(entry + TRACE_TSTATES);
+    pc = TRACE_GET16(entry + TRACE_PC);
+    if (pc < start || pc > end)
+      continue;
+    dis_decode(entry + TRACE_OP, pc, &insn);
+    if (mnemonic != NULL && strcmp(insn.mnemonic, mnemonic) != 0)
+      continue;
+    if (registers)
+      printf("%10lu  af=%04x bc=%04x de=%04x hl=%04x sp=%04x  ", tstates,
+             TRACE_GET16(entry + TRACE_AF), TRACE_GET16(entry + TRACE_BC),
+             TRACE_GET16(entry + TRACE_DE), TRACE_GET16(entry + TRACE_HL),
+             TRACE_GET16(entry + TRACE_SP));
+    dis_format(&insn, line, sizeof(line));
+    puts(line);
+  }
+  fclose(file);
+  return EXIT_SUCCESS;
+}
@@ -64,6 +64,9 @@ extern char trs_disk_set_dir[FILENAME_MAX];
 extern char trs_state_dir[FILENAME_MAX];
 extern char trs_printer_dir[FILENAME_MAX];
 extern char trs_printer_command[FILENAME_MAX];
+extern char trs_retrostore_host[FILENAME_MAX];
+extern char trs_retrostore_cache[FILENAME_MAX];
+extern int trs_retrostore_cache_size;
 extern char trs_cmd_file[FILENAME_MAX];
 extern char trs_config_file[FILENAME_MAX];
 extern char trs_state_file[FILENAME_MAX];
@@ -104,6 +107,9 @@ extern void trs_screen_caption(void);
 extern void trs_disk_led(int drive, int on_off);
 extern void trs_hard_led(int drive, int on_off);
 extern void trs_turbo_led(void);
+extern void trs_perf_overlay_draw(void);
+extern void trs_screen_frame_skip(int on);
+extern int trs_turbo_fps;
 
 extern void trs_reset(int poweron);
 extern void trs_exit(int confirm);
@@ -151,6 +157,9 @@ extern int trs_joystick_in(void);
 
 extern int trs_rom_size;
 
+extern void trs_io_poll(void);
+extern void trs_io_stop(void);
+
 extern unsigned char trs_interrupt_latch_read(void);
 extern unsigned char trs_nmi_latch_read(void);
 extern void trs_interrupt_mask_write(unsigned char);
@@ -162,6 +171,7 @@ extern void trs_disk_motoroff_interrupt(int state);
 extern void trs_uart_err_interrupt(int state);
 extern void trs_uart_rcv_interrupt(int state);
 extern void trs_uart_snd_interrupt(int state);
+extern void trs_iobus_interrupt(int state);
 extern void trs_timer_interrupt(int state);
 extern void trs_timer_init(void);
 extern void trs_timer_off(void);
@@ -174,6 +184,10 @@ extern void trs_cassette_clear_interrupts(void);
 extern int trs_cassette_interrupts_enabled(void);
 extern void trs_cassette_update(int dummy);
 extern int cassette_default_sample_rate;
+extern int cassette_decode;
+extern int cassette_fastload;
+extern int cassette_fastload_armed;
+extern void trs_cassette_rom_trap(void);
 extern void trs_orch90_out(int chan, int value);
 extern void trs_cassette_reset(void);
 extern void assert_state_void(int dummy);
@@ -187,6 +201,9 @@ extern void trs_uart_set_avail(int dummy);
 extern void trs_uart_set_empty(int dummy);
 
 extern void trs_disk_debug(void);
+extern void trs_sound_debug(void);
+extern int trs_sound_fill(void);
+extern unsigned long long trs_disk_bytes(void);
 extern int trs_disk_motoroff(void);
 
 extern int huffman_ram;
@@ -208,6 +225,56 @@ extern int mem_read_bank_base(void);
 extern void mem_romin(int state);
 extern int cp500_a11_flipflop_toggle(void);
 
+/* Memory pages tracked for the rewind buffer: 2M of banked RAM and 512K
+   of SuperMem */
+#define MEM_PAGE_SHIFT	8
+#define MEM_PAGE_SIZE	(1 << MEM_PAGE_SHIFT)
+#define MEM_PAGES	((0x200000 + 0x80000) >> MEM_PAGE_SHIFT)
+extern unsigned char *mem_page(int page);
+extern int mem_dirty_next(int page);
+extern void mem_dirty_clear(void);
+extern void mem_write_phys(int offset, int value);
+extern void mem_contents_changed(void);
+
+extern char trs_forkserver_socket[FILENAME_MAX];
+extern int trs_forkserver_pc;
+extern int trs_forkserver_armed;
+extern void trs_forkserver_init(void);
+extern void trs_forkserver_checkpoint(void);
+extern void trs_forkserver_exit(int status);
+extern void trs_forkserver_tick(void);
+
+extern int trs_rewind;
+extern void trs_rewind_tick(void);
+extern void trs_rewind_reset(void);
+extern int trs_rewind_back(int seconds);
+extern int trs_rewind_available(void);
+
+extern int trs_perf_overlay;
+extern char trs_perf_file[FILENAME_MAX];
+extern char trs_perf_text[81];
+extern void trs_perf_tick(unsigned int slept);
+
+/* Device classes for trs_iostats_event */
+#define IOSTATS_DISK		0
+#define IOSTATS_CASSETTE	1
+#define IOSTATS_UART		2
+#define IOSTATS_TRSIO		3
+#define IOSTATS_SOUND		4
+#define IOSTATS_RESET		5
+#define IOSTATS_OTHER		6
+#define IOSTATS_EVENTS		7
+
+extern int trs_iostats;
+extern char trs_iostats_file[FILENAME_MAX];
+extern void trs_iostats_port(int port, int bytes, int writing);
+extern void trs_iostats_mmio(int address, int writing);
+extern void trs_iostats_event(int device);
+extern void trs_iostats_tick(void);
+extern void trs_iostats_clear(void);
+extern void trs_iostats_debug(void);
+extern int trs_iostats_save(const char *filename);
+
 extern void trs_debug(void);
 
 typedef void (*trs_event_func)(int arg);
@@ -103,6 +103,14 @@ static int soundDeviceOpen = FALSE;
 
 int trs_sound = 1;
 
+/* ROM cassette entry points satisfied directly by fast loading.  The
+   Model III ROM keeps the Model I addresses as compatibility vectors. */
+#define ROM_CSIN	0x0235  /* read one byte into A */
+#define ROM_CSHIN	0x0296  /* find leader and sync byte, show ** */
+#define ROM_CHECK	4       /* entry bytes that must match the ROM image */
+int cassette_fastload = 0;
+int cassette_fastload_armed = 0;
+
 /* Windows won't work with a sound fragment size smaller than 2048,
    or you get gaps in sound */
 #ifdef _WIN32
@@ -111,12 +119,56 @@ int trs_sound = 1;
 #define FRAGSIZE 9
 #endif
 #define SOUND_RING_SIZE (1 << (FRAGSIZE + 8))
+#define SOUND_RING_MASK (SOUND_RING_SIZE - 1)
 static int cassette_afmt = AUDIO_U8;
+static int cassette_framesize = 1;  /* bytes per sample frame */
+
+/* The sound ring is a single-producer (emulator thread), single-
+ * consumer (SDL audio callback) queue.  The head and tail indices run
+ * freely and are reduced modulo the power-of-two ring size on access,
+ * so head - tail is always the number of bytes queued.  Only the
+ * producer stores head and only the consumer stores tail.  SDL 1.2
+ * has no atomics, but it holds the audio lock around the callback, so
+ * there the producer publishes its updates under that lock instead.
+ * RING_RELEASE orders the data accesses before publishing an index,
+ * RING_ACQUIRE orders them after reading the other side's index.
+ */
+#ifdef SDL2
+typedef SDL_atomic_t ring_index;
+#define RING_GET(i)	((Uint32) SDL_AtomicGet(&(i)))
+#define RING_SET(i, v)	SDL_AtomicSet(&(i), (int) (v))
+#define RING_RELEASE()	SDL_MemoryBarrierRelease()
+#define RING_ACQUIRE()	SDL_MemoryBarrierAcquire()
+#define RING_LOCK()
+#define RING_UNLOCK()
+#else
+typedef volatile Uint32 ring_index;
+#define RING_GET(i)	(i)
+#define RING_SET(i, v)	((i) = (v))
+#define RING_RELEASE()
+#define RING_ACQUIRE()
+#define RING_LOCK()	SDL_LockAudio()
+#define RING_UNLOCK()	SDL_UnlockAudio()
+#endif
 static Uint8 sound_ring[SOUND_RING_SIZE];
-static Uint8 *sound_ring_read_ptr = sound_ring;
-static Uint8 *sound_ring_write_ptr = sound_ring;
-static Uint32 sound_ring_count = 0;
-static Uint8 *sound_ring_end = sound_ring + SOUND_RING_SIZE;
+static ring_index sound_ring_head;
+static ring_index sound_ring_tail;
+
+/* Statistics, each written by one side only */
+static Uint32 sound_underruns;
+static Uint32 sound_overruns;
+static Uint32 sound_trimmed;
+
+/* Adaptive latency: the consumer keeps the fill level near
+ * sound_target bytes.  An underrun doubles the target; a long run of
+ * clean callbacks shrinks it again, and anything queued beyond twice
+ * the target is stale and gets skipped.  */
+#define SOUND_SETTLE 64  /* clean callbacks before shrinking the target */
+static int sound_target;
+static int sound_target_min;
+static int sound_clean;
+static int sound_starved;
+static Uint32 sound_last_head;
 
 /* For bit-level emulation */
 static tstate_t cassette_transition;
@@ -306,50 +358,124 @@ get_fourbyte(Uint *pp, FILE* f)
   return 0;
 }
 
-/* Output an 8-byte unsigned sample, if necessary converting to a
- * different sample format.  */
+/* Fill len bytes at dst with a repeating frame of framelen bytes,
+ * starting phase bytes into the frame.  Runs of a single byte value
+ * are a plain memset; otherwise the first frame is laid down and then
+ * doubled with memcpy, so the cost is O(log len) calls either way.  */
+static void
+fill_frames(Uint8 *dst, int len, const Uint8 *frame, int framelen, int phase)
+{
+  int i, n;
+
+  for (i = 1; i < framelen; i++) {
+    if (frame[i] != frame[0]) break;
+  }
+  if (i == framelen) {
+    SDL_memset(dst, frame[0], len);
+    return;
+  }
+  n = framelen < len ? framelen : len;
+  for (i = 0; i < n; i++) {
+    dst[i] = frame[(phase + i) % framelen];
+  }
+  while (i < len) {
+    n = i < len - i ? i : len - i;
+    SDL_memcpy(dst + i, dst, n);
+    i += n;
+  }
+}
+
+/* Output a run of count identical frames of 8-bit unsigned samples
+ * (one sample per channel), if necessary converting to a different
+ * sample format.  The whole run is generated with block fills into
+ * the sound ring or a write buffer, so long plateaus between
+ * transitions cost the same as a single sample.  */
 static void
-put_sample(Uchar sample, int convert, FILE* f)
+put_samples(const Uchar *samples, int channels, long count, int convert,
+            FILE* f)
 {
-  Uint16 two_byte;
+  Uint8 frame[4];
+  int framelen, ch;
+
+  if (count <= 0) return;
 
   if (convert) {
-    SDL_LockAudio();
+    long nbytes, space;
+    Uint32 head;
+    int phase = 0;
+
     switch (cassette_afmt) {
       case AUDIO_U8:
-        *sound_ring_write_ptr++ = sample;
-        if (sound_ring_write_ptr >= sound_ring_end) {
-          sound_ring_write_ptr = sound_ring;
-        }
-        sound_ring_count++;
+        for (ch = 0; ch < channels; ch++)
+          frame[ch] = samples[ch];
+        framelen = channels;
         break;
 #ifdef big_endian
       case AUDIO_S16MSB:
-        two_byte = (sample << 8) - 0x8000;
-        *sound_ring_write_ptr++ =  two_byte >> 8;
-        if (sound_ring_write_ptr >= sound_ring_end)
-          sound_ring_write_ptr = sound_ring;
-        *sound_ring_write_ptr++ = two_byte & 0xFF;
 #else
       case AUDIO_S16:
-        two_byte = (sample << 8) - 0x8000;
-        *sound_ring_write_ptr++ =  two_byte & 0xFF;
-        if (sound_ring_write_ptr >= sound_ring_end)
-          sound_ring_write_ptr = sound_ring;
-        *sound_ring_write_ptr++ = two_byte >> 8;
 #endif
-        if (sound_ring_write_ptr >= sound_ring_end)
-          sound_ring_write_ptr = sound_ring;
-        sound_ring_count+=2;
+        for (ch = 0; ch < channels; ch++) {
+          Uint16 const two_byte = (samples[ch] << 8) - 0x8000;
+#ifdef big_endian
+          frame[ch * 2] = two_byte >> 8;
+          frame[ch * 2 + 1] = two_byte & 0xFF;
+#else
+          frame[ch * 2] = two_byte & 0xFF;
+          frame[ch * 2 + 1] = two_byte >> 8;
+#endif
+        }
+        framelen = channels * 2;
         break;
       default:
         error("sample format 0x%x not supported", cassette_afmt);
-        break;
+        return;
+    }
+
+    RING_LOCK();
+    head = RING_GET(sound_ring_head);
+    /* Drop whatever doesn't fit rather than overwrite unplayed data */
+    space = SOUND_RING_SIZE - (head - RING_GET(sound_ring_tail));
+    RING_ACQUIRE();
+    nbytes = count * framelen;
+    if (nbytes > space) {
+      sound_overruns++;
+      nbytes = space - space % framelen;
     }
-    SDL_UnlockAudio();
+    while (nbytes > 0) {
+      int const pos = head & SOUND_RING_MASK;
+      int n = SOUND_RING_SIZE - pos;
+
+      if (n > nbytes) n = nbytes;
+      fill_frames(sound_ring + pos, n, frame, framelen, phase);
+      phase = (phase + n) % framelen;
+      head += n;
+      nbytes -= n;
+    }
+    /* Samples must be in place before the consumer can see them */
+    RING_RELEASE();
+    RING_SET(sound_ring_head, head);
+    RING_UNLOCK();
     return;
   }
-  putc(sample, f);
+
+  if (channels == 1) {
+    static Uchar buf[512];
+    size_t n = count < (long)sizeof(buf) ? (size_t)count : sizeof(buf);
+
+    SDL_memset(buf, samples[0], n);
+    while (count > 0) {
+      if ((long)n > count) n = count;
+      if (fwrite(buf, 1, n, f) != n) return;
+      count -= n;
+    }
+    return;
+  }
+
+  while (count-- > 0) {
+    for (ch = 0; ch < channels; ch++)
+      putc(samples[ch], f);
+  }
 }
 
 /* Write a new .wav file header to a file.  Return -1 on error. */
@@ -390,99 +516,639 @@ create_wav_header(FILE *f)
 
 /* Error message generator */
 static int
-check_chunk_id(char *expected, FILE* f)
+check_chunk_id(char *expected, FILE* f, int quiet)
 {
   char c4[5];
   c4[4] = '\0';
   if (fread(c4, 4, 1, f) != 1) return -1;
   if (strcmp(c4, expected) != 0) {
-    error("unusable wav file: expected chunk id '%s', got '%s'", expected, c4);
+    if (!quiet)
+      error("unusable wav file: expected chunk id '%s', got '%s'",
+            expected, c4);
     return -1;
   }
   return 0;
 }
 
-/* Parse a .wav file's RIFF header.  We don't understand much about
+typedef struct {
+  int sample_rate;
+  long dataid_offset;
+  long datasize_offset;
+  long data_offset;
+} WavHeader;
+
+/* Read a .wav file's RIFF header.  We don't understand much about
    the RIFF format, so we might fail on valid .WAV files.  For now,
    that's just tough.  Try running the file through sox to convert it
    to something more vanilla. */
 static int
-parse_wav_header(FILE *f)
+read_wav_header(FILE *f, WavHeader *h, int quiet)
 {
   Uint n4;
   Uint fmt_size;
   Ushort n2, expect2;
 
-  if (check_chunk_id("RIFF", f) < 0) return -1;
+  if (check_chunk_id("RIFF", f, quiet) < 0) return -1;
   if (get_fourbyte(&n4, f) < 0) return -1; /* ignore this field */
-  if (check_chunk_id("WAVE", f) < 0) return -1;
-  if (check_chunk_id("fmt ", f) < 0) return -1;
+  if (check_chunk_id("WAVE", f, quiet) < 0) return -1;
+  if (check_chunk_id("fmt ", f, quiet) < 0) return -1;
   if (get_fourbyte(&fmt_size, f) < 0) return -1;
   if (get_twobyte(&n2, f) < 0) return -1;
   if (n2 != WAVE_FORMAT_PCM) {
-    error("unusable wav file: must be pcm");
+    if (!quiet) error("unusable wav file: must be pcm");
     return -1;
   }
   if (get_twobyte(&n2, f) < 0) return -1;
   if (n2 != WAVE_FORMAT_MONO) {
-    error("unusable wav file: must be mono");
+    if (!quiet) error("unusable wav file: must be mono");
     return -1;
   }
   if (get_fourbyte(&n4, f) < 0) return -1;
-  cassette_sample_rate = n4;
+  h->sample_rate = n4;
   if (get_fourbyte(&n4, f) < 0) return -1; /* ignore this field */
   expect2 = WAVE_FORMAT_MONO * WAVE_FORMAT_8BIT / 8;
   if (get_twobyte(&n2, f) < 0) return -1;
   if (n2 != expect2) {
-    error("unusable wav file: must be %d bytes/sample", expect2);
+    if (!quiet) error("unusable wav file: must be %d bytes/sample", expect2);
     return -1;
   }
   expect2 = WAVE_FORMAT_8BIT;
   if (get_twobyte(&n2, f) < 0) return -1;
   if (n2 != expect2) {
-    error("unusable wav file: must be %d bits/sample", expect2);
+    if (!quiet) error("unusable wav file: must be %d bits/sample", expect2);
     return -1;
   }
   fmt_size -= 16;  /* size read so far */
   while (fmt_size-- > 0) getc(f); /* ignore additional */
-  wave_dataid_offset = ftell(f);
-  if (check_chunk_id("data", f) < 0) return -1;
-  wave_datasize_offset = ftell(f);
+  h->dataid_offset = ftell(f);
+  if (check_chunk_id("data", f, quiet) < 0) return -1;
+  h->datasize_offset = ftell(f);
   if (get_fourbyte(&n4, f) < 0) return -1; /* ignore this field */
-  wave_data_offset = ftell(f);
+  h->data_offset = ftell(f);
+  return 0;
+}
+
+/* Parse a .wav file's header into the cassette state */
+static int
+parse_wav_header(FILE *f)
+{
+  WavHeader h;
+
+  if (read_wav_header(f, &h, FALSE) < 0) return -1;
+  cassette_sample_rate = h.sample_rate;
+  wave_dataid_offset = h.dataid_offset;
+  wave_datasize_offset = h.datasize_offset;
+  wave_data_offset = h.data_offset;
   if (cassette_position < wave_data_offset)
     cassette_position = wave_data_offset;
   return 0;
 }
 
-static void trs_sdl_sound_update(void *userdata, Uint8 * stream, int len)
+/*
+ * Pre-decoded cassette input.  When a .cpt tape is inserted, or the
+ * motor starts on a .wav tape, a background thread decodes the file
+ * into an array of transitions, each holding the file offset just past it and its
+ * duration and level packed as (duration << 2) | level.  Durations
+ * are in microseconds for .cpt and samples for .wav, so the array
+ * doesn't depend on the emulated clock speed.  Once decoding has
+ * finished, transition_in takes transitions from the array instead of
+ * reading the file, and positioning the tape is a binary search.
+ *
+ * transition_in restarts its .wav level detector each time the motor
+ * comes on, so a .wav file is decoded from that position onward with
+ * a fresh detector, and the array is used only until the motor goes
+ * off again.  The last few decodings are kept so that reloading a
+ * state or rewinding doesn't decode the same tape again.
+ *
+ * The .wav decoder's noise floor differs at 1500 bps, so .wav files
+ * get a second array decoded with that setting; the reader switches
+ * between them at the same file offset when the speed changes.
+ */
+typedef struct {
+  Uint32 offset;
+  Uint32 code;
+} CassTrans;
+
+#define DECODE_RUNNING	0
+#define DECODE_DONE	1
+#define DECODE_FAILED	(-1)
+
+typedef struct {
+  char filename[FILENAME_MAX];
+  int format;
+  long start;  /* where the motor came on; 0 for .cpt */
+  time_t mtime;
+  long size;
+  int sample_rate;
+  long data_offset;
+  CassTrans *trans[2];
+  int count[2];
+  int alloc[2];
+  int status;  /* protected by decode_mutex */
+  int cancel;  /* ditto */
+} CassDecode;
+
+int cassette_decode = 1;
+static SDL_mutex *decode_mutex;
+static SDL_Thread *decode_thread;
+static CassDecode *decoding;  /* owned by the decoder thread until done */
+static CassDecode *decoded;   /* finished and in use by transition_in */
+static long decode_segment = -1;  /* start wanted by transition_in */
+#define DECODE_CACHE 3
+static CassDecode *decode_cache[DECODE_CACHE];  /* most recent first */
+static int stream_active;
+static int stream_which;
+static int stream_index;
+static Uint32 stream_pos;
+
+/* State of one .wav level detector, as kept by transition_in */
+typedef struct {
+  float avg;
+  float env;
+  int noisefloor;
+  int value;
+  unsigned long nsamples;
+  unsigned long maxsamples;
+  int fixed;  /* 1500 bps: fixed noise floor */
+} WavDetector;
+
+static int
+decode_cancelled(CassDecode *d)
+{
+  int cancel;
+
+  SDL_LockMutex(decode_mutex);
+  cancel = d->cancel;
+  SDL_UnlockMutex(decode_mutex);
+  return cancel;
+}
+
+static int
+decode_add(CassDecode *d, int which, Uint32 offset, Uint32 code)
 {
-  if (sound_ring_count == 0) {
-    SDL_memset(stream, cassette_silence, len);
+  if (d->count[which] == d->alloc[which]) {
+    int const n = d->alloc[which] ? d->alloc[which] * 2 : 4096;
+    CassTrans *t = realloc(d->trans[which], n * sizeof(CassTrans));
+
+    if (t == NULL) return -1;
+    d->trans[which] = t;
+    d->alloc[which] = n;
+  }
+  d->trans[which][d->count[which]].offset = offset;
+  d->trans[which][d->count[which]].code = code;
+  d->count[which]++;
+  return 0;
+}
+
+/* Same thresholding and adaptive noise cutoff as transition_in */
+static int
+decode_wav_sample(CassDecode *d, int which, WavDetector *w, int c,
+                  Uint32 offset)
+{
+  int next, cabs;
+
+  if (c > 127 + w->noisefloor) {
+    next = 1;
+  } else if (c <= 127 - w->noisefloor) {
+    next = 2;
   } else {
-    int num_to_read;
+    next = 0;
+  }
+  if (w->fixed) {
+    w->noisefloor = 2;
+  } else {
+    cabs = abs(c - 127);
+    if (cabs > 1) {
+      w->avg = (99*w->avg + cabs) / 100;
+    }
+    if (cabs > w->env) {
+      w->env = (w->env + 9*cabs) / 10;
+    } else if (cabs > 10) {
+      w->env = (99*w->env + cabs) / 100;
+    }
+    w->noisefloor = (w->avg + w->env) / 2;
+  }
+  w->nsamples++;
+  if (next != w->value || w->nsamples > w->maxsamples) {
+    if (decode_add(d, which, offset, (w->nsamples << 2) | next) < 0)
+      return -1;
+    w->value = next;
+    w->nsamples = 0;
+  }
+  return 0;
+}
 
-    if (sound_ring_count > (unsigned int)len)
-      num_to_read = len;
-    else
-      num_to_read = sound_ring_count;
+static int
+decode_wav(CassDecode *d, FILE *f)
+{
+  WavHeader h;
+  WavDetector w[2];
+  Uchar buf[16384];
+  Uint32 offset;
+  size_t n, i;
+  int which;
+
+  if (read_wav_header(f, &h, TRUE) < 0) return -1;
+  d->sample_rate = h.sample_rate;
+  d->data_offset = h.data_offset;
+  if (d->start > d->data_offset) {
+    if (fseek(f, d->start, 0) < 0) return -1;
+    d->data_offset = d->start;
+  }
+  for (which = 0; which < 2; which++) {
+    w[which].avg = NOISE_FLOOR;
+    w[which].env = 127;
+    w[which].noisefloor = NOISE_FLOOR;
+    w[which].value = 0;
+    w[which].nsamples = 0;
+    w[which].maxsamples = h.sample_rate / 100;
+    w[which].fixed = which;
+  }
+  offset = d->data_offset;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    if (decode_cancelled(d)) return -1;
+    for (i = 0; i < n; i++) {
+      offset++;
+      if (decode_wav_sample(d, 0, &w[0], buf[i], offset) < 0 ||
+          decode_wav_sample(d, 1, &w[1], buf[i], offset) < 0)
+        return -1;
+    }
+  }
+  return 0;
+}
 
-    if (sound_ring_read_ptr + num_to_read > sound_ring_end) {
-      int const len_to_end = sound_ring_end - sound_ring_read_ptr;
+static int
+decode_cpt(CassDecode *d, FILE *f)
+{
+  Ushort code;
+  Uint delta_us;
+  int c, value;
 
-      SDL_memcpy(stream, sound_ring_read_ptr, len_to_end);
-      SDL_memcpy(stream + len_to_end, sound_ring, num_to_read - len_to_end);
-      SDL_memset(stream, cassette_silence, len - num_to_read);
-      sound_ring_read_ptr = sound_ring + num_to_read - len_to_end;
+  d->data_offset = 0;
+  while (get_twobyte(&code, f) == 0) {
+    if (code == 0xffff) {
+      if ((c = getc(f)) == EOF) break;
+      if (get_fourbyte(&delta_us, f) < 0) break;
+      /* Can't pack these; leave the tape to the file reader */
+      if (c > 3 || delta_us > 0x3fffffff) return -1;
+      value = c;
     } else {
-      SDL_memcpy(stream, sound_ring_read_ptr, num_to_read);
-      SDL_memset(stream, cassette_silence, len - num_to_read);
-      sound_ring_read_ptr += num_to_read;
-      if (sound_ring_read_ptr == sound_ring_end)
-        sound_ring_read_ptr = sound_ring;
+      value = code & 3;
+      delta_us = code >> 2;
+    }
+    if (decode_add(d, 0, ftell(f), (delta_us << 2) | value) < 0)
+      return -1;
+    if ((d->count[0] & 0xfff) == 0 && decode_cancelled(d)) return -1;
+  }
+  return 0;
+}
+
+static int
+decode_main(void *data)
+{
+  CassDecode *d = data;
+  FILE *f = fopen(d->filename, "rb");
+  int ret = -1;
+
+  if (f != NULL) {
+    ret = (d->format == WAV_FORMAT) ? decode_wav(d, f) : decode_cpt(d, f);
+    fclose(f);
+  }
+  SDL_LockMutex(decode_mutex);
+  d->status = (ret < 0) ? DECODE_FAILED : DECODE_DONE;
+  SDL_UnlockMutex(decode_mutex);
+  return ret;
+}
+
+static void
+decode_free(CassDecode *d)
+{
+  free(d->trans[0]);
+  free(d->trans[1]);
+  free(d);
+}
+
+/* Whether d is a decoding of the current tape from start */
+static int
+decode_matches(CassDecode *d, long start, struct stat *st)
+{
+  return strcmp(d->filename, cassette_filename) == 0 &&
+    d->format == cassette_format && d->start == start &&
+    d->mtime == st->st_mtime && d->size == (long) st->st_size;
+}
+
+/* Keep a finished decoding, dropping the least recently used one */
+static void
+decode_keep(CassDecode *d)
+{
+  int i;
+
+  if (decode_cache[DECODE_CACHE - 1] != NULL)
+    decode_free(decode_cache[DECODE_CACHE - 1]);
+  for (i = DECODE_CACHE - 1; i > 0; i--)
+    decode_cache[i] = decode_cache[i - 1];
+  decode_cache[0] = d;
+}
+
+/* Look up a kept decoding, making it the most recently used */
+static CassDecode *
+decode_find(long start, struct stat *st)
+{
+  CassDecode *d;
+  int i;
+
+  for (i = 0; i < DECODE_CACHE && decode_cache[i] != NULL; i++) {
+    if (decode_matches(decode_cache[i], start, st)) {
+      d = decode_cache[i];
+      for (; i > 0; i--)
+        decode_cache[i] = decode_cache[i - 1];
+      decode_cache[0] = d;
+      return d;
+    }
+  }
+  return NULL;
+}
+
+/* Discard the kept decodings of a file that has been written */
+static void
+decode_forget(const char *filename)
+{
+  int i, j;
+
+  for (i = j = 0; i < DECODE_CACHE; i++) {
+    CassDecode *d = decode_cache[i];
+
+    decode_cache[i] = NULL;
+    if (d == NULL) continue;
+    if (strcmp(d->filename, filename) == 0) {
+      if (d == decoded) {
+        decoded = NULL;
+        stream_active = FALSE;
+      }
+      decode_free(d);
+    } else {
+      decode_cache[j++] = d;
+    }
+  }
+}
+
+/* Collect the background decoder's result once it has finished */
+static void
+decode_collect(int wait)
+{
+  int status;
+
+  if (decoding == NULL)
+    return;
+  SDL_LockMutex(decode_mutex);
+  status = decoding->status;
+  SDL_UnlockMutex(decode_mutex);
+  if (status == DECODE_RUNNING && !wait)
+    return;
+  SDL_WaitThread(decode_thread, NULL);
+  SDL_LockMutex(decode_mutex);
+  status = decoding->status;
+  SDL_UnlockMutex(decode_mutex);
+  if (status == DECODE_DONE) {
+    decode_keep(decoding);
+    if (decoded == NULL && decoding->start == decode_segment &&
+        strcmp(decoding->filename, cassette_filename) == 0)
+      decoded = decoding;
+  } else {
+    decode_free(decoding);
+  }
+  decoding = NULL;
+}
+
+/* Cancel any decoding in progress and stop using the decoded tape */
+static void
+decode_stop(void)
+{
+  if (decoding != NULL) {
+    SDL_LockMutex(decode_mutex);
+    decoding->cancel = TRUE;
+    SDL_UnlockMutex(decode_mutex);
+    decode_collect(TRUE);
+  }
+  decoded = NULL;
+  decode_segment = -1;
+  stream_active = FALSE;
+}
+
+/*
+ * Use a decoding of the current tape from file offset start, starting
+ * one in the background if none is kept.  A negative start means the
+ * detector's starting point is unknown, so the file reader is used.
+ */
+static void
+decode_start(long start)
+{
+  struct stat st;
+  CassDecode *d;
+
+  if (!cassette_decode || cassette_filename[0] == 0 ||
+      (cassette_format != WAV_FORMAT && cassette_format != CPT_FORMAT) ||
+      stat(cassette_filename, &st) != 0) {
+    decode_stop();
+    return;
+  }
+  if (cassette_format == CPT_FORMAT)
+    start = 0;
+  if (decoded != NULL && decode_matches(decoded, start, &st))
+    return;
+  decoded = NULL;
+  decode_segment = start;
+  stream_active = FALSE;
+  if (start < 0)
+    return;
+  if ((decoded = decode_find(start, &st)) != NULL)
+    return;
+  if (decoding != NULL) {
+    if (decode_matches(decoding, start, &st))
+      return;
+    SDL_LockMutex(decode_mutex);
+    decoding->cancel = TRUE;
+    SDL_UnlockMutex(decode_mutex);
+    decode_collect(TRUE);
+  }
+  if (decode_mutex == NULL && (decode_mutex = SDL_CreateMutex()) == NULL)
+    return;
+  if ((d = calloc(1, sizeof(CassDecode))) == NULL)
+    return;
+  snprintf(d->filename, FILENAME_MAX, "%s", cassette_filename);
+  d->format = cassette_format;
+  d->start = start;
+  d->mtime = st.st_mtime;
+  d->size = (long) st.st_size;
+  d->status = DECODE_RUNNING;
+#ifdef SDL2
+  decode_thread = SDL_CreateThread(decode_main, "cassette", d);
+#else
+  decode_thread = SDL_CreateThread(decode_main, d);
+#endif
+  if (decode_thread == NULL) {
+    decode_free(d);
+    return;
+  }
+  decoding = d;
+}
+
+/* Return the decoded tape once the background decoder has finished */
+static CassDecode *
+decode_ready(void)
+{
+  if (decoded == NULL)
+    decode_collect(FALSE);
+  return decoded;
+}
+
+/* Finish any background decoding; threads don't survive fork() */
+void
+trs_cassette_decode_wait(void)
+{
+  decode_collect(TRUE);
+}
+
+/* Find the first transition ending after file offset pos */
+static int
+stream_lookup(CassDecode *d, int which, Uint32 pos)
+{
+  int lo = 0, hi = d->count[which];
+
+  while (lo < hi) {
+    int const mid = lo + (hi - lo) / 2;
+
+    if (d->trans[which][mid].offset <= pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static void
+stream_seek(Uint32 pos, int which)
+{
+  stream_which = which;
+  stream_index = stream_lookup(decoded, which, pos);
+  stream_pos = pos;
+}
+
+/* transition_in for a pre-decoded tape */
+static int
+stream_transition_in(void)
+{
+  int const which = (decoded->format == WAV_FORMAT &&
+                     cassette_speed == SPEED_1500);
+  CassTrans *t;
+  float delta_ts;
+
+  if (which != stream_which)
+    stream_seek(stream_pos, which);
+  if (stream_index >= decoded->count[which])
+    return 0;
+  t = &decoded->trans[which][stream_index++];
+  cassette_next = t->code & 3;
+  if (decoded->format == WAV_FORMAT) {
+    delta_ts = (t->offset - stream_pos) * (1000000.0 / decoded->sample_rate)
+      * z80_state.clockMHz - cassette_roundoff_error;
+    cassette_delta = (unsigned long) delta_ts + 0.5;
+  } else {
+    delta_ts = (t->code >> 2) * z80_state.clockMHz - cassette_roundoff_error;
+    cassette_delta = (unsigned long)(delta_ts + 0.5);
+  }
+  cassette_roundoff_error = cassette_delta - delta_ts;
+  stream_pos = t->offset;
+#if CASSDEBUG
+  debug("%d %4lu %d\n", cassette_value, cassette_delta, cassette_next);
+#endif
+  return 1;
+}
+
+static void trs_sdl_sound_update(void *userdata, Uint8 * stream, int len)
+{
+  Uint32 const head = RING_GET(sound_ring_head);
+  Uint32 tail = RING_GET(sound_ring_tail);
+  Uint32 count = head - tail;
+  int num_to_read, pos, n;
+
+  RING_ACQUIRE();
+
+  /* Skip stale samples if the emulator has run too far ahead */
+  if (count > (Uint32)(sound_target * 2)) {
+    Uint32 skip = count - sound_target;
+
+    skip -= skip % cassette_framesize;
+    tail += skip;
+    count -= skip;
+    sound_trimmed += skip;
+  }
+
+  num_to_read = count < (Uint32)len ? (int)count : len;
+  pos = tail & SOUND_RING_MASK;
+  n = SOUND_RING_SIZE - pos;
+  if (n > num_to_read) n = num_to_read;
+  SDL_memcpy(stream, sound_ring + pos, n);
+  SDL_memcpy(stream + n, sound_ring, num_to_read - n);
+  SDL_memset(stream + num_to_read, cassette_silence, len - num_to_read);
+  RING_RELEASE();
+  RING_SET(sound_ring_tail, tail + num_to_read);
+
+  /* Running dry only counts as an underrun if more samples turn up
+     afterwards; otherwise the sound simply ended. */
+  if (sound_starved && head != sound_last_head) {
+    sound_underruns++;
+    sound_clean = 0;
+    if (sound_target < SOUND_RING_SIZE / 4)
+      sound_target *= 2;
+  } else if (count != 0 && ++sound_clean >= SOUND_SETTLE) {
+    sound_clean = 0;
+    if (sound_target > sound_target_min) {
+      sound_target -= sound_target / 8;
+      if (sound_target < sound_target_min)
+        sound_target = sound_target_min;
     }
-    sound_ring_count -= num_to_read;
   }
+  sound_starved = (count != 0 && num_to_read < len);
+  sound_last_head = head;
+}
+
+static void
+sound_ring_reset(void)
+{
+  SDL_LockAudio();
+  RING_SET(sound_ring_head, 0);
+  RING_SET(sound_ring_tail, 0);
+  sound_clean = 0;
+  sound_starved = 0;
+  sound_last_head = 0;
+  SDL_UnlockAudio();
+}
+
+void
+trs_sound_debug(void)
+{
+  Uint32 const count =
+    RING_GET(sound_ring_head) - RING_GET(sound_ring_tail);
+
+  printf("Sound state:\n");
+  printf("  device %s, rate %d Hz, %s, %d bytes/frame\n",
+         soundDeviceOpen ? "open" : "closed", cassette_sample_rate,
+         cassette_stereo ? "stereo" : "mono", cassette_framesize);
+  printf("  ring %u/%d bytes queued, latency target %d bytes (min %d)\n",
+         count, SOUND_RING_SIZE, sound_target, sound_target_min);
+  printf("  underruns %u, overruns %u, stale bytes skipped %u\n",
+         sound_underruns, sound_overruns, sound_trimmed);
+}
+
+/* Fill of the sound ring in percent, or -1 if there is no sound */
+int
+trs_sound_fill(void)
+{
+  if (!soundDeviceOpen)
+    return -1;
+  return (RING_GET(sound_ring_head) - RING_GET(sound_ring_tail)) * 100
+    / SOUND_RING_SIZE;
 }
 
 static int
@@ -538,6 +1204,13 @@ set_audio_format(int state)
   cassette_afmt = obtained.format;
   cassette_stereo = (obtained.channels == 2);
   cassette_silence = obtained.silence;
+  cassette_framesize = obtained.channels *
+    (obtained.format == AUDIO_U8 ? 1 : 2);
+
+  /* Start out with two device buffers of slack */
+  sound_target_min = obtained.samples * cassette_framesize;
+  sound_target = sound_target_min * 2;
+  sound_ring_reset();
 
   SDL_PauseAudio(0);
 
@@ -566,6 +1239,7 @@ trs_cassette_insert(const char *filename)
    }
    else
      cassette_format = CAS_FORMAT;
+   decode_start(cassette_motor ? -1 : cassette_position);
 }
 
 void
@@ -574,6 +1248,8 @@ trs_cassette_remove(void)
    cassette_filename[0] = 0;
    cassette_position = 0;
    cassette_format = DIRECT_FORMAT;
+   cassette_fastload_armed = 0;
+   decode_stop();
 }
 
 char*
@@ -615,6 +1291,13 @@ int trs_get_cassette_position(void)
 
 void trs_set_cassette_position(int pos)
 {
+  if (decode_ready() != NULL && pos >= decoded->data_offset) {
+    /* Snap to the start of the transition containing pos */
+    int const i = stream_lookup(decoded, 0, pos);
+
+    pos = (i > 0) ? (int)decoded->trans[0][i - 1].offset
+                  : decoded->data_offset;
+  }
   cassette_position = pos;
 }
 
@@ -642,7 +1325,12 @@ static int assert_state(int state)
       soundDeviceOpen = FALSE;
       cassette_position = 0;
     } else {
-      cassette_position = ftell(cassette_file);
+      if (stream_active) {
+        cassette_position = stream_pos;
+        stream_active = FALSE;
+      } else {
+        cassette_position = ftell(cassette_file);
+      }
       if (cassette_format == WAV_FORMAT && cassette_state == WRITE) {
         fseek(cassette_file, WAVE_RIFFSIZE_OFFSET, 0);
         put_fourbyte(cassette_position - WAVE_RIFF_OFFSET, cassette_file);
@@ -650,6 +1338,11 @@ static int assert_state(int state)
         put_fourbyte(cassette_position - wave_data_offset, cassette_file);
       }
       fclose(cassette_file);
+      /* The tape has changed; decode it afresh */
+      if (cassette_state == WRITE) {
+        decode_forget(cassette_filename);
+        decode_start(cassette_motor ? -1 : cassette_position);
+      }
     }
 
     cassette_stereo = 0;
@@ -682,6 +1375,7 @@ static int assert_state(int state)
   case SOUND:
   case ORCH90:
   case WRITE:
+    decode_stop();
     if (state == SOUND || state == ORCH90) {
       cassette_format = DIRECT_FORMAT;
       cassette_filename[0] = 0;
@@ -813,9 +1507,12 @@ transition_out(int value)
     debug("%d %4lu %d -> %3lu\n", cassette_value,
           z80_state.t_count - cassette_transition, value, nsamples);
 #endif
-    if (cassette_format == DIRECT_FORMAT && cassette_stereo) nsamples *= 2;
-    while (nsamples-- > 0) {
-      put_sample(sample, cassette_format == DIRECT_FORMAT, cassette_file);
+    {
+      Uchar const frame[2] = { sample, sample };
+
+      put_samples(frame,
+                  (cassette_format == DIRECT_FORMAT && cassette_stereo) ? 2 : 1,
+                  nsamples, cassette_format == DIRECT_FORMAT, cassette_file);
     }
     if (value == FLUSH) {
       value = cassette_value;
@@ -944,6 +1641,16 @@ transition_in(void)
   int c, cabs;
   float delta_ts;
 
+  if ((cassette_format == WAV_FORMAT || cassette_format == CPT_FORMAT) &&
+      decode_ready() != NULL) {
+    if (!stream_active) {
+      stream_seek(ftell(cassette_file), 0);
+      stream_active = TRUE;
+    }
+    ret = stream_transition_in();
+    goto fail;
+  }
+
   switch (cassette_format) {
   case DEBUG_FORMAT:
     if (fscanf(cassette_file, "%d %lu\n", &next, &delta_us) == 2) {
@@ -1102,6 +1809,73 @@ trs_cassette_kickoff(int dummy)
   }
 }
 
+static void
+fastload_arm(void)
+{
+  cassette_fastload_armed = cassette_fastload && cassette_motor &&
+    cassette_filename[0] != 0 && cassette_format == CAS_FORMAT;
+}
+
+/* Called from z80_run before fetching an instruction at a low address
+   while fast loading is armed.  If the PC is at one of the ROM's
+   cassette input entry points and the ROM is mapped in, do the job of
+   the ROM routine straight from the .cas byte stream and return to
+   the caller; otherwise leave it to bit-level emulation.  */
+void
+trs_cassette_rom_trap(void)
+{
+  extern Uchar rom[];
+  int const pc = Z80_PC;
+  long pos;
+  int c, i;
+
+  if (pc != ROM_CSIN && pc != ROM_CSHIN) return;
+  for (i = 0; i < ROM_CHECK; i++) {
+    if (pc + i >= trs_rom_size || mem_read(pc + i) != rom[pc + i]) return;
+  }
+  /* Don't take over in the middle of a byte being read bit by bit */
+  if (cassette_state == READ && pc == ROM_CSIN &&
+      (cassette_bitnumber != 0 || cassette_pulsestate != 0)) return;
+  if (cassette_state == WRITE || assert_state(READ) < 0) return;
+
+  pos = ftell(cassette_file);
+  c = getc(cassette_file);
+  if (pc == ROM_CSHIN) {
+    /* Skip leader (0x00 at 250/500 bps, 0x55 at 1500 bps) up to and
+       including the sync byte (0xA5 or 0x7F respectively) */
+    int leader = 0;
+
+    while (c != EOF) {
+      if (leader && (c == 0xA5 || c == 0x7F)) break;
+      leader = (c == 0x00 || c == 0x55);
+      c = getc(cassette_file);
+    }
+  }
+  if (c == EOF) {
+    fseek(cassette_file, pos, 0);
+    return;
+  }
+  if (pc == ROM_CSHIN) {
+    mem_write(0x3C3E, '*');
+    mem_write(0x3C3F, '*');
+  }
+  Z80_A = c;
+
+  /* If bit-level reading takes over later, start at the next byte */
+  cassette_value = cassette_next = 0;
+  cassette_delta = 0;
+  cassette_transition = z80_state.t_count;
+  cassette_roundoff_error = 0.0;
+  cassette_flipflop = 0;
+  cassette_byte = 0;
+  cassette_bitnumber = 0;
+  cassette_pulsestate = 0;
+
+  /* Return to the caller, as the ROM routine's RET would */
+  Z80_PC = mem_read_word(Z80_SP);
+  Z80_SP += 2;
+}
+
 /* Z80 program is turning motor on or off */
 void trs_cassette_motor(int value)
 {
@@ -1127,6 +1901,8 @@ void trs_cassette_motor(int value)
       cassette_noisefloor = NOISE_FLOOR;
       cassette_firstoutread = 0;
       cassette_transitionsout = 0;
+      decode_start(cassette_position);
+      fastload_arm();
       if (trs_model > 1) {
 	/* Get 1500bps reading started after 1 second */
 	trs_schedule_event(trs_cassette_kickoff, 0,
@@ -1141,6 +1917,7 @@ void trs_cassette_motor(int value)
       }
       assert_state(CLOSE);
       cassette_motor = 0;
+      cassette_fastload_armed = 0;
     }
   }
 }
@@ -1229,9 +2006,10 @@ trs_orch90_out(int channels, int value)
   cassette_roundoff_error =
     nsamples * (1000000.0 / cassette_sample_rate) - ddelta_us;
 
-  while (nsamples-- > 0) {
-    put_sample(orch90_left, TRUE, cassette_file);
-    put_sample(orch90_right, TRUE, cassette_file);
+  {
+    Uchar const sample[2] = { orch90_left, orch90_right };
+
+    put_samples(sample, 2, nsamples, TRUE, cassette_file);
   }
 
   if (trs_event_scheduled() == orch90_flush ||
@@ -1408,11 +2186,9 @@ trs_cassette_load(FILE *file)
   trs_load_int(file, &cassette_speed, 1);
   trs_load_int(file, &orch90_left, 1);
   trs_load_int(file, &orch90_right, 1);
-  SDL_LockAudio();
-  sound_ring_read_ptr = sound_ring;
-  sound_ring_write_ptr = sound_ring;
-  sound_ring_count = 0;
-  SDL_UnlockAudio();
+  fastload_arm();
+  decode_start(cassette_motor ? -1 : cassette_position);
+  sound_ring_reset();
   trs_load_int(file, &soundDeviceOpen, 1);
   if (currentOpened != soundDeviceOpen) {
     if (soundDeviceOpen) {
@@ -40,6 +40,7 @@
 int create_wav_header(FILE *f);
 void trs_cassette_insert(const char *filename);
 void trs_cassette_remove(void);
+void trs_cassette_decode_wait(void);
 char* trs_cassette_getfilename(void);
 int trs_cass_getwriteprotect(void);
 int trs_get_cassette_length(void);
@@ -297,6 +297,9 @@ typedef struct {
 
 static DiskState disk[NDRIVES];
 
+/* Data bytes read and written, for the performance statistics */
+static unsigned long long disk_bytes;
+
 /* Emulate interleave in JV1 mode */
 static const unsigned char jv1_interleave[10] = {0, 5, 1, 6, 2, 7, 3, 8, 4, 9};
 
@@ -311,6 +314,12 @@ static void real_readtrk(void);
 static void real_writetrk(void);
 static int  real_check_empty(DiskState *d);
 
+unsigned long long
+trs_disk_bytes(void)
+{
+  return disk_bytes;
+}
+
 /* Entry point for the zbx debugger */
 void
 trs_disk_debug(void)
@@ -1411,6 +1420,7 @@ trs_disk_data_read(void)
 	}
       }
       state.data = c;
+      disk_bytes++;
       state.bytecount--;
       if (state.bytecount <= 0) {
 	if (d->emutype == DMK) {
@@ -1569,6 +1579,7 @@ trs_disk_data_write(unsigned char data)
   switch (state.currcommand & TRSDISK_CMDMASK) {
   case TRSDISK_WRITE:
     if (state.bytecount > 0) {
+      disk_bytes++;
       if (d->emutype == REAL) {
 	d->u.real.buf[size_code_to_size(d->u.real.size_code)
 		     - state.bytecount] = data;
@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2006-2011, Mark Grebe
+ * Copyright (C) 2018-2021, Jens Guenther
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * trs_forkserver.c -- checkpoint and fork for test harnesses
+ *
+ * With -forkserver <socket> the emulator runs headless and boots
+ * normally until it reaches the checkpoint: the address given with
+ * -checkpoint, or a Z80 program calling emt_misc function 26.  There
+ * it listens on the Unix domain socket.  Each connection sends one
+ * line:
+ *
+ *     <cmd file> [<timeout in emulated seconds>]
+ *
+ * and gets a forked copy of the emulator which loads the program with
+ * trs_load_cmd and runs it from its entry point.  The program ends the
+ * test with emt_misc function 27 (exit with status HL); the child then
+ * answers "exit <status>" and terminates.  If the timeout (default 60
+ * seconds) expires first, the answer is "timeout".  A connection that
+ * is closed without an answer means the child crashed.
+ *
+ * The children share the disk image files, so tests should only use
+ * write protected images or ones they don't write to.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#include <SDL.h>
+#include "error.h"
+#include "trs.h"
+#include "trs_cassette.h"
+#include "trs_state_save.h"
+
+#define FORKSERVER_TIMEOUT 60
+
+char trs_forkserver_socket[FILENAME_MAX];
+int trs_forkserver_pc = -1;
+int trs_forkserver_armed = 0;
+
+#ifndef _WIN32
+static int listen_fd = -1;
+static int conn_fd = -1;
+static tstate_t deadline;
+
+static void reply(const char *text)
+{
+  if (conn_fd >= 0 && write(conn_fd, text, strlen(text)) < 0)
+    error("fork server: failed to answer: %s", strerror(errno));
+}
+
+void trs_forkserver_init(void)
+{
+  struct sockaddr_un addr;
+
+  /* No window or sound: the children all share the parent's */
+  SDL_QuitSubSystem(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
+  putenv("SDL_VIDEODRIVER=dummy");
+  if (SDL_InitSubSystem(SDL_INIT_VIDEO) != 0)
+    fatal("fork server: failed to initialize SDL: %s", SDL_GetError());
+  trs_sound = 0;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(trs_forkserver_socket) >= sizeof(addr.sun_path))
+    fatal("fork server: socket name too long: %s", trs_forkserver_socket);
+  strcpy(addr.sun_path, trs_forkserver_socket);
+  unlink(trs_forkserver_socket);
+
+  if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+      bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listen_fd, 16) < 0)
+    fatal("fork server: failed to listen on %s: %s", trs_forkserver_socket,
+          strerror(errno));
+  trs_forkserver_armed = (trs_forkserver_pc >= 0);
+}
+
+/*
+ * Close and reopen the disk images by a round trip through the state
+ * functions.  This flushes the hard disk caches at the checkpoint, and
+ * gives each child file positions of its own.
+ */
+static void reopen_files(void)
+{
+  FILE *file = tmpfile();
+
+  if (file == NULL) {
+    error("fork server: failed to create temporary file: %s",
+          strerror(errno));
+    return;
+  }
+  trs_state_save_regs(file);
+  rewind(file);
+  trs_state_load_regs(file);
+  fclose(file);
+}
+
+/* Read one request line, return 0 if got one */
+static int get_request(int fd, char *line, int size)
+{
+  int len = 0;
+
+  while (len < size - 1) {
+    int const n = read(fd, line + len, 1);
+
+    if (n <= 0)
+      return -1;
+    if (line[len] == '\n')
+      break;
+    len++;
+  }
+  line[len] = 0;
+  return 0;
+}
+
+static void run_child(const char *request)
+{
+  char filename[FILENAME_MAX];
+  int len = 0, timeout = FORKSERVER_TIMEOUT;
+
+  signal(SIGCHLD, SIG_DFL);
+  close(listen_fd);
+  listen_fd = -1;
+
+  reopen_files();
+  while (*request == ' ')
+    request++;
+  while (*request != 0 && *request != ' ' && len < FILENAME_MAX - 1)
+    filename[len++] = *request++;
+  filename[len] = 0;
+  if (*request == ' ')
+    timeout = atoi(request);
+
+  if (len == 0 || trs_load_cmd(filename) != 0) {
+    reply("error\n");
+    _exit(EXIT_FAILURE);
+  }
+  deadline = z80_state.t_count +
+      (tstate_t)(timeout * z80_state.clockMHz * 1000000);
+
+  /* Run as fast as possible */
+  timer_overclock_rate = 0;
+  trs_turbo_mode(1);
+}
+
+/*
+ * Called at the checkpoint.  Only returns in the forked children,
+ * which then run the requested program.
+ */
+void trs_forkserver_checkpoint(void)
+{
+  trs_forkserver_armed = 0;
+  if (listen_fd < 0)
+    return;
+
+  debug("fork server: checkpoint at 0x%04x, listening on %s\n", Z80_PC,
+        trs_forkserver_socket);
+  reopen_files();
+  /* Threads don't survive fork(), the children start their own */
+  trs_io_stop();
+  trs_cassette_decode_wait();
+  /* Children are reaped automatically */
+  signal(SIGCHLD, SIG_IGN);
+
+  for (;;) {
+    char request[FILENAME_MAX + 16];
+    pid_t pid;
+    int const fd = accept(listen_fd, NULL, NULL);
+
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+      fatal("fork server: accept failed: %s", strerror(errno));
+    }
+    if (get_request(fd, request, sizeof(request)) == 0) {
+      fflush(NULL);
+      if ((pid = fork()) == 0) {
+        conn_fd = fd;
+        run_child(request);
+        return;
+      }
+      if (pid < 0) {
+        conn_fd = fd;
+        reply("error\n");
+        conn_fd = -1;
+      }
+    }
+    close(fd);
+  }
+}
+
+/* End a test with the given status; outside of a child just exit */
+void trs_forkserver_exit(int status)
+{
+  char text[32];
+
+  if (conn_fd < 0) {
+    trs_sdl_cleanup();
+    exit(status);
+  }
+  snprintf(text, sizeof(text), "exit %d\n", status);
+  reply(text);
+  _exit(status & 0xFF);
+}
+
+/* Check the timeout of a child, once per timer interrupt */
+void trs_forkserver_tick(void)
+{
+  if (conn_fd >= 0 && z80_state.t_count > deadline) {
+    reply("timeout\n");
+    _exit(EXIT_FAILURE);
+  }
+}
+
+#else /* _WIN32 */
+
+void trs_forkserver_init(void)
+{
+  fatal("fork server not supported on this platform");
+}
+
+void trs_forkserver_checkpoint(void)
+{
+  trs_forkserver_armed = 0;
+}
+
+void trs_forkserver_exit(int status)
+{
+  trs_sdl_cleanup();
+  exit(status);
+}
+
+void trs_forkserver_tick(void)
+{
+}
+
+#endif
@@ -28,12 +28,14 @@
  * mapped at ports 0xc8-0xcf, plus control registers at 0xc0-0xc1.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include "error.h"
 #include "trs.h"
 #include "trs_hard.h"
 #include "trs_imp_exp.h"
+#include "trs_sparse.h"
 #include "trs_state_save.h"
 
 #include "reed.h"
@@ -46,6 +48,7 @@
 /* Structure describing one drive */
 typedef struct {
   FILE* file;
+  SparseImage *sparse; /* non-NULL if file is a sparse image */
   char filename[FILENAME_MAX];
   /* Values decoded from rhh */
   int writeprot;
@@ -74,12 +77,42 @@ typedef struct {
   /* Number of bytes already done in current read/write */
   int bytesdone;
 
+  /* Data of the sector currently being transferred */
+  Uchar buf[TRS_HARD_SECSIZE];
+
   /* Drive geometries and files */
   Drive d[TRS_HARD_MAXDRIVES];
 } State;
 
 static State state;
 
+/* Sector cache.  Entries are kept on a doubly linked LRU list (most
+   recently used first) and hashed by drive and sector number. */
+typedef struct {
+  int drive;   /* -1 if entry is unused */
+  long lsn;    /* logical sector number within the image */
+  int prev;    /* LRU list links, -1 terminated */
+  int next;
+  int hnext;   /* hash chain link, -1 terminated */
+  Uchar data[TRS_HARD_SECSIZE];
+} CacheEntry;
+
+int trs_hard_cachesize = TRS_HARD_CACHE_DEFAULT;
+
+static CacheEntry *cache;
+static int *cache_hash;
+static int cache_entries;
+static int cache_hashmask;
+static int cache_head = -1;
+static int cache_tail = -1;
+
+static struct {
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long bytes_read;
+  unsigned long long bytes_written;
+} stats;
+
 /* Forward */
 static int hard_data_in(void);
 static void hard_data_out(int value);
@@ -93,7 +126,12 @@ static void hard_seek(int cmd);
 static int open_drive(int drive);
 static int find_sector(int newstatus);
 static int open_drive(int n);
+static void close_drive(Drive *d);
 static void set_dir_cyl(int cyl);
+static void cache_invalidate(int drive);
+static int fetch_sector(void);
+static int store_sector(void);
+static int next_sector(void);
 
 /* Powerup or reset button */
 void trs_hard_init(void)
@@ -121,8 +159,8 @@ void trs_hard_init(void)
 
 void trs_hard_attach(int drive, const char *diskname)
 {
-  if (state.d[drive].file != NULL)
-    fclose(state.d[drive].file);
+  close_drive(&state.d[drive]);
+  cache_invalidate(drive);
   snprintf(state.d[drive].filename, FILENAME_MAX, "%s", diskname);
   if (open_drive(drive) < 0) {
     trs_hard_remove(drive);
@@ -132,11 +170,10 @@ void trs_hard_attach(int drive, const char *diskname)
 
 void trs_hard_remove(int drive)
 {
-  if (state.d[drive].file != NULL)
-    fclose(state.d[drive].file);
+  close_drive(&state.d[drive]);
+  cache_invalidate(drive);
   trs_impexp_xtrshard_remove(drive);
   state.d[drive].filename[0] = 0;
-  state.d[drive].file = NULL;
 }
 
 char*
@@ -151,6 +188,75 @@ trs_hard_getwriteprotect(int unit)
   return state.d[unit].writeprot;
 }
 
+void
+trs_hard_debug(void)
+{
+  int i;
+  unsigned long long lookups = stats.hits + stats.misses;
+
+  printf("Hard disk controller state:\n");
+  printf("  present %d, control 0x%02x, status 0x%02x, error 0x%02x\n",
+	 state.present, state.control, state.status, state.error);
+  printf("  command 0x%02x, drive %d, cyl %d, head %d, sector %d, "
+	 "sector count %d, bytes done %d\n", state.command, state.drive,
+	 state.cyl, state.head, state.secnum, state.seccnt, state.bytesdone);
+  for (i = 0; i < TRS_HARD_MAXDRIVES; i++) {
+    Drive *d = &state.d[i];
+    if (d->filename[0] == 0) {
+      printf("Drive %d: EMPTY\n", i);
+    } else {
+      printf("Drive %d: %s, writeprot %d, cyls %d, heads %d, secs %d%s\n",
+	     i, d->filename, d->writeprot, d->cyls, d->heads, d->secs,
+	     d->sparse ? ", sparse" : "");
+    }
+  }
+  printf("Sector cache: %d of %d sectors allocated\n",
+	 cache_entries, trs_hard_cachesize);
+  printf("  hits %llu, misses %llu (%.1f%% hit rate)\n",
+	 stats.hits, stats.misses,
+	 lookups ? 100.0 * stats.hits / lookups : 0.0);
+  printf("  bytes read %llu, bytes written %llu\n",
+	 stats.bytes_read, stats.bytes_written);
+}
+
+/* Bytes read and written so far, for the performance statistics */
+unsigned long long trs_hard_bytes(void)
+{
+  return stats.bytes_read + stats.bytes_written;
+}
+
+/*
+ * The image of a drive is accessed through another file descriptor,
+ * by XTRSHARD.  Write out what stdio holds, so the other side sees
+ * it, and once the image has been written there, drop the cached
+ * sectors and stdio's read buffer, which may no longer match.
+ */
+void trs_hard_external(int unit, int written)
+{
+  Drive *d = &state.d[unit];
+
+  if (d->file != NULL)
+    fflush(d->file);
+  if (written)
+    cache_invalidate(unit);
+}
+
+/* Whether the image of a drive is in the sparse format */
+int trs_hard_is_sparse(int unit)
+{
+  Drive *d = &state.d[unit];
+  FILE *f;
+  int sparse;
+
+  if (d->sparse != NULL)
+    return 1;
+  if (d->filename[0] == 0 || (f = fopen(d->filename, "rb")) == NULL)
+    return 0;
+  sparse = trs_sparse_check(f);
+  fclose(f);
+  return sparse;
+}
+
 /* Read from an I/O port mapped to the controller */
 int trs_hard_in(int port)
 {
@@ -314,13 +420,8 @@ static void hard_read(int cmd)
   debug("hard_read drive %d cyl %d hd %d sec %d\n",
 	state.drive, state.cyl, state.head, state.secnum);
 #endif
-  if (cmd & TRS_HARD_MULTI) {
-    error("trs_hard: multi-sector read not supported (0x%02x)", cmd);
-    state.status = TRS_HARD_READY | TRS_HARD_SEEKDONE | TRS_HARD_ERR;
-    state.error = TRS_HARD_ABRTERR;
-    return;
-  }
-  find_sector(TRS_HARD_READY | TRS_HARD_SEEKDONE | TRS_HARD_DRQ);
+  if (find_sector(TRS_HARD_READY | TRS_HARD_SEEKDONE | TRS_HARD_DRQ))
+    fetch_sector();
 }
 
 static void hard_write(int cmd)
@@ -329,12 +430,6 @@ static void hard_write(int cmd)
   debug("hard_write drive %d cyl %d hd %d sec %d\n",
 	state.drive, state.cyl, state.head, state.secnum);
 #endif
-  if (cmd & TRS_HARD_MULTI) {
-    error("trs_hard: multi-sector write not supported (0x%02x)", cmd);
-    state.status = TRS_HARD_READY | TRS_HARD_SEEKDONE | TRS_HARD_ERR;
-    state.error = TRS_HARD_ABRTERR;
-    return;
-  }
   find_sector(TRS_HARD_READY | TRS_HARD_SEEKDONE | TRS_HARD_DRQ);
 }
 
@@ -404,10 +499,7 @@ static int open_drive(int drive)
   size_t res;
   int err = 0;
 
-  if (d->file != NULL) {
-    fclose(d->file);
-    d->file = NULL;
-  }
+  close_drive(d);
   if (d->filename[0] == 0)
     goto fail;
 
@@ -429,8 +521,21 @@ static int open_drive(int drive)
     d->writeprot = 0;
   }
 
-  /* Read in the Reed header and check some basic magic numbers (not all) */
-  res = fread(&rhh, sizeof(rhh), 1, d->file);
+  /* Sparse images carry a copy of the Reed header */
+  if (trs_sparse_check(d->file)) {
+    d->sparse = trs_sparse_open(d->file);
+    if (d->sparse == NULL) {
+      error("trs_hard: unreadable sparse hard drive image %s", d->filename);
+      err = -1;
+      goto fail;
+    }
+    memcpy(&rhh, d->sparse->reed, sizeof(rhh));
+    res = 1;
+  } else {
+    fseek(d->file, 0, 0);
+    /* Read in the Reed header and check some basic magic numbers (not all) */
+    res = fread(&rhh, sizeof(rhh), 1, d->file);
+  }
   if (res != 1 || rhh.id1 != 0x56 || rhh.id2 != 0xcb || rhh.ver != 0x10) {
     error("trs_hard: unrecognized hard drive image %s", d->filename);
     err = -1;
@@ -459,23 +564,36 @@ static int open_drive(int drive)
   return 0;
 
  fail:
-  if (d->file) fclose(d->file);
-  d->file = NULL;
+  close_drive(d);
   state.status = TRS_HARD_READY | TRS_HARD_SEEKDONE | TRS_HARD_ERR;
   state.error = TRS_HARD_NFERR;
   return err;
 }
 
+static void close_drive(Drive *d)
+{
+  if (d->sparse != NULL) {
+    trs_sparse_close(d->sparse);
+    d->sparse = NULL;
+  }
+  if (d->file != NULL) {
+    fclose(d->file);
+    d->file = NULL;
+  }
+}
+
 /*
  * Check whether the current position is in bounds for the geometry.
- * If not, return 0 and set the controller error status.  If so, fseek
- * the file to the start of the current sector, return 1, and set
- * the controller status to newstatus.
+ * If not, return 0 and set the controller error status.  If so,
+ * return 1 and set the controller status to newstatus.  The file is
+ * only opened here if it is not open yet, so that consecutive sector
+ * accesses do not pay for an fopen each.
  */
 static int find_sector(int newstatus)
 {
   Drive *d = &state.d[state.drive];
-  if (open_drive(state.drive) < 0) return 0;
+  if (d->file == NULL && open_drive(state.drive) < 0) return 0;
+  if (d->file == NULL) return 0;
   if (/**state.cyl >= d->cyls ||**/ /* ignore this limit */
       state.head >= d->heads ||
       state.secnum > d->secs /* allow 0-origin or 1-origin */ ) {
@@ -485,26 +603,282 @@ static int find_sector(int newstatus)
     state.error = TRS_HARD_NFERR;
     return 0;
   }
-  fseek(d->file,
-	sizeof(ReedHardHeader) +
-	TRS_HARD_SECSIZE * (state.cyl * d->heads * d->secs +
-			    state.head * d->secs +
-			    (state.secnum % d->secs)),
-	0);
   state.status = newstatus;
   return 1;
 }
 
-static int hard_data_in(void)
+/* Logical sector number of the current position within the image */
+static long current_lsn(void)
+{
+  Drive *d = &state.d[state.drive];
+  return (long) state.cyl * d->heads * d->secs +
+    state.head * d->secs + (state.secnum % d->secs);
+}
+
+static long lsn_offset(long lsn)
+{
+  return sizeof(ReedHardHeader) + TRS_HARD_SECSIZE * lsn;
+}
+
+/* (Re)allocate the cache if trs_hard_cachesize has changed */
+static void cache_setup(void)
+{
+  int i, hashsize;
+
+  if (cache_entries == trs_hard_cachesize)
+    return;
+  free(cache);
+  free(cache_hash);
+  cache = NULL;
+  cache_hash = NULL;
+  cache_entries = 0;
+  cache_head = cache_tail = -1;
+  if (trs_hard_cachesize <= 0) {
+    trs_hard_cachesize = 0;
+    return;
+  }
+
+  for (hashsize = 1; hashsize < trs_hard_cachesize; hashsize <<= 1)
+    ;
+  cache = (CacheEntry *) malloc(trs_hard_cachesize * sizeof(CacheEntry));
+  cache_hash = (int *) malloc(hashsize * sizeof(int));
+  if (cache == NULL || cache_hash == NULL) {
+    error("trs_hard: failed to allocate %d sector cache entries",
+	  trs_hard_cachesize);
+    free(cache);
+    free(cache_hash);
+    cache = NULL;
+    cache_hash = NULL;
+    trs_hard_cachesize = 0;
+    return;
+  }
+  cache_entries = trs_hard_cachesize;
+  cache_hashmask = hashsize - 1;
+  for (i = 0; i < hashsize; i++)
+    cache_hash[i] = -1;
+  /* Chain all entries into the LRU list as unused */
+  for (i = 0; i < cache_entries; i++) {
+    cache[i].drive = -1;
+    cache[i].hnext = -1;
+    cache[i].prev = i - 1;
+    cache[i].next = (i + 1 < cache_entries) ? i + 1 : -1;
+  }
+  cache_head = 0;
+  cache_tail = cache_entries - 1;
+}
+
+static int cache_bucket(int drive, long lsn)
+{
+  return (int) ((lsn * TRS_HARD_MAXDRIVES + drive) & cache_hashmask);
+}
+
+static void cache_unlink(int i)
+{
+  if (cache[i].prev >= 0)
+    cache[cache[i].prev].next = cache[i].next;
+  else
+    cache_head = cache[i].next;
+  if (cache[i].next >= 0)
+    cache[cache[i].next].prev = cache[i].prev;
+  else
+    cache_tail = cache[i].prev;
+}
+
+static void cache_make_mru(int i)
+{
+  if (cache_head == i)
+    return;
+  cache_unlink(i);
+  cache[i].prev = -1;
+  cache[i].next = cache_head;
+  if (cache_head >= 0)
+    cache[cache_head].prev = i;
+  cache_head = i;
+  if (cache_tail < 0)
+    cache_tail = i;
+}
+
+static void cache_make_lru(int i)
+{
+  if (cache_tail == i)
+    return;
+  cache_unlink(i);
+  cache[i].next = -1;
+  cache[i].prev = cache_tail;
+  if (cache_tail >= 0)
+    cache[cache_tail].next = i;
+  cache_tail = i;
+  if (cache_head < 0)
+    cache_head = i;
+}
+
+static void cache_unhash(int i)
+{
+  int *link = &cache_hash[cache_bucket(cache[i].drive, cache[i].lsn)];
+
+  while (*link >= 0) {
+    if (*link == i) {
+      *link = cache[i].hnext;
+      break;
+    }
+    link = &cache[*link].hnext;
+  }
+  cache[i].drive = -1;
+}
+
+static int cache_lookup(int drive, long lsn)
+{
+  int i;
+
+  if (cache == NULL)
+    return -1;
+  for (i = cache_hash[cache_bucket(drive, lsn)]; i >= 0; i = cache[i].hnext) {
+    if (cache[i].drive == drive && cache[i].lsn == lsn) {
+      cache_make_mru(i);
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Store a sector in the cache, evicting the least recently used one */
+static void cache_store(int drive, long lsn, const Uchar *data)
+{
+  int i, bucket;
+
+  if (cache == NULL)
+    return;
+  i = cache_lookup(drive, lsn);
+  if (i < 0) {
+    i = cache_tail;
+    if (cache[i].drive >= 0)
+      cache_unhash(i);
+    cache[i].drive = drive;
+    cache[i].lsn = lsn;
+    bucket = cache_bucket(drive, lsn);
+    cache[i].hnext = cache_hash[bucket];
+    cache_hash[bucket] = i;
+    cache_make_mru(i);
+  }
+  memcpy(cache[i].data, data, TRS_HARD_SECSIZE);
+}
+
+/* Drop all cached sectors of a drive, or of all drives if drive < 0 */
+static void cache_invalidate(int drive)
+{
+  int i;
+
+  for (i = 0; i < cache_entries; i++) {
+    if (cache[i].drive >= 0 && (drive < 0 || cache[i].drive == drive)) {
+      cache_unhash(i);
+      cache_make_lru(i);
+    }
+  }
+}
+
+/*
+ * Fill the sector buffer with the current sector, either from the
+ * cache or from the image file.  Return 1 if OK, 0 on error.
+ */
+static int fetch_sector(void)
+{
+  Drive *d = &state.d[state.drive];
+  long lsn = current_lsn();
+  size_t res;
+  int i;
+
+  cache_setup();
+  i = cache_lookup(state.drive, lsn);
+  if (i >= 0) {
+    memcpy(state.buf, cache[i].data, TRS_HARD_SECSIZE);
+    stats.hits++;
+    return 1;
+  }
+  stats.misses++;
+  if (d->sparse != NULL) {
+    if (trs_sparse_read(d->sparse, lsn, state.buf) < 0) {
+      error("trs_hard: errno %d while reading drive %d", errno, state.drive);
+      state.status = TRS_HARD_READY | TRS_HARD_SEEKDONE | TRS_HARD_ERR;
+      state.error = TRS_HARD_DATAERR;
+      return 0;
+    }
+    stats.bytes_read += TRS_HARD_SECSIZE;
+    cache_store(state.drive, lsn, state.buf);
+    return 1;
+  }
+  if (fseek(d->file, lsn_offset(lsn), 0) < 0) {
+    error("trs_hard: errno %d while seeking drive %d", errno, state.drive);
+    state.status = TRS_HARD_READY | TRS_HARD_SEEKDONE | TRS_HARD_ERR;
+    state.error = TRS_HARD_NFERR;
+    return 0;
+  }
+  res = fread(state.buf, 1, TRS_HARD_SECSIZE, d->file);
+  stats.bytes_read += res;
+  /* Beyond the end of the image reads back as 0xff, as getc's EOF did */
+  if (res < TRS_HARD_SECSIZE)
+    memset(state.buf + res, 0xff, TRS_HARD_SECSIZE - res);
+  else
+    cache_store(state.drive, lsn, state.buf);
+  return 1;
+}
+
+/*
+ * Write the sector buffer through to the image file and the cache.
+ * Return 1 if OK, 0 on error.
+ */
+static int store_sector(void)
 {
   Drive *d = &state.d[state.drive];
+  long lsn = current_lsn();
+
+  cache_setup();
+  if (state.cyl == 0 && state.head == 0 && state.secnum == 0) {
+    set_dir_cyl(state.buf[2]);
+  }
+  if (d->sparse != NULL) {
+    if (trs_sparse_write(d->sparse, lsn, state.buf) < 0) {
+      cache_invalidate(state.drive);
+      return 0;
+    }
+  } else if (fseek(d->file, lsn_offset(lsn), 0) < 0 ||
+      fwrite(state.buf, TRS_HARD_SECSIZE, 1, d->file) != 1) {
+    /* The image may no longer match what we have cached */
+    cache_invalidate(state.drive);
+    return 0;
+  }
+  stats.bytes_written += TRS_HARD_SECSIZE;
+  cache_store(state.drive, lsn, state.buf);
+  return 1;
+}
+
+/*
+ * Done with one sector of a read or write.  For a multiple sector
+ * command, decrement the sector count and advance to the next sector;
+ * a count of 0 means 256 sectors.  Return 1 if another sector follows.
+ */
+static int next_sector(void)
+{
+  if ((state.command & TRS_HARD_MULTI) == 0)
+    return 0;
+  if (--state.seccnt == 0) {
+    state.status = TRS_HARD_READY | TRS_HARD_SEEKDONE;
+    return 0;
+  }
+  state.secnum++;
+  state.bytesdone = 0;
+  return find_sector(TRS_HARD_READY | TRS_HARD_SEEKDONE | TRS_HARD_DRQ);
+}
+
+static int hard_data_in(void)
+{
   if (trs_show_led)
     trs_hard_led(state.drive, 1);
   if ((state.command & TRS_HARD_CMDMASK) == TRS_HARD_READ &&
       (state.status & TRS_HARD_ERR) == 0) {
     if (state.bytesdone < TRS_HARD_SECSIZE) {
-      state.data = getc(d->file);
-      state.bytesdone++;
+      state.data = state.buf[state.bytesdone++];
+      if (state.bytesdone == TRS_HARD_SECSIZE && next_sector())
+	fetch_sector();
     }
   }
   return state.data;
@@ -520,14 +894,16 @@ static void hard_data_out(int value)
   if ((state.command & TRS_HARD_CMDMASK) == TRS_HARD_WRITE &&
       (state.status & TRS_HARD_ERR) == 0) {
     if (state.bytesdone < TRS_HARD_SECSIZE) {
-      if (state.cyl == 0 && state.head == 0 &&
-	  state.secnum == 0 && state.bytesdone == 2) {
-	set_dir_cyl(value);
-      }
-      res = putc(state.data, d->file);
-      state.bytesdone++;
-      if (res != EOF && state.bytesdone == TRS_HARD_SECSIZE) {
-	res = fflush(d->file);
+      state.buf[state.bytesdone++] = value;
+      if (state.bytesdone == TRS_HARD_SECSIZE) {
+	if (!store_sector())
+	  res = EOF;
+	else if (!next_sector()) {
+	  if (d->sparse != NULL)
+	    res = trs_sparse_flush(d->sparse) < 0 ? EOF : 0;
+	  else
+	    res = fflush(d->file);
+	}
       }
     }
   }
@@ -545,10 +921,12 @@ static void hard_data_out(int value)
 static void set_dir_cyl(int cyl)
 {
   Drive *d = &state.d[state.drive];
-  long where = ftell(d->file);
+  if (d->sparse != NULL) {
+    trs_sparse_set_header(d->sparse, 31, cyl);
+    return;
+  }
   fseek(d->file, 31, 0);
   putc(cyl, d->file);
-  fseek(d->file, where, 0);
 }
 
 static void trs_save_harddrive(FILE *file, Drive *d)
@@ -607,10 +985,9 @@ void trs_hard_load(FILE *file)
 {
   int i;
 
-  for (i = 0; i < TRS_HARD_MAXDRIVES; i++) {
-    if (state.d[i].file != NULL)
-      fclose(state.d[i].file);
-  }
+  for (i = 0; i < TRS_HARD_MAXDRIVES; i++)
+    close_drive(&state.d[i]);
+  cache_invalidate(-1);
   trs_load_int(file, &state.present, 1);
   trs_load_uchar(file, &state.control, 1);
   trs_load_uchar(file, &state.data, 1);
@@ -640,6 +1017,19 @@ void trs_hard_load(FILE *file)
       } else {
         state.d[i].writeprot = 0;
       }
+      if (trs_sparse_check(state.d[i].file))
+        state.d[i].sparse = trs_sparse_open(state.d[i].file);
+    }
+  }
+  /* The sector buffer is not part of the saved state: refill it
+     so that a transfer in progress can continue. */
+  if ((state.status & (TRS_HARD_DRQ | TRS_HARD_ERR)) == TRS_HARD_DRQ &&
+      state.d[state.drive].file != NULL) {
+    switch (state.command & TRS_HARD_CMDMASK) {
+    case TRS_HARD_READ:
+    case TRS_HARD_WRITE:
+      fetch_sector();
+      break;
     }
   }
 }
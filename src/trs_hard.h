@@ -39,6 +39,11 @@ extern void trs_hard_out(int port, int value);
 extern char trs_disk_dir[];
 extern char* trs_hard_getfilename(int unit);
 extern int trs_hard_getwriteprotect(int unit);
+extern void trs_hard_debug(void);
+extern unsigned long long trs_hard_bytes(void);
+extern void trs_hard_external(int unit, int written);
+extern int trs_hard_is_sparse(int unit);
+extern int trs_hard_cachesize;
 
 /* Sector size is always 256 for TRSDOS/LDOS/etc. */
 /* Other sizes currently not emulated */
@@ -49,6 +54,9 @@ extern int trs_hard_getwriteprotect(int unit);
 /* Other sizes currently not emulated */
 #define TRS_HARD_SEC_PER_TRK 32
 
+/* Default number of sectors held in the LRU sector cache */
+#define TRS_HARD_CACHE_DEFAULT 1024
+
 /*
  * Tandy-specific registers
  */
@@ -124,6 +132,7 @@ extern int trs_hard_getwriteprotect(int unit);
 
 /* Sector count register (read/write) */
 /* Used only for multiple sector accesses; otherwise ignored. */
+/* A count of 0 transfers 256 sectors. */
 /* Autodecrements when used. */
 #define TRS_HARD_SECCNT (TRS_HARD_DATA + 2)
 
@@ -195,7 +204,7 @@ extern int trs_hard_getwriteprotect(int unit);
  *  0010dm00
  *  d = 0 for interrupt on DRQ, 1 for interrupt at end (DMA style)
  *      TRS-80 always uses programmed I/O, INTRQ not connected, I believe.
- *  m = multiple sector flag (not emulated!)
+ *  m = multiple sector flag; transfers TRS_HARD_SECCNT sectors
  */
 #define TRS_HARD_READ  0x20
 #define TRS_HARD_DMA   0x08
@@ -203,7 +212,7 @@ extern int trs_hard_getwriteprotect(int unit);
 
 /* Write sector:
  *  00110m00
- *  m = multiple sector flag (not emulated!)
+ *  m = multiple sector flag; transfers TRS_HARD_SECCNT sectors
  */
 #define TRS_HARD_WRITE 0x30
 
@@ -235,10 +235,37 @@ void do_emt_close(void)
   }
 }
 
+/*
+ * Open the image of a drive for XTRSHARD.  It reads and writes the
+ * file directly, which would corrupt the block map of a sparse image,
+ * so those are refused.
+ */
+static int xtrshard_open(int unit, const char *filename, int oflag, int mode)
+{
+  if (trs_hard_is_sparse(unit)) {
+    error("XTRSHARD can't access sparse hard disk %s", filename);
+    errno = EINVAL;
+    return -1;
+  }
+  return open(filename, oflag, mode);
+}
+
+/* Drive of an XTRSHARD file descriptor, or -1 */
+static int xtrshard_unit(int fd)
+{
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    if (fd == xtrshard_fd[i])
+      return i;
+  }
+  return -1;
+}
+
 void do_emt_read(void)
 {
   int size;
-  int i;
+  int i, unit;
 
   if (Z80_HL + Z80_BC > 0x10000) {
     Z80_A = EFAULT;
@@ -252,6 +279,8 @@ void do_emt_read(void)
         trs_hard_led(i, 1);
     }
   }
+  if ((unit = xtrshard_unit(Z80_DE)) >= 0)
+    trs_hard_external(unit, FALSE);
   size = read(Z80_DE, mem_pointer(Z80_HL, 1), Z80_BC);
   if (size >= 0) {
     Z80_A = 0;
@@ -267,7 +296,7 @@ void do_emt_read(void)
 void do_emt_write(void)
 {
   int size;
-  int i;
+  int i, unit;
 
   if (trs_emtsafe) {
     error("emt_write: potentially dangerous emulator trap blocked");
@@ -287,7 +316,11 @@ void do_emt_write(void)
         trs_hard_led(i, 1);
     }
   }
+  if ((unit = xtrshard_unit(Z80_DE)) >= 0)
+    trs_hard_external(unit, FALSE);
   size = write(Z80_DE, mem_pointer(Z80_HL, 0), Z80_BC);
+  if (unit >= 0)
+    trs_hard_external(unit, TRUE);
   if (size >= 0) {
     Z80_A = 0;
     Z80_F |= ZERO_MASK;
@@ -608,6 +641,18 @@ void do_emt_misc(void)
   case 25:
     lowercase = Z80_HL;
     break;
+  case 26:
+    if (trs_forkserver_socket[0])
+      trs_forkserver_checkpoint();
+    else
+      error("unsupported function code to emt_misc");
+    break;
+  case 27:
+    if (trs_forkserver_socket[0])
+      trs_forkserver_exit(Z80_HL);
+    else
+      error("unsupported function code to emt_misc");
+    break;
   default:
     error("unsupported function code to emt_misc");
     break;
@@ -616,7 +661,7 @@ void do_emt_misc(void)
 
 void do_emt_ftruncate(void)
 {
-  int i, result;
+  int i, result, unit;
   off_t offset;
   if (trs_emtsafe) {
     error("emt_ftruncate: potentially dangerous emulator trap blocked");
@@ -633,11 +678,15 @@ void do_emt_ftruncate(void)
   for (i = 0; i < 8; i++) {
     offset = offset + (mem_read(Z80_HL + i) << i*8);
   }
+  if ((unit = xtrshard_unit(Z80_DE)) >= 0)
+    trs_hard_external(unit, FALSE);
 #ifdef _WIN32
   result = chsize(Z80_DE, offset);
 #else
   result = ftruncate(Z80_DE, offset);
 #endif
+  if (unit >= 0)
+    trs_hard_external(unit, TRUE);
   if (result == 0) {
     Z80_A = 0;
     Z80_F |= ZERO_MASK;
@@ -710,8 +759,10 @@ void do_emt_opendisk(void)
     int hard_unit = name[strlen(name) -1] - '0';
     if (hard_unit >= 0 && hard_unit <= 3) {
       snprintf(od[i].filename, FILENAME_MAX, "%s", trs_hard_getfilename(hard_unit));
-      od[i].fd = open(od[i].filename, oflag, Z80_DE);
+      trs_hard_external(hard_unit, FALSE);
+      od[i].fd = xtrshard_open(hard_unit, od[i].filename, oflag, Z80_DE);
       od[i].oflag = oflag;
+      trs_hard_external(hard_unit, TRUE);
       if (od[i].fd >= 0)
         od[i].xtrshard = 1;
       xtrshard_fd[hard_unit] = od[i].fd;
@@ -861,9 +912,13 @@ void trs_imp_exp_load(FILE *file)
   }
   for (i = 0; i < MAX_OPENDISK; i++) {
     if (od[i].inuse) {
-      od[i].fd = open(od[i].filename, od[i].oflag);
-      if (od[i].xtrshard)
+      if (od[i].xtrshard) {
+        od[i].fd = xtrshard_open(od[i].xtrshard_unit, od[i].filename,
+                                 od[i].oflag, 0666);
         xtrshard_fd[od[i].xtrshard_unit] = od[i].fd;
+      } else {
+        od[i].fd = open(od[i].filename, od[i].oflag);
+      }
     }
   }
 }
@@ -877,7 +932,7 @@ trs_impexp_xtrshard_attach(int drive, const char *filename)
     if (od[i].inuse && od[i].xtrshard && (od[i].xtrshard_unit == drive)) {
       close(od[i].fd);
       snprintf(od[i].filename, FILENAME_MAX, "%s", filename);
-      od[i].fd = open(filename, od[i].oflag);
+      od[i].fd = xtrshard_open(drive, filename, od[i].oflag, 0666);
       xtrshard_fd[od[i].xtrshard_unit] = od[i].fd;
     }
   }
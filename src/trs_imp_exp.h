@@ -230,6 +230,9 @@
  *         After,  HL = 0 or 1
  *    25 = disable/enable lowercase (meaningful only for Model I)
  *         Before,  HL = 0 or 1
+ *    26 = fork server checkpoint (see -forkserver)
+ *    27 = exit emulator with status, or end a fork server test
+ *         Before,  HL = exit status
  *
  * ED3D emt_ftruncate
  *         Before, DE =  fd
@@ -343,15 +343,16 @@ trs_timer_event(void)
 
 void trs_timer_sync_with_host(void)
 {
-  Uint32 curtime;
+  Uint32 curtime, sleeptime;
   static Uint32 lasttime = 0;
 
-  curtime = SDL_GetTicks();
+  sleeptime = curtime = SDL_GetTicks();
 
   if (lasttime + deltatime > curtime)
     SDL_Delay(lasttime + deltatime - curtime);
 
   curtime = SDL_GetTicks();
+  sleeptime = curtime - sleeptime;
 
   lasttime += deltatime;
   if ((lasttime + deltatime) < curtime)
@@ -362,6 +363,14 @@ void trs_timer_sync_with_host(void)
     trs_hard_led(0,0);
   }
   trs_timer_event();
+  trs_rewind_tick();
+  trs_forkserver_tick();
+  trs_iostats_tick();
+  trs_perf_tick(sleeptime);
+  trs_io_poll();
+#ifdef ZBX
+  debug_gdb_tick();
+#endif
 }
 
 void
@@ -414,10 +423,9 @@ trs_timer_init(void)
       mem_write(NEWDOS3_SEC, lt->tm_sec);
 
       if (trs_model >= 4) {
-        extern Uchar memory[];
-        memory[LDOS4_MONTH] = lt->tm_mon + 1;
-        memory[LDOS4_DAY] = lt->tm_mday;
-        memory[LDOS4_YEAR] = lt->tm_year;
+        mem_write_phys(LDOS4_MONTH, lt->tm_mon + 1);
+        mem_write_phys(LDOS4_DAY, lt->tm_mday);
+        mem_write_phys(LDOS4_YEAR, lt->tm_year);
       }
   }
 }
@@ -466,10 +474,13 @@ trs_turbo_mode(int mode)
   if (mode != -1)
     timer_overclock = mode;
 
-  if (timer_overclock)
+  if (timer_overclock && timer_overclock_rate == 0)
+    deltatime = 0; /* As fast as possible */
+  else if (timer_overclock)
     deltatime = 1000 / (timer_overclock_rate * timer_hz);
   else
     deltatime = 1000 / timer_hz;
+  trs_screen_frame_skip(timer_overclock && timer_overclock_rate == 0);
 
   if (trs_show_led)
     trs_turbo_led();
@@ -504,6 +515,24 @@ trs_schedule_event(trs_event_func f, int arg, int countdown)
   if (z80_state.sched == 0) z80_state.sched--;
 }
 
+/* Device class of an event function, for the I/O statistics */
+static int event_device(trs_event_func f)
+{
+  if (f == trs_disk_done || f == trs_disk_lostdata || f == trs_disk_firstdrq)
+    return IOSTATS_DISK;
+  if (f == assert_state_void || f == transition_out ||
+      f == trs_cassette_kickoff || f == trs_cassette_update ||
+      f == trs_cassette_rise_interrupt || f == trs_cassette_fall_interrupt)
+    return IOSTATS_CASSETTE;
+  if (f == trs_uart_set_avail || f == trs_uart_set_empty)
+    return IOSTATS_UART;
+  if (f == orch90_flush)
+    return IOSTATS_SOUND;
+  if (f == trs_reset_button_interrupt)
+    return IOSTATS_RESET;
+  return IOSTATS_OTHER;
+}
+
 /*
  * If an event is scheduled, do it now.  (If the event function
  * schedules a new event, however, leave that one pending.)
@@ -515,6 +544,8 @@ trs_do_event(void)
   if (f) {
     event_func = NULL;
     z80_state.sched = 0;
+    if (trs_iostats)
+      trs_iostats_event(event_device(f));
     f(event_arg);
   }
 }
@@ -45,6 +45,8 @@
 
 #include <time.h>
 
+#include <SDL.h>
+
 #include "error.h"
 #include "trs.h"
 #include "trs_imp_exp.h"
@@ -54,6 +56,7 @@
 #include "trs_stringy.h"
 #include "trs_uart.h"
 #include "trsio-wrapper.h"
+#include "xray.h"
 #include "frehd.h"
 
 #define USE_FREHD
@@ -65,38 +68,148 @@ static int rominimage = 0;  /* Model 4p */
 
 int trs_io_debug_flags = 0;
 
-/*ARGSUSED*/
-void z80_out(int port, int value)
+/*
+ * Port handlers.  The dispatch tables below map each port to one of
+ * them for the emulated model; unused ports read as 0xFF.
+ */
+
+/* Ports common to all models */
+static int in_none(int port)
 {
-  if (trs_io_debug_flags & IODEBUG_OUT) {
-    debug("out (0x%02x), 0x%02x; pc 0x%04x\n", port, value, z80_state.pc.word);
+  return 0xff; /* value returned for nonexistent ports */
+}
+
+static void out_none(int port, int value)
+{
+}
+
+/* Support for a special HW real-time clock (TimeDate80?)
+ * I used to have.  It was a small card-edge unit with a
+ * battery that held the time/date with power off.
+ * - Joe Peterson (joe@skyrush.com)
+ *
+ * According to the LDOS Quarterly 1-6, TChron1, TRSWatch, and
+ * TimeDate80 are accessible at high ports 0xB0-0xBC, while
+ * T-Timer is accessible at high ports 0xC0-0xCC.  It does
+ * not say where the low ports were; Joe's code had 0x70-0x7C,
+ * so I presume that's correct at least for the TimeDate80.
+ * Note: 0xC0-0xCC conflicts with Radio Shack hard disk, so
+ * clock access at these ports is disabled starting in xtrs 4.1.
+ *
+ * These devices were based on the MSM5832 chip, which returns only
+ * a 2-digit year.  It's not clear what software will do with the
+ * date in years beyond 1999.
+ */
+static int in_clock(int port)
+{
+  struct tm *time_info;
+  time_t time_secs;
+
+  time_secs = time(NULL);
+  time_info = localtime(&time_secs);
+
+  switch (port & 0x0F) {
+  case 0xC: /* year (high) */
+    return (time_info->tm_year / 10) % 10;
+  case 0xB: /* year (low) */
+    return (time_info->tm_year % 10);
+  case 0xA: /* month (high) */
+    return ((time_info->tm_mon + 1) / 10);
+  case 0x9: /* month (low) */
+    return ((time_info->tm_mon + 1) % 10);
+  case 0x8: /* date (high) and leap year (bit 2) */
+    return ((time_info->tm_mday / 10) | ((time_info->tm_year % 4) ? 0 : 4));
+  case 0x7: /* date (low) */
+    return (time_info->tm_mday % 10);
+  case 0x6: /* day-of-week */
+    return time_info->tm_wday;
+  case 0x5: /* hours (high) and PM (bit 2) and 24hr (bit 3) */
+    return ((time_info->tm_hour / 10) | 8);
+  case 0x4: /* hours (low) */
+    return (time_info->tm_hour % 10);
+  case 0x3: /* minutes (high) */
+    return (time_info->tm_min / 10);
+  case 0x2: /* minutes (low) */
+    return (time_info->tm_min % 10);
+  case 0x1: /* seconds (high) */
+    return (time_info->tm_sec / 10);
+  case 0x0: /* seconds (low) */
+  default:
+    return (time_info->tm_sec % 10);
   }
+}
+
+static int in_joystick(int port)
+{
+  return trs_joystick_in();
+}
 
-  /* First, ports common to all models */
-  switch (port) {
-  case 0xc2:
-  case 0xc3:
-  case 0xc4:
-  case 0xc5:
-  case 0xc6:
-  case 0xc7:
-  case TRS_HARD_WP:       /* 0xC0 */
-  case TRS_HARD_CONTROL:  /* 0xC1 */
-  case TRS_HARD_DATA:     /* 0xC8 */
-  case TRS_HARD_ERROR:    /* 0xC9 */ /*=TRS_HARD_PRECOMP*/
-  case TRS_HARD_SECCNT:   /* 0xCA */
-  case TRS_HARD_SECNUM:   /* 0xCB */
-  case TRS_HARD_CYLLO:    /* 0xCC */
-  case TRS_HARD_CYLHI:    /* 0xCD */
-  case TRS_HARD_SDH:      /* 0xCE */
-  case TRS_HARD_STATUS:   /* 0xCF */ /*=TRS_HARD_COMMAND*/
 #ifdef USE_FREHD
-    frehd_out(port, value);
+/* A data or task file register was written since the last action check */
+static int frehd_pending;
+#endif
+
+static int in_hard(int port)
+{
+  int value;
+
+#ifdef USE_FREHD
+  value = frehd_in(port);
+  /*
+   * Reading the WD1010 task file and data registers only returns what
+   * is there; actions start on a write.  FreHD's own ports at 0xC2 to
+   * 0xC7 may still act on a read.  A write deferred by out_hard is
+   * acted on before the Z80 can see its result.
+   */
+  if (frehd_pending || (port >= 0xC2 && port <= 0xC7)) {
+    frehd_pending = FALSE;
     frehd_check_action();
+  }
 #else
-    trs_hard_out(port, value);
+  value = trs_hard_in(port);
 #endif
-    break;
+  return value;
+}
+
+static void out_hard(int port, int value)
+{
+#ifdef USE_FREHD
+  frehd_out(port, value);
+  /*
+   * Check for an action only on the control, FreHD and command ports.
+   * A write to the data register or task file (0xC8 to 0xCE) defers
+   * the check to the next read of a FreHD port or write to one of the
+   * others, so that transferring a sector doesn't check every byte.
+   */
+  if (port >= 0xC8 && port <= 0xCE) {
+    frehd_pending = TRUE;
+  } else {
+    frehd_pending = FALSE;
+    frehd_check_action();
+  }
+#else
+  trs_hard_out(port, value);
+#endif
+}
+
+static int in_uart(int port)
+{
+  switch (port) {
+  case TRS_UART_MODEM:    /* 0xE8 */
+    return trs_uart_modem_in();
+  case TRS_UART_SWITCHES: /* 0xE9 */
+    return trs_uart_switches_in();
+  case TRS_UART_STATUS:   /* 0xEA */
+    return trs_uart_status_in();
+  case TRS_UART_DATA:     /* 0xEB */
+  default:
+    return trs_uart_data_in();
+  }
+}
+
+static void out_uart(int port, int value)
+{
+  switch (port) {
   case TRS_UART_RESET:    /* 0xE8 */
     trs_uart_reset_out(value);
     break;
@@ -109,515 +222,607 @@ void z80_out(int port, int value)
   case TRS_UART_DATA:     /* 0xEB */
     trs_uart_data_out(value);
     break;
-  case 0x43: /* Alpha Technologies SuperMem */
-      if (trs_model < 4) {
-        mem_bank_base(value);
-        break;
-      }
   }
+}
 
-  if (trs_model == 1) {
-    /* Next, Model I only */
-    switch (port) {
-    case 0x00: /* HRG off */
-    case 0x01: /* HRG on */
-      hrg_onoff(port);
-      break;
-    case 0x02: /* HRG write address low byte */
-      hrg_write_addr(value, 0xff);
-      break;
-    case 0x03: /* HRG write address high byte */
-      hrg_write_addr(value << 8, 0x3f00);
-      break;
-    case 0x05: /* HRG write data byte */
-      hrg_write_data(value);
-      break;
-    case 0xB9: /* Orchestra-85 left channel */
-      trs_orch90_out(1, value);
-      break;
-      /* Selector doesn't decode A5 */
-    case 0x1F:
-    case 0x3F:
-      selector_out(value);
-      break;
-    case 0xB5: /* Orchestra-85 right channel */
-      trs_orch90_out(2, value);
-      break;
-    case 0xEC:
-      lowe_le18_write_data(value);
-      break;
-    case 0xED:
-      lowe_le18_write_x(value);
-      break;
-    case 0xEE:
-      lowe_le18_write_y(value);
-      break;
-    case 0xEF:
-      lowe_le18_write_control(value);
-      break;
-    case 0xF0:
-    case 0xF1:
-    case 0xF2:
-    case 0xF3:
-    case 0xF4:
-    case 0xF5:
-    case 0xF6:
-    case 0xF7:
-      stringy_out(port & 7, value);
-      break;
-    case 0xFD:
-      /* GENIE location of printer port */
-      trs_printer_write(value);
-      break;
-    case 0xFE:
-      /* Typical location for clock speedup kits */
-      if (speedup)
-        trs_timer_speed(value);
-      break;
-    case 0xFF:
-      /* screen mode select is on D3 line */
-      modesel = (value >> 3) & 1;
-      trs_screen_expanded(modesel);
-      /* do cassette emulation */
-      trs_cassette_motor((value >> 2) & 1);
-      trs_cassette_out(value & 0x3);
-      break;
-    default:
-      break;
-    }
+/* Alpha Technologies SuperMem (0x43), Huffman memory expansion (0x94) */
+static int in_bank_base(int port)
+{
+  return mem_read_bank_base();
+}
 
-  } else {
-    /* Next, Models III/4/4P only */
-    switch (port) {
-    case 31:
-      if (!trsio_z80_out(value)) {
-	trsio_process_in_background();
-        trs_iobus_interrupt(1);
-      }
-      break;
-    case 0x43: /* Alpha Technologies SuperMem */
-      if (trs_model == 3)
-          mem_bank_base(value);
-      break;
-    case 0x5f: /* Sprinter III */
-      if (trs_model == 3)
-          trs_timer_speed(value);
-      break;
-    case 0x79: /* Orchestra-90 left channel */
-      trs_orch90_out(1, value);
-      break;
-    case 0x75: /* Orchestra-90 right channel */
-      trs_orch90_out(2, value);
-      break;
-    case 0x80:
-      if (trs_model >= 3) grafyx_write_x(value);
-      break;
-    case 0x81:
-      if (trs_model >= 3) grafyx_write_y(value);
-      break;
-    case 0x82:
-      if (trs_model >= 3) grafyx_write_data(value);
-      break;
-    case 0x83:
-      if (trs_model >= 3) grafyx_write_mode(value);
-      break;
-    case 0x84:
-    case 0x85:
-    case 0x86:
-    case 0x87:
-      if (trs_model >= 4) {
-	int changes = value ^ ctrlimage;
-	if (changes & 0x80) {
-	  mem_video_page((value & 0x80) >> 7);
-	}
-	if (changes & 0x70) {
-	  mem_bank((value & 0x70) >> 4);
-	}
-	if (changes & 0x08) {
-	  trs_screen_inverse((value & 0x08) >> 3);
-	}
-	if (changes & 0x04) {
-	  trs_screen_80x24((value & 0x04) >> 2);
-	}
-	if (changes & 0x03) {
-	  mem_map(value & 0x03);
-	}
-	ctrlimage = value;
-      }
-      break;
-    case 0x8c:
-      if (trs_model >= 4) grafyx_write_xoffset(value);
-      break;
-    case 0x8d:
-      if (trs_model >= 4) grafyx_write_yoffset(value);
-      break;
-    case 0x8e:
-      if (trs_model >= 4) grafyx_write_overlay(value);
-      break;
-    case 0x90:
-      /* HyperMem uses bits 4-1 of this port, 0 is the existing
-         sound */
-      if (hypermem && trs_model >= 4)
-        mem_bank_base(value);
-      /* Fall through - we affect the sound as well */
-    case 0x91:
-    case 0x92:
-    case 0x93:
-      trs_sound_out(value & 1);
-      break;
-    case 0x94:			/* Huffman memory expansion */
-      if (trs_model >= 4 && huffman_ram)
-        mem_bank_base(value);
-      break;
-    case 0x9C:
-    case 0x9D: /* !!? */
-    case 0x9E: /* !!? */
-    case 0x9F: /* !!? */
-      if (trs_model == 5 /*4p*/) {
-	rominimage = value & 1;
-	mem_romin(rominimage);
-      }
-      break;
-    case 0xE0:
-    case 0xE1:
-    case 0xE2:
-    case 0xE3:
-      trs_interrupt_mask_write(value);
-      break;
-    case TRSDISK3_INTERRUPT: /* 0xE4 */
-    case 0xE5:
-    case 0xE6:
-    case 0xE7:
-      trs_nmi_mask_write(value);
-      break;
-    case 0xEC:
-    case 0xED:
-    case 0xEE:
-    case 0xEF:
-      modeimage = value;
-      /* cassette motor is on D1 */
-      trs_cassette_motor((modeimage & 0x02) >> 1);
-      /* screen mode select is on D2 */
-      trs_screen_expanded((modeimage & 0x04) >> 2);
-      /* alternate char set is on D3 */
-      trs_screen_alternate(!((modeimage & 0x08) >> 3));
-      /* clock speed is on D6; it affects timer HZ too */
-      if (trs_model >= 4)
-        trs_timer_speed((modeimage & 0x40) >> 6);
-      break;
-    case TRSDISK3_COMMAND: /* 0xF0 */
-      trs_disk_command_write(value);
-      break;
-    case TRSDISK3_TRACK: /* 0xF1 */
-      trs_disk_track_write(value);
-      break;
-    case TRSDISK3_SECTOR: /* 0xF2 */
-      trs_disk_sector_write(value);
-      break;
-    case TRSDISK3_DATA: /* 0xF3 */
-      trs_disk_data_write(value);
-      break;
-    case TRSDISK3_SELECT: /* 0xF4 */
-    case 0xF5:
-    case 0xF6:
-    case 0xF7:
-      /* This should cause a 1-2us wait in T states... */
-      trs_disk_select_write(value);
-      break;
-    case 0xF8:
-    case 0xF9:
-    case 0xFA:
-    case 0xFB:
-      trs_printer_write(value);
-      break;
-    case 0xFC:
-    case 0xFD:
-    case 0xFE:
-    case 0xFF:
-      if (trs_model == 3 && (value & 0x20) && grafyx_get_microlabs()) {
-	/* do Model III Micro-Labs graphics card */
-	grafyx_m3_write_mode(value);
-      } else {
-	/* do cassette emulation */
-	trs_cassette_out(value & 3);
-      }
-      break;
-    default:
-      break;
-    }
-  }
-  return;
+static void out_bank_base(int port, int value)
+{
+  mem_bank_base(value);
 }
 
-/*ARGSUSED*/
-int z80_in(int port)
+static void out_orch90(int port, int value)
 {
-  int value = 0xff; /* value returned for nonexistent ports */
+  /* Orchestra-85 0xB9/0xB5, Orchestra-90 0x79/0x75 */
+  trs_orch90_out((port & 0x0F) == 9 ? 1 : 2, value);
+}
 
-  /* First, ports common to all models */
+static int in_printer(int port)
+{
+  return trs_printer_read();
+}
 
-  /* Support for a special HW real-time clock (TimeDate80?)
-   * I used to have.  It was a small card-edge unit with a
-   * battery that held the time/date with power off.
-   * - Joe Peterson (joe@skyrush.com)
-   *
-   * According to the LDOS Quarterly 1-6, TChron1, TRSWatch, and
-   * TimeDate80 are accessible at high ports 0xB0-0xBC, while
-   * T-Timer is accessible at high ports 0xC0-0xCC.  It does
-   * not say where the low ports were; Joe's code had 0x70-0x7C,
-   * so I presume that's correct at least for the TimeDate80.
-   * Note: 0xC0-0xCC conflicts with Radio Shack hard disk, so
-   * clock access at these ports is disabled starting in xtrs 4.1.
-   *
-   * These devices were based on the MSM5832 chip, which returns only
-   * a 2-digit year.  It's not clear what software will do with the
-   * date in years beyond 1999.
-   */
+static void out_printer(int port, int value)
+{
+  trs_printer_write(value);
+}
 
-  if ((port >= 0x70 && port <= 0x7C)
-      || (port >= 0xB0 && port <= 0xBC)
-      /*|| (port >= 0xC0 && port <= 0xCC)*/) {
-    struct tm *time_info;
-    time_t time_secs;
-
-    time_secs = time(NULL);
-    time_info = localtime(&time_secs);
-
-    switch (port & 0x0F) {
-    case 0xC: /* year (high) */
-      value = (time_info->tm_year / 10) % 10;
-      goto done;
-    case 0xB: /* year (low) */
-      value = (time_info->tm_year % 10);
-      goto done;
-    case 0xA: /* month (high) */
-      value = ((time_info->tm_mon + 1) / 10);
-      goto done;
-    case 0x9: /* month (low) */
-      value = ((time_info->tm_mon + 1) % 10);
-      goto done;
-    case 0x8: /* date (high) and leap year (bit 2) */
-      value = ((time_info->tm_mday / 10) | ((time_info->tm_year % 4) ? 0 : 4));
-      goto done;
-    case 0x7: /* date (low) */
-      value = (time_info->tm_mday % 10);
-      goto done;
-    case 0x6: /* day-of-week */
-      value = time_info->tm_wday;
-      goto done;
-    case 0x5: /* hours (high) and PM (bit 2) and 24hr (bit 3) */
-      value = ((time_info->tm_hour / 10) | 8);
-      goto done;
-    case 0x4: /* hours (low) */
-      value = (time_info->tm_hour % 10);
-      goto done;
-    case 0x3: /* minutes (high) */
-      value = (time_info->tm_min / 10);
-      goto done;
-    case 0x2: /* minutes (low) */
-      value = (time_info->tm_min % 10);
-      goto done;
-    case 0x1: /* seconds (high) */
-      value = (time_info->tm_sec / 10);
-      goto done;
-    case 0x0: /* seconds (low) */
-      value = (time_info->tm_sec % 10);
-      goto done;
-    }
+/* Model I only */
+static int in_m1_hrg_on(int port)
+{
+  hrg_onoff(port);
+  return 0xff;
+}
+
+static int in_m1_hrg_data(int port)
+{
+  return hrg_read_data();
+}
+
+static void out_m1_hrg(int port, int value)
+{
+  switch (port) {
+  case 0x00: /* HRG off */
+  case 0x01: /* HRG on */
+    hrg_onoff(port);
+    break;
+  case 0x02: /* HRG write address low byte */
+    hrg_write_addr(value, 0xff);
+    break;
+  case 0x03: /* HRG write address high byte */
+    hrg_write_addr(value << 8, 0x3f00);
+    break;
+  case 0x05: /* HRG write data byte */
+    hrg_write_data(value);
+    break;
   }
+}
+
+static void out_m1_selector(int port, int value)
+{
+  selector_out(value);
+}
 
+static int in_m1_lowe(int port)
+{
+  return lowe_le18_read();
+}
+
+static void out_m1_lowe(int port, int value)
+{
   switch (port) {
-  case 0x00:
-    value = trs_joystick_in();
-    goto done;
-  case 0xc2:
-  case 0xc3:
-  case 0xc4:
-  case 0xc5:
-  case 0xc6:
-  case 0xc7:
-  case TRS_HARD_WP:       /* 0xC0 */
-  case TRS_HARD_CONTROL:  /* 0xC1 */
-  case TRS_HARD_DATA:     /* 0xC8 */
-  case TRS_HARD_ERROR:    /* 0xC9 */ /*=TRS_HARD_PRECOMP*/
-  case TRS_HARD_SECCNT:   /* 0xCA */
-  case TRS_HARD_SECNUM:   /* 0xCB */
-  case TRS_HARD_CYLLO:    /* 0xCC */
-  case TRS_HARD_CYLHI:    /* 0xCD */
-  case TRS_HARD_SDH:      /* 0xCE */
-  case TRS_HARD_STATUS:   /* 0xCF */ /*=TRS_HARD_COMMAND*/
-#ifdef USE_FREHD
-    value = frehd_in(port);
-    frehd_check_action();
+  case 0xEC:
+    lowe_le18_write_data(value);
+    break;
+  case 0xED:
+    lowe_le18_write_x(value);
+    break;
+  case 0xEE:
+    lowe_le18_write_y(value);
+    break;
+  case 0xEF:
+    lowe_le18_write_control(value);
+    break;
+  }
+}
+
+static int in_m1_stringy(int port)
+{
+  return stringy_in(port & 7);
+}
+
+static void out_m1_stringy(int port, int value)
+{
+  stringy_out(port & 7, value);
+}
+
+static void out_m1_speedup(int port, int value)
+{
+  /* Typical location for clock speedup kits */
+  if (speedup)
+    trs_timer_speed(value);
+}
+
+static int in_m1_cassette(int port)
+{
+  return (!modesel ? 0x7f : 0x3f) | trs_cassette_in();
+}
+
+static void out_m1_cassette(int port, int value)
+{
+  /* screen mode select is on D3 line */
+  modesel = (value >> 3) & 1;
+  trs_screen_expanded(modesel);
+  /* do cassette emulation */
+  trs_cassette_motor((value >> 2) & 1);
+  trs_cassette_out(value & 0x3);
+}
+
+/*
+ * TRS-IO commands run on a worker thread, so that host network and file
+ * I/O doesn't stall the emulator.  Once trsio_z80_out() has a complete
+ * command, it is handed to the worker, which runs it and marks it done;
+ * the emulator then raises the I/O bus interrupt and IN 31 returns the
+ * result.  Like the card, port 31 holds one command at a time: touching
+ * it while a command runs waits for the worker, as the card would hold
+ * the Z80 in a wait state.
+ *
+ * trsio_status is the only state shared with the worker.  The emulator
+ * moves it from IDLE to BUSY and back, the worker from BUSY to DONE, so
+ * each side only ever stores a value the other is waiting for.  XRAY
+ * breakpoints and XRAM set by a command go to a staged copy, which the
+ * emulator takes before handing the command over and publishes once it
+ * sees the command done.
+ */
+enum { TRSIO_IDLE, TRSIO_BUSY, TRSIO_DONE };
+
+#ifdef SDL2
+static SDL_atomic_t trsio_status;
+#define TRSIO_GET()	SDL_AtomicGet(&trsio_status)
+#define TRSIO_SET(v)	SDL_AtomicSet(&trsio_status, (v))
 #else
-    value = trs_hard_in(port);
+static volatile int trsio_status;
+#define TRSIO_GET()	(trsio_status)
+#define TRSIO_SET(v)	(trsio_status = (v))
 #endif
-    goto done;
-  case TRS_UART_MODEM:    /* 0xE8 */
-    value = trs_uart_modem_in();
-    goto done;
-  case TRS_UART_SWITCHES: /* 0xE9 */
-    value = trs_uart_switches_in();
-    goto done;
-  case TRS_UART_STATUS:   /* 0xEA */
-    value = trs_uart_status_in();
-    goto done;
-  case TRS_UART_DATA:     /* 0xEB */
-    value = trs_uart_data_in();
-    goto done;
-  case 0x43: /* Supermem memory expansion */
-    if (trs_model < 4) {
-      value = mem_read_bank_base();
-      goto done;
-    }
+static SDL_sem *trsio_request;
+static SDL_sem *trsio_finished;
+static SDL_Thread *trsio_thread;
+static int trsio_quit;
+
+static int trsio_main(void *data)
+{
+  for (;;) {
+    SDL_SemWait(trsio_request);
+    if (trsio_quit)
+      break;
+    trsio_process_in_background();
+    TRSIO_SET(TRSIO_DONE);
+    SDL_SemPost(trsio_finished);
   }
+  return 0;
+}
 
-  if (trs_model == 1) {
-    /* Model I only */
-    switch (port) {
-#if 0 /* Conflicts with joystick port */
-    case 0x00: /* HRG off (undocumented) */
+static int trsio_start_worker(void)
+{
+  if (trsio_request == NULL && (trsio_request = SDL_CreateSemaphore(0)) == NULL)
+    return -1;
+  if (trsio_finished == NULL && (trsio_finished = SDL_CreateSemaphore(0)) == NULL)
+    return -1;
+  trsio_quit = FALSE;
+#ifdef SDL2
+  trsio_thread = SDL_CreateThread(trsio_main, "trs-io", NULL);
+#else
+  trsio_thread = SDL_CreateThread(trsio_main, NULL);
 #endif
-    case 0x01: /* HRG on (undocumented) */
-      hrg_onoff(port);
-      goto done;
-    case 0x04: /* HRG read data byte */
-      value = hrg_read_data();
-      goto done;
-    case 0x43: /* Supermem memory expansion */
-      value = mem_read_bank_base();
-      goto done;
-    case 0xEC:
-      return lowe_le18_read();
-      break;
-    case 0xF0:
-    case 0xF1:
-    case 0xF2:
-    case 0xF3:
-    case 0xF4:
-    case 0xF5:
-    case 0xF6:
-    case 0xF7:
-      value = stringy_in(port & 7);
-      goto done;
-    case 0xFD:
-      /* GENIE location of printer port */
-      value = trs_printer_read();
-      goto done;
-    case 0xFF:
-      value = (!modesel ? 0x7f : 0x3f) | trs_cassette_in();
-      goto done;
-    }
+  return trsio_thread == NULL ? -1 : 0;
+}
+
+/* Raise the I/O bus interrupt if the worker has finished a command;
+ * with wait set, wait for it to finish first. */
+static void trsio_complete(int wait)
+{
+  int const status = TRSIO_GET();
+
+  if (status == TRSIO_IDLE || (status == TRSIO_BUSY && !wait))
+    return;
+  SDL_SemWait(trsio_finished);
+  xray_publish();
+  TRSIO_SET(TRSIO_IDLE);
+  trs_iobus_interrupt(1);
+}
+
+void trs_io_poll(void)
+{
+  trsio_complete(FALSE);
+}
+
+/* Finish any command and end the worker; it restarts when needed */
+void trs_io_stop(void)
+{
+  if (trsio_thread == NULL)
+    return;
+  trsio_complete(TRUE);
+  trsio_quit = TRUE;
+  SDL_SemPost(trsio_request);
+  SDL_WaitThread(trsio_thread, NULL);
+  trsio_thread = NULL;
+}
+
+/* Models III/4/4P only */
+static int in_trsio(int port)
+{
+  trsio_complete(TRUE);
+  trs_iobus_interrupt(0);
+  return trsio_z80_in();
+}
+
+/* Hand a complete command to the worker */
+static void trsio_run(void)
+{
+  if (trs_iostats)
+    trs_iostats_event(IOSTATS_TRSIO);
+  xray_snapshot();
+  if (trsio_thread == NULL && trsio_start_worker() != 0) {
+    /* No thread: run the command right here */
+    trsio_process_in_background();
+    xray_publish();
+    trs_iobus_interrupt(1);
+    return;
+  }
+  TRSIO_SET(TRSIO_BUSY);
+  SDL_SemPost(trsio_request);
+}
+
+static void out_trsio(int port, int value)
+{
+  trsio_complete(TRUE);
+  if (!trsio_z80_out(value))
+    trsio_run();
+}
+
+static void out_m3_sprinter(int port, int value)
+{
+  /* Sprinter III */
+  trs_timer_speed(value);
+}
+
+static int in_grafyx(int port)
+{
+  return grafyx_read_data();
+}
 
+static void out_grafyx(int port, int value)
+{
+  switch (port) {
+  case 0x80:
+    grafyx_write_x(value);
+    break;
+  case 0x81:
+    grafyx_write_y(value);
+    break;
+  case 0x82:
+    grafyx_write_data(value);
+    break;
+  case 0x83:
+    grafyx_write_mode(value);
+    break;
+  case 0x8c:
+    grafyx_write_xoffset(value);
+    break;
+  case 0x8d:
+    grafyx_write_yoffset(value);
+    break;
+  case 0x8e:
+    grafyx_write_overlay(value);
+    break;
+  }
+}
+
+static void out_m4_control(int port, int value)
+{
+  int changes = value ^ ctrlimage;
+
+  if (changes & 0x80) {
+    mem_video_page((value & 0x80) >> 7);
+  }
+  if (changes & 0x70) {
+    mem_bank((value & 0x70) >> 4);
+  }
+  if (changes & 0x08) {
+    trs_screen_inverse((value & 0x08) >> 3);
+  }
+  if (changes & 0x04) {
+    trs_screen_80x24((value & 0x04) >> 2);
+  }
+  if (changes & 0x03) {
+    mem_map(value & 0x03);
+  }
+  ctrlimage = value;
+}
+
+static void out_sound(int port, int value)
+{
+  /* HyperMem uses bits 4-1 of this port, 0 is the existing sound */
+  if (port == 0x90 && hypermem && trs_model >= 4)
+    mem_bank_base(value);
+  trs_sound_out(value & 1);
+}
+
+static void out_m4_huffman(int port, int value)
+{
+  if (huffman_ram)
+    mem_bank_base(value);
+}
+
+static int in_m4p_romin(int port)
+{
+  return rominimage;
+}
+
+static void out_m4p_romin(int port, int value)
+{
+  rominimage = value & 1;
+  mem_romin(rominimage);
+}
+
+static int in_interrupt_latch(int port)
+{
+  trsio_complete(FALSE);
+  return trs_interrupt_latch_read();
+}
+
+static void out_interrupt_mask(int port, int value)
+{
+  trs_interrupt_mask_write(value);
+}
+
+static int in_nmi_latch(int port)
+{
+  return trs_nmi_latch_read();
+}
+
+static void out_nmi_mask(int port, int value)
+{
+  trs_nmi_mask_write(value);
+}
+
+static int in_timer_ack(int port)
+{
+  trs_timer_interrupt(0); /* acknowledge */
+  return 0xFF;
+}
+
+static void out_modeimage(int port, int value)
+{
+  modeimage = value;
+  /* cassette motor is on D1 */
+  trs_cassette_motor((modeimage & 0x02) >> 1);
+  /* screen mode select is on D2 */
+  trs_screen_expanded((modeimage & 0x04) >> 2);
+  /* alternate char set is on D3 */
+  trs_screen_alternate(!((modeimage & 0x08) >> 3));
+  /* clock speed is on D6; it affects timer HZ too */
+  if (trs_model >= 4)
+    trs_timer_speed((modeimage & 0x40) >> 6);
+}
+
+static int in_disk(int port)
+{
+  switch (port) {
+  case TRSDISK3_STATUS: /* 0xF0 */
+    return trs_disk_status_read();
+  case TRSDISK3_TRACK:  /* 0xF1 */
+    return trs_disk_track_read();
+  case TRSDISK3_SECTOR: /* 0xF2 */
+    return trs_disk_sector_read();
+  case TRSDISK3_DATA:   /* 0xF3 */
+  default:
+    return trs_disk_data_read();
+  }
+}
+
+static void out_disk(int port, int value)
+{
+  switch (port) {
+  case TRSDISK3_COMMAND: /* 0xF0 */
+    trs_disk_command_write(value);
+    break;
+  case TRSDISK3_TRACK:   /* 0xF1 */
+    trs_disk_track_write(value);
+    break;
+  case TRSDISK3_SECTOR:  /* 0xF2 */
+    trs_disk_sector_write(value);
+    break;
+  case TRSDISK3_DATA:    /* 0xF3 */
+    trs_disk_data_write(value);
+    break;
+  }
+}
+
+static int in_cp500_a11(int port)
+{
+  return cp500_a11_flipflop_toggle();
+}
+
+static void out_disk_select(int port, int value)
+{
+  /* This should cause a 1-2us wait in T states... */
+  trs_disk_select_write(value);
+}
+
+static int in_m3_printer(int port)
+{
+  return trs_printer_read() | (ctrlimage & 0x0F);
+}
+
+static int in_m3_cassette(int port)
+{
+  return (modeimage & 0x7e) | trs_cassette_in();
+}
+
+static void out_m3_cassette(int port, int value)
+{
+  if (trs_model == 3 && (value & 0x20) && grafyx_get_microlabs()) {
+    /* do Model III Micro-Labs graphics card */
+    grafyx_m3_write_mode(value);
   } else {
-    /* Models III/4/4P only */
-    switch (port) {
-    case 31:
-      trs_iobus_interrupt(0);
-      value = trsio_z80_in();
-      goto done;
-    case 0x43: /* Supermem memory expansion */
-      if (trs_model == 3)
-          value = mem_read_bank_base();
-      goto done;
-    case 0x82:
-      if (trs_model >= 3) {
-	value = grafyx_read_data();
-	goto done;
-      }
-      break;
-    case 0x94: /* Huffman memory expansion */
-      value = mem_read_bank_base();
-      goto done;
-    case 0x9C: /* !!? */
-    case 0x9D: /* !!? */
-    case 0x9E: /* !!? */
-    case 0x9F: /* !!? */
-      if (trs_model == 5 /*4p*/) {
-	value = rominimage;
-	goto done;
-      }
-      break;
-    case 0xc2:
-    case 0xc3:
-    case 0xc4:
-    case 0xc5:
-    case 0xc6:
-    case 0xc7:
-    case TRS_HARD_WP:      /* 0xC0 */
-    case TRS_HARD_CONTROL: /* 0xC1 */
-    case TRS_HARD_DATA:    /* 0xC8 */
-    case TRS_HARD_ERROR:   /* 0xC9 */ /*=TRS_HARD_PRECOMP*/
-    case TRS_HARD_SECCNT:  /* 0xCA */
-    case TRS_HARD_SECNUM:  /* 0xCB */
-    case TRS_HARD_CYLLO:   /* 0xCC */
-    case TRS_HARD_CYLHI:   /* 0xCD */
-    case TRS_HARD_SDH:     /* 0xCE */
-    case TRS_HARD_STATUS:  /* 0xCF */ /*=TRS_HARD_COMMAND*/
-#ifdef USE_FREHD
-      value = frehd_in(port);
-      frehd_check_action();
-#else
-      value = trs_hard_in(port);
+    /* do cassette emulation */
+    trs_cassette_out(value & 3);
+  }
+}
+
+/*
+ * Dispatch tables, built for the emulated model on first use and
+ * whenever the model changes.
+ */
+typedef int (*io_in_func)(int port);
+typedef void (*io_out_func)(int port, int value);
+
+static io_in_func port_in[256];
+static io_out_func port_out[256];
+static int port_model = -1;
+
+static void io_port(int first, int last, io_in_func in, io_out_func out)
+{
+  int port;
+
+  for (port = first; port <= last; port++) {
+    if (in != NULL)
+      port_in[port] = in;
+    if (out != NULL)
+      port_out[port] = out;
+  }
+}
+
+static void trs_io_init(void)
+{
+  port_model = trs_model;
+  io_port(0x00, 0xFF, in_none, out_none);
+
+  /* First, ports common to all models */
+  io_port(0x00, 0x00, in_joystick, NULL);
+  io_port(0xC0, 0xCF, in_hard, out_hard);
+  io_port(0xE8, 0xEB, in_uart, out_uart);
+  if (trs_model < 4)
+    io_port(0x43, 0x43, in_bank_base, out_bank_base);
+
+  if (trs_model == 1) {
+    /* Next, Model I only */
+    io_port(0x00, 0x03, NULL, out_m1_hrg);
+    io_port(0x05, 0x05, NULL, out_m1_hrg);
+#if 0 /* Conflicts with joystick port */
+    io_port(0x00, 0x00, in_m1_hrg_on, NULL); /* HRG off (undocumented) */
 #endif
-      goto done;
-      break;
-    case 0xE0:
-    case 0xE1:
-    case 0xE2:
-    case 0xE3:
-      value = trs_interrupt_latch_read();
-      goto done;
-    case 0xEC:
-    case 0xED:
-    case 0xEE:
-    case 0xEF:
-      trs_timer_interrupt(0); /* acknowledge */
-      value = 0xFF;
-      goto done;
-    case TRSDISK3_INTERRUPT: /* 0xE4 */
-      value = trs_nmi_latch_read();
-      goto done;
-    case TRSDISK3_STATUS: /* 0xF0 */
-      value = trs_disk_status_read();
-      goto done;
-    case TRSDISK3_TRACK: /* 0xF1 */
-      value = trs_disk_track_read();
-      goto done;
-    case TRSDISK3_SECTOR: /* 0xF2 */
-      value = trs_disk_sector_read();
-      goto done;
-    case TRSDISK3_DATA: /* 0xF3 */
-      value = trs_disk_data_read();
-      goto done;
-    case 0xF4:
-    case 0xF5:
-    case 0xF6:
-    case 0xF7:
-      value = cp500_a11_flipflop_toggle();
-      goto done;
-    case 0xF8:
-    case 0xF9:
-    case 0xFA:
-    case 0xFB:
-      value = trs_printer_read() | (ctrlimage & 0x0F);
-      goto done;
-    case 0xFC:
-    case 0xFD:
-    case 0xFF:
-      value = (modeimage & 0x7e) | trs_cassette_in();
-      goto done;
+    io_port(0x01, 0x01, in_m1_hrg_on, NULL);
+    io_port(0x04, 0x04, in_m1_hrg_data, NULL);
+    /* Selector doesn't decode A5 */
+    io_port(0x1F, 0x1F, NULL, out_m1_selector);
+    io_port(0x3F, 0x3F, NULL, out_m1_selector);
+    io_port(0xB5, 0xB5, NULL, out_orch90);
+    io_port(0xB9, 0xB9, NULL, out_orch90);
+    io_port(0xEC, 0xEC, in_m1_lowe, NULL);
+    io_port(0xEC, 0xEF, NULL, out_m1_lowe);
+    io_port(0xF0, 0xF7, in_m1_stringy, out_m1_stringy);
+    /* GENIE location of printer port */
+    io_port(0xFD, 0xFD, in_printer, out_printer);
+    io_port(0xFE, 0xFE, NULL, out_m1_speedup);
+    io_port(0xFF, 0xFF, in_m1_cassette, out_m1_cassette);
+  } else {
+    /* Next, Models III/4/4P only */
+    io_port(31, 31, in_trsio, out_trsio);
+    if (trs_model == 3)
+      io_port(0x5F, 0x5F, NULL, out_m3_sprinter);
+    io_port(0x75, 0x75, NULL, out_orch90);
+    io_port(0x79, 0x79, NULL, out_orch90);
+    io_port(0x80, 0x83, NULL, out_grafyx);
+    io_port(0x82, 0x82, in_grafyx, NULL);
+    if (trs_model >= 4) {
+      io_port(0x84, 0x87, NULL, out_m4_control);
+      io_port(0x8C, 0x8E, NULL, out_grafyx);
+      io_port(0x94, 0x94, NULL, out_m4_huffman);
     }
+    io_port(0x90, 0x93, NULL, out_sound);
+    io_port(0x94, 0x94, in_bank_base, NULL);
+    if (trs_model == 5) {
+      io_port(0x9C, 0x9F, in_m4p_romin, out_m4p_romin);
+    }
+    io_port(0xE0, 0xE3, in_interrupt_latch, out_interrupt_mask);
+    io_port(0xE4, 0xE4, in_nmi_latch, NULL);
+    io_port(0xE4, 0xE7, NULL, out_nmi_mask);
+    io_port(0xEC, 0xEF, in_timer_ack, out_modeimage);
+    io_port(0xF0, 0xF3, in_disk, out_disk);
+    io_port(0xF4, 0xF7, in_cp500_a11, out_disk_select);
+    io_port(0xF8, 0xFB, in_m3_printer, out_printer);
+    io_port(0xFC, 0xFD, in_m3_cassette, NULL);
+    io_port(0xFF, 0xFF, in_m3_cassette, NULL);
+    io_port(0xFC, 0xFF, NULL, out_m3_cassette);
   }
 
- done:
+  /* The clock overrides any other device */
+  io_port(0x70, 0x7C, in_clock, NULL);
+  io_port(0xB0, 0xBC, in_clock, NULL);
+  /*io_port(0xC0, 0xCC, in_clock, NULL);*/
+}
+
+/*ARGSUSED*/
+void z80_out(int port, int value)
+{
+  if (trs_io_debug_flags & IODEBUG_OUT) {
+    debug("out (0x%02x), 0x%02x; pc 0x%04x\n", port, value, z80_state.pc.word);
+  }
+  if (port_model != trs_model)
+    trs_io_init();
+  if (trs_iostats)
+    trs_iostats_port(port, 1, TRUE);
+
+  port_out[port & 0xFF](port & 0xFF, value);
+}
+
+/*ARGSUSED*/
+int z80_in(int port)
+{
+  int value;
+
+  if (port_model != trs_model)
+    trs_io_init();
+  if (trs_iostats)
+    trs_iostats_port(port, 1, FALSE);
+
+  value = port_in[port & 0xFF](port & 0xFF);
+
   if (trs_io_debug_flags & IODEBUG_IN) {
     debug("in (0x%02x) => 0x%02x; pc %04x\n", port, value, z80_state.pc.word);
   }
-
   return value;
 }
 
+/*
+ * Block transfers for INIR and OTIR.  Ports for which z80_block_port()
+ * is true take or deliver a whole block in one call; the transfer may
+ * stop short, but always moves at least one byte.
+ */
+int z80_block_port(int port, int writing)
+{
+  if (port_model != trs_model)
+    trs_io_init();
+
+  if (trs_io_debug_flags & (writing ? IODEBUG_OUT : IODEBUG_IN))
+    return FALSE;
+  if (writing)
+    return port_out[port & 0xFF] == out_trsio;
+  else
+    return port_in[port & 0xFF] == in_trsio;
+}
+
+int z80_in_block(int port, Uchar *buf, int count)
+{
+  trsio_complete(TRUE);
+  trs_iobus_interrupt(0);
+  trsio_z80_in_block(buf, count);
+  if (trs_iostats)
+    trs_iostats_port(port, count, FALSE);
+  return count;
+}
+
+int z80_out_block(int port, const Uchar *buf, int count)
+{
+  bool complete;
+
+  trsio_complete(TRUE);
+  count = trsio_z80_out_block(buf, count, &complete);
+  if (trs_iostats)
+    trs_iostats_port(port, count, TRUE);
+  if (complete)
+    trsio_run();
+  return count;
+}
+
 void trs_io_save(FILE *file)
 {
   trs_save_int(file, &modesel, 1);
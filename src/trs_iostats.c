@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2006-2011, Mark Grebe
+ * Copyright (C) 2018-2021, Jens Guenther
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * trs_iostats.c -- I/O port and device access statistics
+ *
+ * While trs_iostats is set, z80_in and z80_out count the accesses to
+ * each port, the Model I memory mapped devices count theirs, and the
+ * devices' scheduled events are counted per device.  For ports and
+ * memory mapped devices the T-states between accesses are summed, and
+ * the shortest gap is kept, which shows polling loops.  With -iostats
+ * <file> the counts are written to the file as JSON every emulated
+ * second; zbx shows them with the 'iostats' command.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "error.h"
+#include "trs.h"
+
+typedef struct {
+  unsigned long long count;
+  unsigned long long bytes;
+  unsigned long long gaps;    /* T-states between accesses, summed */
+  tstate_t min_gap;
+  tstate_t last;
+} iostat;
+
+#define MMIO_LATCH		0	/* Interrupt latch and drive select */
+#define MMIO_CASSETTE		1
+#define MMIO_PRINTER		2
+#define MMIO_FDC		3
+#define MMIO_KEYBOARD		4
+#define MMIO_VIDEO		5
+#define MMIO_OTHER		6
+#define MMIO_DEVICES		7
+
+static const char *mmio_names[MMIO_DEVICES] = {
+  "latch", "cassette", "printer", "fdc", "keyboard", "video", "other"
+};
+
+static const char *event_names[IOSTATS_EVENTS] = {
+  "disk", "cassette", "uart", "trsio", "sound", "reset", "other"
+};
+
+int trs_iostats = 0;
+char trs_iostats_file[FILENAME_MAX];
+
+static iostat port_stats[2][256];
+static iostat mmio_stats[2][MMIO_DEVICES];
+static unsigned long long event_stats[IOSTATS_EVENTS];
+static tstate_t iostats_start;
+static int iostats_ticks;
+
+static void count(iostat *s, int bytes)
+{
+  if (s->count) {
+    tstate_t const gap = z80_state.t_count - s->last;
+
+    s->gaps += gap;
+    if (s->count == 1 || gap < s->min_gap)
+      s->min_gap = gap;
+  }
+  s->count++;
+  s->bytes += bytes;
+  s->last = z80_state.t_count;
+}
+
+void trs_iostats_port(int port, int bytes, int writing)
+{
+  count(&port_stats[writing != 0][port & 0xFF], bytes);
+}
+
+/* Model I memory mapped devices, for addresses 0x37E0 and up */
+void trs_iostats_mmio(int address, int writing)
+{
+  int device;
+
+  if (address >= 0x3C00)
+    device = MMIO_VIDEO;
+  else if (address >= 0x3800)
+    device = MMIO_KEYBOARD;
+  else if (address >= 0x37EC && address <= 0x37EF)
+    device = MMIO_FDC;
+  else if (address >= 0x37E8 && address <= 0x37EB)
+    device = MMIO_PRINTER;
+  else if (address >= 0x37E4 && address <= 0x37E7)
+    device = MMIO_CASSETTE;
+  else if (address >= 0x37E0 && address <= 0x37E3)
+    device = MMIO_LATCH;
+  else
+    device = MMIO_OTHER;
+  count(&mmio_stats[writing != 0][device], 1);
+}
+
+void trs_iostats_event(int device)
+{
+  event_stats[device]++;
+}
+
+void trs_iostats_clear(void)
+{
+  memset(port_stats, 0, sizeof(port_stats));
+  memset(mmio_stats, 0, sizeof(mmio_stats));
+  memset(event_stats, 0, sizeof(event_stats));
+  iostats_start = z80_state.t_count;
+  iostats_ticks = 0;
+}
+
+static unsigned long long avg_gap(const iostat *s)
+{
+  return s->count > 1 ? s->gaps / (s->count - 1) : 0;
+}
+
+void trs_iostats_debug(void)
+{
+  int i, dir;
+
+  printf("I/O statistics %s, over %llu T-states:\n",
+         trs_iostats ? "enabled" : "disabled",
+         z80_state.t_count - iostats_start);
+  printf("  port/device  dir        count      bytes  avg gap  min gap\n");
+  for (i = 0; i < 256; i++) {
+    for (dir = 0; dir < 2; dir++) {
+      const iostat *s = &port_stats[dir][i];
+
+      if (s->count)
+        printf("  0x%02x         %-5s %10llu %10llu %8llu %8llu\n", i,
+               dir ? "out" : "in", s->count, s->bytes, avg_gap(s),
+               s->count > 1 ? s->min_gap : 0ULL);
+    }
+  }
+  for (i = 0; i < MMIO_DEVICES; i++) {
+    for (dir = 0; dir < 2; dir++) {
+      const iostat *s = &mmio_stats[dir][i];
+
+      if (s->count)
+        printf("  %-12s %-5s %10llu %10llu %8llu %8llu\n", mmio_names[i],
+               dir ? "write" : "read", s->count, s->bytes, avg_gap(s),
+               s->count > 1 ? s->min_gap : 0ULL);
+    }
+  }
+  printf("  events:");
+  for (i = 0; i < IOSTATS_EVENTS; i++)
+    printf(" %s %llu", event_names[i], event_stats[i]);
+  printf("\n");
+}
+
+static void save_stat(FILE *file, const char *name, const iostat *s)
+{
+  fprintf(file, "\"%s\": {\"count\": %llu, \"bytes\": %llu, "
+          "\"avg_gap\": %llu, \"min_gap\": %llu}", name, s->count, s->bytes,
+          avg_gap(s), s->count > 1 ? s->min_gap : 0ULL);
+}
+
+/* Write the statistics as JSON; the file is replaced atomically */
+int trs_iostats_save(const char *filename)
+{
+  char tmp[FILENAME_MAX + 4];
+  FILE *file;
+  const char *sep = "";
+  int i;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+  if ((file = fopen(tmp, "w")) == NULL) {
+    error("failed to write I/O statistics %s: %s", tmp, strerror(errno));
+    return -1;
+  }
+  fprintf(file, "{\"model\": %d, \"clock_mhz\": %.2f, "
+          "\"tstates\": %llu,\n \"ports\": [", trs_model, z80_state.clockMHz,
+          z80_state.t_count - iostats_start);
+  for (i = 0; i < 256; i++) {
+    if (port_stats[0][i].count == 0 && port_stats[1][i].count == 0)
+      continue;
+    fprintf(file, "%s\n  {\"port\": %d, ", sep, i);
+    save_stat(file, "in", &port_stats[0][i]);
+    fprintf(file, ", ");
+    save_stat(file, "out", &port_stats[1][i]);
+    fprintf(file, "}");
+    sep = ",";
+  }
+  fprintf(file, "],\n \"mmio\": [");
+  sep = "";
+  for (i = 0; i < MMIO_DEVICES; i++) {
+    if (mmio_stats[0][i].count == 0 && mmio_stats[1][i].count == 0)
+      continue;
+    fprintf(file, "%s\n  {\"device\": \"%s\", ", sep, mmio_names[i]);
+    save_stat(file, "read", &mmio_stats[0][i]);
+    fprintf(file, ", ");
+    save_stat(file, "write", &mmio_stats[1][i]);
+    fprintf(file, "}");
+    sep = ",";
+  }
+  fprintf(file, "],\n \"events\": {");
+  for (i = 0; i < IOSTATS_EVENTS; i++)
+    fprintf(file, "%s\"%s\": %llu", i ? ", " : "", event_names[i],
+            event_stats[i]);
+  fprintf(file, "}}\n");
+  if (fclose(file) != 0 || rename(tmp, filename) != 0) {
+    error("failed to write I/O statistics %s: %s", filename, strerror(errno));
+    remove(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+/* Called from the timer: write the file once per emulated second */
+void trs_iostats_tick(void)
+{
+  if (!trs_iostats || trs_iostats_file[0] == 0)
+    return;
+  if (++iostats_ticks < timer_hz)
+    return;
+  iostats_ticks = 0;
+  if (trs_iostats_save(trs_iostats_file) != 0)
+    trs_iostats_file[0] = 0;
+}
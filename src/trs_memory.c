@@ -105,6 +105,25 @@ static unsigned int supermem_hi;
 static int selector_reg = 0;
 static int m_a11_flipflop;
 
+/* Pages written since the last mem_dirty_clear, one bit per MEM_PAGE_SIZE
+   bytes of memory[] followed by those of supermem_ram */
+#define MEM_PAGES_MAIN	((sizeof(memory) - 1) >> MEM_PAGE_SHIFT)
+static Uchar mem_dirty[MEM_PAGES / 8];
+
+/*
+ * Generation counters for the debugger's decode cache.  Each page's
+ * counter changes when it is written, and mem_epoch whenever the map,
+ * the ROM or memory as a whole may have changed.
+ */
+static unsigned mem_gen[MEM_PAGES];
+static unsigned const mem_rom_gen;
+unsigned mem_epoch;
+#define MEM_DIRTY(offset) \
+  (mem_gen[(offset) >> MEM_PAGE_SHIFT]++, \
+   mem_dirty[(offset) >> (MEM_PAGE_SHIFT + 3)] |= \
+   1 << (((offset) >> MEM_PAGE_SHIFT) & 7))
+#define SUPERMEM_DIRTY(offset) MEM_DIRTY(sizeof(memory) - 1 + (offset))
+
 void mem_video_page(int which)
 {
     video_offset = -VIDEO_START + (which ? VIDEO_PAGE_1 : VIDEO_PAGE_0);
@@ -143,6 +162,7 @@ void mem_bank(int command)
 	break;
     }
     mem_command = command;
+    mem_epoch++;
 }
 
 /*
@@ -196,6 +216,7 @@ void mem_bank_base(int bits)
 		else
 		    supermem_hi = 0x8000;
 	}
+	mem_epoch++;
 }
 
 int mem_read_bank_base(void)
@@ -217,6 +238,7 @@ int cp500_a11_flipflop_toggle(void)
 	m_a11_flipflop ^= 1;
 
 	memcpy(&rom[0], &cp500_rom[m_a11_flipflop * 0x800], MAX_ROM_SIZE);
+	mem_epoch++;
 
 	return 0x00; /* really?! */
 }
@@ -240,15 +262,21 @@ void selector_out(unsigned char value)
 			bank_base += 32768;
 	} else
 		bank_base = 0;
+	mem_epoch++;
 }
 
 /* Handle reset button if poweron=0;
    handle hard reset or initial poweron if poweron=1 */
 void trs_reset(int poweron)
 {
+    mem_epoch++;
     trs_emu_mouse = FALSE;
     m_a11_flipflop = 0;
 
+    /* Let a running TRS-IO command finish, dropping its interrupt */
+    trs_io_stop();
+    trs_iobus_interrupt(0);
+
     /* Close disks opened by Z80 programs */
     do_emt_resetdisk();
     /* Reset devices (Model I SYSRES, Model III/4 RESET) */
@@ -319,6 +347,7 @@ void trs_reset(int poweron)
 	}
 	trs_rom_init();
 	trs_timer_init();
+	trs_rewind_reset();
 	if (trs_show_led) {
 	  trs_disk_led(-1, -1);
 	  trs_hard_led(-1, -1);
@@ -337,12 +366,14 @@ void trs_reset(int poweron)
 void mem_map(int which)
 {
     memory_map = which + (trs_model << 4) + (romin << 2);
+    mem_epoch++;
 }
 
 void mem_romin(int state)
 {
     romin = (state & 1);
     memory_map = (memory_map & ~4) + (romin << 2);
+    mem_epoch++;
 }
 
 /*
@@ -351,6 +382,7 @@ void mem_romin(int state)
 void mem_write_rom(int address, int value)
 {
     address &= 0xffff;
+    mem_epoch++;
 
     if (address <= MAX_ROM_SIZE) {
       rom[address] = value;
@@ -391,6 +423,8 @@ static int trs80_model1_ram(int address)
 
 static int trs80_model1_mmio(int address)
 {
+  if (trs_iostats && address >= 0x37E0)
+    trs_iostats_mmio(address, FALSE);
   if (address >= VIDEO_START) return video[address + video_offset];
   if (address < trs_rom_size) return rom[address];
   if (address == TRSDISK_DATA) return trs_disk_data_read();
@@ -406,13 +440,10 @@ static int trs80_model1_mmio(int address)
   return 0xff;
 }
 
-int mem_read(int address)
+static int mem_read_byte(int address)
 {
     uint8_t byte;
 
-    address &= 0xffff; /* allow callers to be sloppy */
-
-
     if (xray_mem_read(address, &byte)) {
       return byte;
     }
@@ -523,6 +554,7 @@ static void trs80_model1_write_mem(int address, int value)
   /* Model 4 doesn't have banking in Model 1 mode */
   if (trs_model != 1) {
     memory[address] = value;
+    MEM_DIRTY(address);
     return;
   }
   /* Selector mode 6 remaps RAM from 0000-3FFF to C000-FFFF while keeping
@@ -546,10 +578,13 @@ static void trs80_model1_write_mem(int address, int value)
   if ((address & 0x8000) == bank)
     offset += bank_base;
   memory[offset] = value;
+  MEM_DIRTY(offset);
 }
 
 static void trs80_model1_write_mmio(int address, int value)
 {
+  if (trs_iostats && address >= 0x37E0)
+    trs_iostats_mmio(address, TRUE);
   if (address >= VIDEO_START) {
     int vaddr = address + video_offset;
     if (!lowercase) {
@@ -584,11 +619,29 @@ static void trs80_model1_write_mmio(int address, int value)
     trs80_model1_write_mem(address, value);
 }
 
+int mem_read(int address)
+{
+    int value;
+
+    address &= 0xffff; /* allow callers to be sloppy */
+    value = mem_read_byte(address);
+
+#ifdef ZBX
+    if (debug_read_watch != NULL && DEBUG_WATCHED(debug_read_watch, address))
+      debug_watch(address, value, 0);
+#endif
+    return value;
+}
 
 void mem_write(int address, int value)
 {
     address &= 0xffff;
 
+#ifdef ZBX
+    if (debug_write_watch != NULL && DEBUG_WATCHED(debug_write_watch, address))
+      debug_watch(address, value, 1);
+#endif
+
     if (xray_mem_write(address, value)) {
       return;
     }
@@ -597,6 +650,7 @@ void mem_write(int address, int value)
     if (supermem) {
       if (!((address ^ supermem_hi) & 0x8000)) {
           supermem_ram[supermem_base + (address & 0x7FFF)] = value;
+          SUPERMEM_DIRTY(supermem_base + (address & 0x7FFF));
           return;
       }
       /* Otherwise the request comes from the system */
@@ -642,6 +696,7 @@ void mem_write(int address, int value)
       case 0x30: /* Model III */
 	if (address >= RAM_START) {
 	    memory[address] = value;
+	    MEM_DIRTY(address);
 	} else if (address >= VIDEO_START) {
 	    int vaddr = address + video_offset;
 	    if (grafyx_m3_write_byte(vaddr, value)) return;
@@ -659,6 +714,7 @@ void mem_write(int address, int value)
       case 0x54: /* Model 4P map 0, boot ROM in */
 	if (address >= RAM_START) {
 	    memory[address + bank_offset[address >> 15]] = value;
+	    MEM_DIRTY(address + bank_offset[address >> 15]);
 	} else if (address >= VIDEO_START) {
 	    int vaddr = address+ video_offset;
 	    if (video[vaddr] != value) {
@@ -675,6 +731,7 @@ void mem_write(int address, int value)
       case 0x55: /* Model 4P map 1, boot ROM in */
 	if (address >= RAM_START || address < KEYBOARD_START) {
 	    memory[address + bank_offset[address >> 15]] = value;
+	    MEM_DIRTY(address + bank_offset[address >> 15]);
 	} else if (address >= VIDEO_START) {
 	    int vaddr = address + video_offset;
 	    if (video[vaddr] != value) {
@@ -689,6 +746,7 @@ void mem_write(int address, int value)
       case 0x56: /* Model 4P map 2, boot ROM in */
 	if (address < 0xf400) {
 	    memory[address + bank_offset[address >> 15]] = value;
+	    MEM_DIRTY(address + bank_offset[address >> 15]);
 	} else if (address >= 0xf800) {
 	    int vaddr = address - 0xf800;
 	    if (video[vaddr] != value) {
@@ -702,6 +760,7 @@ void mem_write(int address, int value)
       case 0x53: /* Model 4P map 3, boot ROM out */
       case 0x57: /* Model 4P map 3, boot ROM in */
 	memory[address + bank_offset[address >> 15]] = value;
+	MEM_DIRTY(address + bank_offset[address >> 15]);
 	break;
     }
 }
@@ -770,7 +829,7 @@ static Uchar *trs80_model1_mmio_addr(int address, int writing)
  *
  * Needs to die...
  */
-Uchar *mem_pointer(int address, int writing)
+static Uchar *mem_map_pointer(int address, int writing)
 {
     address &= 0xffff;
 
@@ -790,6 +849,8 @@ Uchar *mem_pointer(int address, int writing)
 	  return trs80_model1_ram_addr(address);
       case 0x11: /* Model 1: selector mode 1 (all RAM except I/O high */
       case 0x19:
+        if (address >= 0xF7E0 && address <= 0xF7FF)
+          return trs80_model1_mmio_addr(address & 0x3FFF, writing);
 	return trs80_model1_ram_addr(address);
       case 0x12: /* Model 1 selector mode 2 (ROM disabled) */
         if (address < 0x37E0)
@@ -885,11 +946,220 @@ Uchar *mem_pointer(int address, int writing)
     return NULL;
 }
 
-void trs_mem_save(FILE *file)
+Uchar *mem_pointer(int address, int writing)
+{
+  Uchar *ptr = mem_map_pointer(address, writing);
+
+  /* The caller may write up to 64K from here, so assume it did */
+  if (writing && ptr != NULL) {
+    int offset, end;
+
+    if (ptr >= memory && ptr < memory + sizeof(memory) - 1) {
+      offset = ptr - memory;
+      end = sizeof(memory) - 1;
+    } else if (supermem_ram != NULL && ptr >= supermem_ram &&
+        ptr < supermem_ram + MAX_SUPERMEM_SIZE) {
+      offset = ptr - supermem_ram + sizeof(memory) - 1;
+      end = sizeof(memory) - 1 + MAX_SUPERMEM_SIZE;
+    } else {
+      return ptr;
+    }
+    if (end > offset + 0x10000)
+      end = offset + 0x10000;
+    for (offset &= ~(MEM_PAGE_SIZE - 1); offset < end;
+         offset += MEM_PAGE_SIZE)
+      MEM_DIRTY(offset);
+  }
+  return ptr;
+}
+
+/*
+ * Offset of a pointer into RAM, numbered as for the dirty pages, or -1
+ * if it points anywhere else.
+ */
+static int mem_ram_offset(const Uchar *ptr)
+{
+    if (ptr == NULL)
+      return -1;
+    if (ptr >= memory && ptr < memory + sizeof(memory) - 1)
+      return ptr - memory;
+    if (supermem_ram != NULL && ptr >= supermem_ram &&
+        ptr < supermem_ram + MAX_SUPERMEM_SIZE)
+      return ptr - supermem_ram + sizeof(memory) - 1;
+    return -1;
+}
+
+/*
+ * Write a block as the Z80 would, but copy runs that are plain RAM
+ * in one go instead of going through the memory map for every byte.
+ * The map is only looked up every 32 bytes, the finest granularity
+ * of its boundaries (0x37E0, 0xF7E0).  Anything else, like video
+ * memory or memory-mapped I/O, is still written a byte at a time.
+ */
+#define MEM_RUN 0x20
+
+void mem_write_block(int address, const Uchar *buf, int count)
+{
+    while (count > 0) {
+      Uchar *ptr = mem_map_pointer(address, 1);
+      int const offset = mem_ram_offset(ptr);
+      int len = MEM_RUN - (address & (MEM_RUN - 1));
+      int page;
+
+      if (len > count)
+        len = count;
+#ifdef ZBX
+      if (debug_write_watch != NULL)
+        ptr = NULL;
+#endif
+      /* Selector mode 6 may drop writes the map says go to RAM */
+      if ((selector_reg & 7) == 6)
+        ptr = NULL;
+      if (ptr == NULL || offset < 0) {
+        int i;
+
+        for (i = 0; i < len; i++)
+          mem_write(address + i, buf[i]);
+      } else {
+        /* Extend the run while the map stays contiguous */
+        while (len < count && address + len <= 0xffff &&
+               mem_map_pointer(address + len, 1) == ptr + len &&
+               mem_ram_offset(ptr + len) == offset + len)
+          len += (count - len < MEM_RUN) ? count - len : MEM_RUN;
+        memcpy(ptr, buf, len);
+        for (page = offset >> MEM_PAGE_SHIFT;
+             page <= (offset + len - 1) >> MEM_PAGE_SHIFT; page++)
+          MEM_DIRTY(page << MEM_PAGE_SHIFT);
+      }
+      address = (address + len) & 0xffff;
+      buf += len;
+      count -= len;
+    }
+}
+
+/*
+ * Copy up to count bytes from address as long as they are plain RAM,
+ * which the Z80 can read without side effects, and return how many
+ * were copied.  Stops at anything else, or right away while XRAY may
+ * intercept the reads.
+ */
+int mem_read_ram(int address, Uchar *buf, int count)
+{
+    int i;
+
+    if (xray_mem_active())
+      return 0;
+    for (i = 0; i < count; i++) {
+      int const addr = (address + i) & 0xffff;
+      /* The read map doesn't always agree with mem_read: the Model I
+         one has RAM under the ROM, and the Model III one has RAM at
+         the video addresses and banks the top 32K.  Where both maps
+         have RAM, the write map has the byte mem_read returns. */
+      Uchar *ptr = mem_map_pointer(addr, 1);
+
+      if (mem_ram_offset(ptr) < 0 ||
+          mem_ram_offset(mem_map_pointer(addr, 0)) < 0)
+        break;
+      buf[i] = *ptr;
+    }
+    return i;
+}
+
+/*
+ * Return the generation counter of the 256 byte page at address, or
+ * NULL if mem_read doesn't read all of it from one page of RAM or ROM.
+ * The counter is only valid for as long as mem_epoch stays the same.
+ */
+const unsigned *mem_page_gen(int address)
+{
+    int const first = address & 0xff00;
+    Uchar *ptr = mem_map_pointer(first, 0);
+    int offset;
+
+    if (xray_mem_active())
+      return NULL;
+    if (ptr >= rom && ptr < rom + MAX_ROM_SIZE + 1) {
+      /* The maps have ROM where mem_read reads it, but the printer
+         port may sit in the last page */
+      if (mem_map_pointer(first + 0xff, 0) != ptr + 0xff ||
+          (first ^ PRINTER_ADDRESS) < 0x100)
+        return NULL;
+      return &mem_rom_gen;
+    }
+    /* RAM as for mem_read_ram */
+    ptr = mem_map_pointer(first, 1);
+    offset = mem_ram_offset(ptr);
+    if (offset < 0 || mem_ram_offset(mem_map_pointer(first, 0)) < 0 ||
+        mem_map_pointer(first + 0xff, 1) != ptr + 0xff ||
+        mem_ram_offset(mem_map_pointer(first + 0xff, 0)) < 0)
+      return NULL;
+    return &mem_gen[offset >> MEM_PAGE_SHIFT];
+}
+
+/* Note a change to memory made without the memory map */
+void mem_contents_changed(void)
+{
+    mem_epoch++;
+}
+
+/*
+ * Dirty page tracking for the rewind buffer.  Pages are numbered
+ * through memory[] and then supermem_ram.
+ */
+Uchar *mem_page(int page)
+{
+  if (page < (int)MEM_PAGES_MAIN)
+    return memory + (page << MEM_PAGE_SHIFT);
+  if (supermem_ram == NULL || page >= MEM_PAGES)
+    return NULL;
+  return supermem_ram + ((page - MEM_PAGES_MAIN) << MEM_PAGE_SHIFT);
+}
+
+/* Write to memory[] directly, bypassing the memory map */
+void mem_write_phys(int offset, int value)
+{
+  memory[offset] = value;
+  MEM_DIRTY(offset);
+}
+
+/* Return the first page at or after page written since mem_dirty_clear */
+int mem_dirty_next(int page)
+{
+  while (page < MEM_PAGES) {
+    int const bits = mem_dirty[page >> 3] >> (page & 7);
+
+    if (bits == 0) {
+      page = (page | 7) + 1;
+    } else {
+      if (bits & 1)
+        return page;
+      page++;
+    }
+  }
+  return -1;
+}
+
+void mem_dirty_clear(void)
+{
+  memset(mem_dirty, 0, sizeof(mem_dirty));
+}
+
+/* Amount of memory[] the current model and expansions can address */
+static int mem_extent(void)
+{
+  if (huffman_ram)
+    return 0x200000;
+  if (hypermem)
+    return 0x110000;
+  if (selector)
+    return 0x40000;
+  if (trs_model >= 4)
+    return 0x20000;
+  return 0x10000;
+}
+
+static void mem_save_vars(FILE *file)
 {
-  trs_save_uchar(file, memory, 0x200001);
-  trs_save_uchar(file, rom, MAX_ROM_SIZE + 1);
-  trs_save_uchar(file, video, MAX_VIDEO_SIZE + 1);
   trs_save_int(file, &trs_rom_size, 1);
   trs_save_int(file, &trs_video_size, 1);
   trs_save_int(file, &memory_map, 1);
@@ -905,11 +1175,9 @@ void trs_mem_save(FILE *file)
   trs_save_int(file, &selector_reg, 1);
 }
 
-void trs_mem_load(FILE *file)
+static void mem_load_vars(FILE *file)
 {
-  trs_load_uchar(file, memory, 0x200001);
-  trs_load_uchar(file, rom, MAX_ROM_SIZE + 1);
-  trs_load_uchar(file, video, MAX_VIDEO_SIZE + 1);
+  mem_epoch++;
   trs_load_int(file, &trs_rom_size, 1);
   trs_load_int(file, &trs_video_size, 1);
   trs_load_int(file, &memory_map, 1);
@@ -925,3 +1193,75 @@ void trs_mem_load(FILE *file)
   trs_load_int(file, &selector_reg, 1);
 }
 
+void trs_mem_save(FILE *file)
+{
+  int extent = mem_extent();
+
+  trs_save_int(file, &extent, 1);
+  trs_save_pages(file, memory, extent);
+  trs_save_pages(file, rom, MAX_ROM_SIZE + 1);
+  trs_save_pages(file, video, MAX_VIDEO_SIZE + 1);
+  if (supermem_ram != NULL)
+    trs_save_pages(file, supermem_ram, MAX_SUPERMEM_SIZE + 1);
+  else
+    trs_save_pages(file, NULL, 0);
+  mem_save_vars(file);
+}
+
+static Uchar *supermem_alloc(void)
+{
+  if (supermem_ram == NULL) {
+    supermem_ram = (Uchar *) calloc(MAX_SUPERMEM_SIZE + 1, 1);
+    if (supermem_ram == NULL)
+      error("failed to allocate SuperMem");
+  }
+  return supermem_ram;
+}
+
+void trs_mem_load(FILE *file)
+{
+  if (trs_state_version == 1) {
+    trs_load_uchar(file, memory, 0x200001);
+    trs_load_uchar(file, rom, MAX_ROM_SIZE + 1);
+    trs_load_uchar(file, video, MAX_VIDEO_SIZE + 1);
+  } else {
+    int extent;
+
+    trs_load_int(file, &extent, 1);
+    if (extent < 0 || extent > (int)sizeof(memory))
+      extent = sizeof(memory);
+    trs_load_pages(file, memory, extent);
+    memset(memory + extent, 0, sizeof(memory) - extent);
+    trs_load_pages(file, rom, MAX_ROM_SIZE + 1);
+    trs_load_pages(file, video, MAX_VIDEO_SIZE + 1);
+    /* Only allocate the SuperMem if the State has anything in it */
+    if (trs_peek_pages(file))
+      supermem_alloc();
+    trs_load_pages(file, supermem_ram, MAX_SUPERMEM_SIZE + 1);
+  }
+  mem_load_vars(file);
+  if (supermem && supermem_alloc() == NULL)
+    supermem = 0;
+}
+
+/*
+ * Memory state except RAM and ROM contents, used by the rewind buffer
+ * which keeps track of the RAM pages itself.
+ */
+void trs_mem_save_regs(FILE *file)
+{
+  trs_save_uchar(file, video, MAX_VIDEO_SIZE + 1);
+  mem_save_vars(file);
+  trs_save_int(file, &supermem_base, 1);
+  trs_save_uint32(file, &supermem_hi, 1);
+  trs_save_int(file, &m_a11_flipflop, 1);
+}
+
+void trs_mem_load_regs(FILE *file)
+{
+  trs_load_uchar(file, video, MAX_VIDEO_SIZE + 1);
+  mem_load_vars(file);
+  trs_load_int(file, &supermem_base, 1);
+  trs_load_uint32(file, &supermem_hi, 1);
+  trs_load_int(file, &m_a11_flipflop, 1);
+}
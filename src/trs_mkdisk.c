@@ -41,6 +41,7 @@
 #include "trs_disk.h"
 #include "trs_hard.h"
 #include "trs_mkdisk.h"
+#include "trs_sparse.h"
 #include "trs_stringy.h"
 
 typedef unsigned char Uchar;
@@ -173,11 +174,13 @@ void trs_protect_hard(int drive, int writeprot)
 #endif
   f = fopen(prot_filename, "r+");
   if (f != NULL) {
-    fseek(f, 7, 0);
+    /* Flags #1 of the Reed header, which sparse images embed */
+    long flag1 = trs_sparse_check(f) ? TRS_SPARSE_HDRSIZE + 7 : 7;
+    fseek(f, flag1, 0);
     newmode = getc(f);
     if (newmode != EOF) {
       newmode = (newmode & 0x7f) | (writeprot ? 0x80 : 0);
-      fseek(f, 7, 0);
+      fseek(f, flag1, 0);
       putc(newmode, f);
     }
     fclose(f);
@@ -327,7 +330,7 @@ int trs_create_blank_dmk(const char *fname, int sides, int density,
 }
 
 int trs_create_blank_hard(const char *fname, int cyl, int sec,
-                          int gran, int dir)
+                          int gran, int dir, int sparse)
 {
   FILE *f;
   int i;
@@ -373,6 +376,11 @@ int trs_create_blank_hard(const char *fname, int cyl, int sec,
   }
   rhh.cksum = ((Uchar) cksum) ^ 0x4c;
 
+  if (sparse) {
+    /* Unwritten sectors read as 0xff, like those past the end of a
+       Reed image */
+    return trs_sparse_create(fname, rhhp, 0, 0xff, TRS_SPARSE_COMPRESS) != 0;
+  }
   f = fopen(fname, "wb");
   if (f == NULL) {
     error("failed to create hard disk %s: %s", fname, strerror(errno));
@@ -35,4 +35,4 @@ int trs_create_blank_jv3(const char *fname);
 int trs_create_blank_dmk(const char *fname, int sides, int density,
                          int eight, int ignden);
 int trs_create_blank_hard(const char *fname, int cyl, int sec,
-                          int gran, int dir);
+                          int gran, int dir, int sparse);
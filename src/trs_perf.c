@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2006-2011, Mark Grebe
+ * Copyright (C) 2018-2021, Jens Guenther
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * trs_perf.c -- runtime performance statistics
+ *
+ * trs_timer_sync_with_host reports the time it slept at every timer
+ * tick.  Once per host second the effective emulated clock rate, the
+ * host time per tick spent emulating (frame time), the share of time
+ * spent sleeping, the fill of the sound ring and the floppy and hard
+ * disk data rate are computed.  They are shown in a line at the top of
+ * the screen with -perfoverlay (toggled with Alt-','), and written as
+ * JSON to the file given with -perfstats, which is replaced atomically
+ * so monitors of headless instances can poll it.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <SDL.h>
+#include "error.h"
+#include "trs.h"
+#include "trs_hard.h"
+
+int trs_perf_overlay = 0;
+char trs_perf_file[FILENAME_MAX];
+char trs_perf_text[81];
+
+static Uint32 sample_start;
+static Uint32 sample_slept;
+static int sample_ticks;
+static tstate_t sample_tstates;
+static unsigned long long sample_disk;
+
+static void write_stats(float mhz, float frame_ms, int sleep, int audio,
+                        unsigned long disk_rate)
+{
+  char tmp[FILENAME_MAX + 4];
+  FILE *file;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", trs_perf_file);
+  if ((file = fopen(tmp, "w")) == NULL) {
+    error("failed to write performance statistics %s: %s", tmp,
+          strerror(errno));
+    trs_perf_file[0] = 0;
+    return;
+  }
+  fprintf(file, "{\"time_ms\": %lu, \"emulated_mhz\": %.3f, "
+          "\"target_mhz\": %.3f, \"turbo\": %d, \"frame_ms\": %.2f, "
+          "\"sleep_percent\": %d, \"audio_fill_percent\": %d, "
+          "\"disk_bytes_per_sec\": %lu}\n", (unsigned long) sample_start,
+          mhz, z80_state.clockMHz, timer_overclock, frame_ms, sleep, audio,
+          disk_rate);
+  if (fclose(file) != 0 || rename(tmp, trs_perf_file) != 0) {
+    error("failed to write performance statistics %s: %s", trs_perf_file,
+          strerror(errno));
+    remove(tmp);
+    trs_perf_file[0] = 0;
+  }
+}
+
+/* Called from trs_timer_sync_with_host with the milliseconds slept */
+void trs_perf_tick(unsigned int slept)
+{
+  Uint32 const now = SDL_GetTicks();
+  Uint32 const elapsed = now - sample_start;
+  unsigned long long const disk = trs_disk_bytes() + trs_hard_bytes();
+  float mhz, frame_ms;
+  int sleep, audio, len;
+  unsigned long disk_rate;
+
+  sample_slept += slept;
+  sample_ticks++;
+  if (elapsed < 1000)
+    return;
+
+  if (sample_start != 0 && (trs_perf_overlay || trs_perf_file[0])) {
+    mhz = (z80_state.t_count - sample_tstates) / (elapsed * 1000.0);
+    frame_ms = (float) (elapsed - sample_slept) / sample_ticks;
+    sleep = sample_slept * 100 / elapsed;
+    audio = trs_sound_fill();
+    disk_rate = (disk - sample_disk) * 1000 / elapsed;
+
+    if (audio < 0)
+      len = snprintf(trs_perf_text, sizeof(trs_perf_text),
+                     "%5.2f/%.2f MHz frame %4.1f ms sleep %3d%% audio off "
+                     "disk %luK/s", mhz, z80_state.clockMHz, frame_ms, sleep,
+                     disk_rate >> 10);
+    else
+      len = snprintf(trs_perf_text, sizeof(trs_perf_text),
+                     "%5.2f/%.2f MHz frame %4.1f ms sleep %3d%% audio %3d%% "
+                     "disk %luK/s", mhz, z80_state.clockMHz, frame_ms, sleep,
+                     audio, disk_rate >> 10);
+    /* Mark a line cut short by absurd readings */
+    if (len >= (int) sizeof(trs_perf_text))
+      strcpy(trs_perf_text + sizeof(trs_perf_text) - 4, "...");
+    if (trs_perf_overlay)
+      trs_perf_overlay_draw();
+    if (trs_perf_file[0])
+      write_stats(mhz, frame_ms, sleep, audio, disk_rate);
+  }
+
+  sample_start = now;
+  sample_slept = 0;
+  sample_ticks = 0;
+  sample_tstates = z80_state.t_count;
+  sample_disk = disk;
+}
@@ -0,0 +1,418 @@
+/*
+ * Copyright (C) 2006-2011, Mark Grebe
+ * Copyright (C) 2018-2021, Jens Guenther
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * trs_rewind.c -- in-memory rewind buffer
+ *
+ * Once per emulated second a snapshot is taken.  It holds the machine
+ * state without RAM, as written by trs_state_save_regs, and the RAM
+ * pages written since the previous snapshot.  The oldest snapshot has
+ * a full copy of RAM instead, into which the next one is merged when
+ * the buffer is full.  Restoring a snapshot applies the pages of all
+ * snapshots up to it on top of that copy.
+ *
+ * Both the state and the pages are kept PackBits compressed where
+ * that is shorter.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "error.h"
+#include "trs.h"
+#include "trs_sparse.h"
+#include "trs_state_save.h"
+
+typedef struct {
+  Uchar *state;       /* machine state, packed if state_len < state_size */
+  int state_len;
+  int state_size;
+  Uchar *pages;       /* page number, length, data for each page */
+  int pages_len;
+} Snapshot;
+
+typedef struct {
+  unsigned short page;
+  unsigned short length; /* packed if less than MEM_PAGE_SIZE */
+} PageHeader;
+
+/* Number of seconds to keep, 0 = off */
+int trs_rewind = 0;
+
+static Snapshot *snapshots;
+static int rewind_size;  /* allocated snapshots, trs_rewind + 1 */
+static int rewind_first; /* oldest snapshot */
+static int rewind_count;
+static int rewind_ticks; /* timer ticks since the newest snapshot */
+static Uchar *rewind_base[MEM_PAGES]; /* RAM at the oldest, NULL = zero */
+#ifdef _WIN32
+static FILE *rewind_file;
+static char rewind_arena[0x20000]; /* stdio buffer, holds the whole state */
+#endif
+static Uchar *rewind_buf;
+static long rewind_buf_size;
+
+static Snapshot *snapshot(int n)
+{
+  return &snapshots[(rewind_first + n) % rewind_size];
+}
+
+static void snapshot_free(Snapshot *s)
+{
+  free(s->state);
+  free(s->pages);
+  memset(s, 0, sizeof(Snapshot));
+}
+
+void trs_rewind_reset(void)
+{
+  int i;
+
+  for (i = 0; i < rewind_count; i++)
+    snapshot_free(snapshot(i));
+  for (i = 0; i < MEM_PAGES; i++) {
+    free(rewind_base[i]);
+    rewind_base[i] = NULL;
+  }
+  free(snapshots);
+  snapshots = NULL;
+  rewind_size = rewind_first = rewind_count = rewind_ticks = 0;
+}
+
+int trs_rewind_available(void)
+{
+  return rewind_count;
+}
+
+static int page_is_zero(const Uchar *data)
+{
+  int i;
+
+  for (i = 0; i < MEM_PAGE_SIZE; i++)
+    if (data[i])
+      return 0;
+  return 1;
+}
+
+/* Copy all non-zero pages of RAM to the base image */
+static int save_base(void)
+{
+  int page;
+
+  for (page = 0; page < MEM_PAGES; page++) {
+    Uchar const *data = mem_page(page);
+
+    if (data == NULL || page_is_zero(data))
+      continue;
+    if ((rewind_base[page] = (Uchar *)malloc(MEM_PAGE_SIZE)) == NULL)
+      return -1;
+    memcpy(rewind_base[page], data, MEM_PAGE_SIZE);
+  }
+  return 0;
+}
+
+/* Collect the dirty pages of RAM */
+static int save_pages(Snapshot *s)
+{
+  PageHeader h;
+  Uchar *pages;
+  int page, n = 0;
+
+  for (page = mem_dirty_next(0); page >= 0; page = mem_dirty_next(page + 1))
+    n++;
+  if (n == 0)
+    return 0;
+  pages = (Uchar *)malloc(n * (sizeof(h) + MEM_PAGE_SIZE));
+  if (pages == NULL)
+    return -1;
+
+  n = 0;
+  for (page = mem_dirty_next(0); page >= 0; page = mem_dirty_next(page + 1)) {
+    Uchar const *data = mem_page(page);
+    int len;
+
+    if (data == NULL)
+      continue;
+    len = trs_packbits(data, MEM_PAGE_SIZE, pages + n + sizeof(h),
+                       MEM_PAGE_SIZE - 1);
+    if (len < 0) {
+      len = MEM_PAGE_SIZE;
+      memcpy(pages + n + sizeof(h), data, len);
+    }
+    h.page = page;
+    h.length = len;
+    memcpy(pages + n, &h, sizeof(h));
+    n += sizeof(h) + len;
+  }
+  s->pages = pages;
+  s->pages_len = n;
+  if (n > 0 && (pages = (Uchar *)realloc(pages, n)) != NULL)
+    s->pages = pages;
+  return 0;
+}
+
+/* Apply the pages of a snapshot to dst, or to RAM if dst is NULL */
+static int load_pages(Snapshot *s, Uchar **dst)
+{
+  PageHeader h;
+  int n = 0;
+
+  while (n < s->pages_len) {
+    Uchar *data;
+
+    memcpy(&h, s->pages + n, sizeof(h));
+    n += sizeof(h);
+    if (dst == NULL) {
+      data = mem_page(h.page);
+    } else {
+      if (dst[h.page] == NULL &&
+          (dst[h.page] = (Uchar *)malloc(MEM_PAGE_SIZE)) == NULL)
+        return -1;
+      data = dst[h.page];
+    }
+    if (data != NULL) {
+      if (h.length == MEM_PAGE_SIZE)
+        memcpy(data, s->pages + n, MEM_PAGE_SIZE);
+      else
+        trs_unpackbits(s->pages + n, h.length, data, MEM_PAGE_SIZE);
+    }
+    n += h.length;
+  }
+  return 0;
+}
+
+static int buf_reserve(long size)
+{
+  if (size > rewind_buf_size) {
+    Uchar *buf = (Uchar *)realloc(rewind_buf, size);
+
+    if (buf == NULL)
+      return -1;
+    rewind_buf = buf;
+    rewind_buf_size = size;
+  }
+  return 0;
+}
+
+#ifndef _WIN32
+/* Serialize the machine state into rewind_buf and return its size */
+static long state_to_buf(void)
+{
+  FILE *file;
+  long size;
+
+  if (buf_reserve(0x20000) < 0)
+    return -1;
+  for (;;) {
+    if ((file = fmemopen(rewind_buf, rewind_buf_size, "wb")) == NULL)
+      return -1;
+    trs_state_save_regs(file);
+    size = (fflush(file) == 0 && !ferror(file)) ? ftell(file) : -1;
+    fclose(file);
+    /* A full buffer may have cut the state short */
+    if (size >= 0 && size < rewind_buf_size)
+      return size;
+    if (buf_reserve(rewind_buf_size * 2) < 0)
+      return -1;
+  }
+}
+
+/* Restore the machine state from the first size bytes of rewind_buf */
+static int state_from_buf(long size)
+{
+  FILE *file = fmemopen(rewind_buf, size, "rb");
+
+  if (file == NULL)
+    return -1;
+  trs_state_load_regs(file);
+  fclose(file);
+  return 0;
+}
+#else
+/* No fmemopen(), so go through a temporary file held in its buffer */
+static long state_to_buf(void)
+{
+  long size;
+
+  if (rewind_file == NULL) {
+    if ((rewind_file = tmpfile()) == NULL)
+      return -1;
+    setvbuf(rewind_file, rewind_arena, _IOFBF, sizeof(rewind_arena));
+  }
+  rewind(rewind_file);
+  trs_state_save_regs(rewind_file);
+  size = ftell(rewind_file);
+  if (buf_reserve(size) < 0)
+    return -1;
+  rewind(rewind_file);
+  if (fread(rewind_buf, size, 1, rewind_file) != 1)
+    return -1;
+  return size;
+}
+
+static int state_from_buf(long size)
+{
+  rewind(rewind_file);
+  if (fwrite(rewind_buf, size, 1, rewind_file) != 1)
+    return -1;
+  rewind(rewind_file);
+  trs_state_load_regs(rewind_file);
+  return 0;
+}
+#endif
+
+static int save_state(Snapshot *s)
+{
+  long const size = state_to_buf();
+
+  if (size < 0)
+    return -1;
+  if ((s->state = (Uchar *)malloc(size)) == NULL)
+    return -1;
+  s->state_size = size;
+  s->state_len = trs_packbits(rewind_buf, size, s->state, size - 1);
+  if (s->state_len < 0) {
+    s->state_len = size;
+    memcpy(s->state, rewind_buf, size);
+  } else {
+    Uchar *state = (Uchar *)realloc(s->state, s->state_len);
+
+    if (state != NULL)
+      s->state = state;
+  }
+  return 0;
+}
+
+static int load_state(Snapshot *s)
+{
+  if (s->state_len < s->state_size) {
+    if (trs_unpackbits(s->state, s->state_len, rewind_buf,
+                       s->state_size) < 0)
+      return -1;
+  } else {
+    memcpy(rewind_buf, s->state, s->state_size);
+  }
+  return state_from_buf(s->state_size);
+}
+
+static void take_snapshot(void)
+{
+  Snapshot *s;
+
+  if (rewind_size != trs_rewind + 1) {
+    trs_rewind_reset();
+    snapshots = (Snapshot *)calloc(trs_rewind + 1, sizeof(Snapshot));
+    if (snapshots == NULL)
+      goto fail;
+    rewind_size = trs_rewind + 1;
+  }
+
+  if (rewind_count == rewind_size) {
+    /* Merge the second oldest into the base and drop the oldest */
+    if (load_pages(snapshot(1), rewind_base) < 0)
+      goto fail;
+    snapshot_free(snapshot(0));
+    free(snapshot(1)->pages);
+    snapshot(1)->pages = NULL;
+    snapshot(1)->pages_len = 0;
+    rewind_first = (rewind_first + 1) % rewind_size;
+    rewind_count--;
+  }
+
+  s = snapshot(rewind_count);
+  if ((rewind_count == 0 ? save_base() : save_pages(s)) < 0 ||
+      save_state(s) < 0)
+    goto fail;
+  rewind_count++;
+  mem_dirty_clear();
+  return;
+
+fail:
+  error("failed to save rewind snapshot");
+  trs_rewind_reset();
+}
+
+void trs_rewind_tick(void)
+{
+  if (trs_rewind <= 0) {
+    if (rewind_size)
+      trs_rewind_reset();
+    return;
+  }
+  if (++rewind_ticks < timer_hz)
+    return;
+  rewind_ticks = 0;
+  take_snapshot();
+}
+
+/*
+ * Go back the given number of seconds.  The newest snapshot counts as
+ * the first second unless it was taken less than half a second ago,
+ * so repeating the command steps further back.  Returns the number of
+ * seconds gone back, or -1 if there is nothing to go back to.
+ */
+int trs_rewind_back(int seconds)
+{
+  int target, i;
+
+  if (rewind_count == 0 || seconds <= 0)
+    return -1;
+  target = rewind_count - seconds;
+  if (rewind_ticks < timer_hz / 2)
+    target--;
+  if (target < 0)
+    target = 0;
+
+  for (i = 0; i < MEM_PAGES; i++) {
+    Uchar *data = mem_page(i);
+
+    if (data == NULL)
+      continue;
+    if (rewind_base[i] != NULL)
+      memcpy(data, rewind_base[i], MEM_PAGE_SIZE);
+    else
+      memset(data, 0, MEM_PAGE_SIZE);
+  }
+  for (i = 1; i <= target; i++)
+    load_pages(snapshot(i), NULL);
+  if (load_state(snapshot(target)) < 0) {
+    error("failed to restore rewind snapshot");
+    trs_rewind_reset();
+    return -1;
+  }
+
+  /* Forget the future */
+  for (i = target + 1; i < rewind_count; i++)
+    snapshot_free(snapshot(i));
+  seconds = rewind_count - target;
+  rewind_count = target + 1;
+  rewind_ticks = 0;
+  mem_dirty_clear();
+  trs_screen_init();
+  return seconds;
+}
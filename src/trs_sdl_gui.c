@@ -164,6 +164,7 @@ static void trs_gui_cassette_management(void);
 static void trs_gui_emulator_settings(void);
 static void trs_gui_display_settings(void);
 static void trs_gui_misc_settings(void);
+static int  trs_gui_rewind(void);
 static int  trs_gui_config_management(void);
 static void trs_gui_printer_management(void);
 static const char *trs_gui_get_key_name(int key);
@@ -1506,6 +1507,7 @@ void trs_gui_hard_management(void)
    {"Sector Count                                                ", MENU_NORMAL_TYPE},
    {"Granularity                                                 ", MENU_NORMAL_TYPE},
    {"Directory Sector                                            ", MENU_NORMAL_TYPE},
+   {"Sparse Image                                                ", MENU_NORMAL_TYPE},
    {"Insert Created Disk Into This Drive                         ", MENU_NORMAL_TYPE},
    {"Create Hard Disk Image with Above Parameters", MENU_NORMAL_TYPE},
    {"", 0}};
@@ -1514,6 +1516,7 @@ void trs_gui_hard_management(void)
   static int sector_count = 256;
   static int granularity = 8;
   static int dir_sector = 1;
+  static int sparse = 0;
   static int drive_insert = 0;
   char input[4];
   int selection = 0;
@@ -1533,7 +1536,8 @@ void trs_gui_hard_management(void)
     snprintf(&hard_menu[8].title[57], 4, "%3d", sector_count);
     snprintf(&hard_menu[9].title[57], 4, "%3d", granularity);
     snprintf(&hard_menu[10].title[57], 4, "%3d", dir_sector);
-    snprintf(&hard_menu[11].title[54], 7, "%6s", drive_choices[drive_insert]);
+    snprintf(&hard_menu[11].title[50], 11, "%s", yes_no_choices[sparse]);
+    snprintf(&hard_menu[12].title[54], 7, "%6s", drive_choices[drive_insert]);
     trs_gui_clear_screen();
 
     selection = trs_gui_display_menu("SDLTRS Hard Disk Management", hard_menu, selection);
@@ -1598,9 +1602,12 @@ void trs_gui_hard_management(void)
         }
         break;
       case 11:
-        drive_insert = trs_gui_display_popup("Hard", drive_choices, 5, drive_insert);
+        sparse = trs_gui_display_popup("Sparse", yes_no_choices, 2, sparse);
         break;
       case 12:
+        drive_insert = trs_gui_display_popup("Hard", drive_choices, 5, drive_insert);
+        break;
+      case 13:
         if (sector_count < granularity) {
           trs_gui_display_message("ERROR", "Sector Count must be >= Granularity");
           break;
@@ -1618,7 +1625,7 @@ void trs_gui_hard_management(void)
             trs_hard_dir, filename, 191, 1) == 0) {
           if (trs_gui_file_overwrite()) {
             if (trs_create_blank_hard(filename, cylinder_count, sector_count,
-                granularity, dir_sector) != 0)
+                granularity, dir_sector, sparse) != 0)
               trs_gui_display_error(filename);
             else if (drive_insert)
               trs_hard_attach(drive_insert - 1, filename);
@@ -2186,7 +2193,7 @@ void trs_gui_misc_settings(void)
         snprintf(input, 11, "%d", timer_overclock_rate);
         if (trs_gui_input_string("Enter Turbo Rate Multiplier", input, input, 10, 0) == 0) {
           timer_overclock_rate = atoi(input);
-          if (timer_overclock_rate <= 0)
+          if (timer_overclock_rate < 0)
             timer_overclock_rate = 1;
         }
         break;
@@ -2261,6 +2268,26 @@ int trs_gui_read_config(void)
   return -1;
 }
 
+static int trs_gui_rewind(void)
+{
+  char input[11];
+  char title[64];
+  int const seconds = trs_rewind_available();
+
+  if (seconds == 0) {
+    trs_gui_display_message("Rewind", trs_rewind ?
+        "No snapshot taken yet" : "Rewind buffer is disabled (-rewind)");
+    return -1;
+  }
+  snprintf(title, 64, "Enter Seconds to Rewind (1-%d)", seconds);
+  snprintf(input, 11, "%d", 1);
+  if (trs_gui_input_string(title, input, input, 10, 0) == 0) {
+    if (trs_rewind_back(atoi(input)) > 0)
+      return 0;
+  }
+  return -1;
+}
+
 static int trs_gui_config_management(void)
 {
   MENU_ENTRY misc_menu[] =
@@ -2268,6 +2295,7 @@ static int trs_gui_config_management(void)
    {"Load Emulator State (Alt-L)", MENU_NORMAL_TYPE},
    {"Write Configuration (Alt-W)", MENU_NORMAL_TYPE},
    {"Read Configuration  (Alt-R)", MENU_NORMAL_TYPE},
+   {"Rewind Emulation    (Alt-Backspace)", MENU_NORMAL_TYPE},
    {"", 0}};
   int selection = 0;
 
@@ -2290,6 +2318,10 @@ static int trs_gui_config_management(void)
         if (trs_gui_read_config() == 0)
           return 1;
         break;
+      case 4:
+        if (trs_gui_rewind() == 0)
+          return 1;
+        break;
       case -1:
         return 0;
     }
@@ -47,6 +47,7 @@
 #include "trs.h"
 #include "trs_cassette.h"
 #include "trs_disk.h"
+#include "trs_hard.h"
 #include "trs_iodefs.h"
 #include "trs_sdl_gui.h"
 #include "trs_sdl_keyboard.h"
@@ -81,6 +82,7 @@ int trs_charset4;
 int trs_paused;
 int trs_emu_mouse;
 int trs_show_led;
+int trs_turbo_fps = 10;
 int scale;
 int fullscreen;
 int resize;
@@ -105,6 +107,9 @@ char trs_cmd_file[FILENAME_MAX];
 char trs_config_file[FILENAME_MAX];
 char trs_state_file[FILENAME_MAX];
 char trs_printer_command[FILENAME_MAX];
+char trs_retrostore_host[FILENAME_MAX];
+char trs_retrostore_cache[FILENAME_MAX];
+int trs_retrostore_cache_size;
 
 /* Private data */
 #include "trs_chars.c"
@@ -118,6 +123,12 @@ static int col_chars = 16;
 static int border_width = 2;
 static int text80x24 = 0, screen640x240 = 0;
 static int drawnRectCount = 0;
+static int frame_skip = 0;  /* Unlimited turbo: only present frame_fps */
+static int frame_dirty = 0;  /* whole screen to redraw */
+static unsigned char frame_chars[2048]; /* characters written meanwhile */
+static unsigned short frame_list[2048];
+static int frame_count = 0;
+static Uint32 frame_time;
 static int top_margin = 0;
 static int left_margin = 0;
 static int screen_height = 0;
@@ -227,6 +238,7 @@ typedef struct trs_opt_struct {
 static void trs_opt_borderwidth(char *arg, int intarg, int *stringarg);
 static void trs_opt_cass(char *arg, int intarg, int *stringarg);
 static void trs_opt_charset(char *arg, int intarg, int *stringarg);
+static void trs_opt_checkpoint(char *arg, int intarg, int *stringarg);
 static void trs_opt_clock(char *arg, int intarg, int *stringarg);
 static void trs_opt_color(char *arg, int intarg, int *color);
 static void trs_opt_disk(char *arg, int intarg, int *stringarg);
@@ -237,14 +249,18 @@ static void trs_opt_doubler(char *arg, int intarg, int *stringarg);
 static void trs_opt_doublestep(char *arg, int intarg, int *stringarg);
 #endif
 static void trs_opt_hard(char *arg, int intarg, int *stringarg);
+static void trs_opt_hardcache(char *arg, int intarg, int *stringarg);
 static void trs_opt_huffman(char *arg, int intarg, int *stringarg);
 static void trs_opt_hypermem(char *arg, int intarg, int *stringarg);
 static void trs_opt_joybuttonmap(char *arg, int intarg, int *stringarg);
 static void trs_opt_joysticknum(char *arg, int intarg, int *stringarg);
+static void trs_opt_iostats(char *arg, int intarg, int *stringarg);
 static void trs_opt_keystretch(char *arg, int intarg, int *stringarg);
 static void trs_opt_microlabs(char *arg, int intarg, int *stringarg);
 static void trs_opt_model(char *arg, int intarg, int *stringarg);
 static void trs_opt_printer(char *arg, int intarg, int *stringarg);
+static void trs_opt_retrostorecachesize(char *arg, int intarg, int *stringarg);
+static void trs_opt_rewind(char *arg, int intarg, int *stringarg);
 static void trs_opt_rom(char *arg, int intarg, int *stringarg);
 static void trs_opt_samplerate(char *arg, int intarg, int *stringarg);
 static void trs_opt_scale(char *arg, int intarg, int *stringarg);
@@ -259,6 +275,7 @@ static void trs_opt_stepmap(char *arg, int intarg, int *stringarg);
 static void trs_opt_string(char *arg, int intarg, int *stringarg);
 static void trs_opt_supermem(char *arg, int intarg, int *stringarg);
 static void trs_opt_switches(char *arg, int intarg, int *stringarg);
+static void trs_opt_turbofps(char *arg, int intarg, int *stringarg);
 static void trs_opt_turborate(char *arg, int intarg, int *stringarg);
 static void trs_opt_value(char *arg, int intarg, int *variable);
 static void trs_opt_wafer(char *arg, int intarg, int *stringarg);
@@ -269,11 +286,13 @@ static const trs_opt options[] = {
   { "borderwidth",     trs_opt_borderwidth,   1, 0, NULL                 },
   { "bw",              trs_opt_borderwidth,   1, 0, NULL                 },
   { "cass",            trs_opt_cass,          1, 0, NULL                 },
+  { "cassdecode",      trs_opt_value,         0, 1, &cassette_decode     },
   { "cassdir",         trs_opt_dirname,       1, 0, trs_cass_dir         },
   { "cassette",        trs_opt_cass,          1, 0, NULL                 },
   { "charset1",        trs_opt_charset,       1, 1, NULL                 },
   { "charset3",        trs_opt_charset,       1, 3, NULL                 },
   { "charset4",        trs_opt_charset,       1, 4, NULL                 },
+  { "checkpoint",      trs_opt_checkpoint,    1, 0, NULL                 },
   { "clock1",          trs_opt_clock,         1, 1, NULL                 },
   { "clock3",          trs_opt_clock,         1, 3, NULL                 },
   { "clock4",          trs_opt_clock,         1, 4, NULL                 },
@@ -296,10 +315,15 @@ static const trs_opt options[] = {
   { "doublestep",      trs_opt_doublestep,    0, 2, NULL                 },
 #endif
   { "emtsafe",         trs_opt_value,         0, 1, &trs_emtsafe         },
+  { "fastload",        trs_opt_value,         0, 1, &cassette_fastload   },
   { "fg",              trs_opt_color,         1, 0, &foreground          },
   { "foreground",      trs_opt_color,         1, 0, &foreground          },
+  { "forkserver",      trs_opt_string,        1, 0, trs_forkserver_socket },
   { "fullscreen",      trs_opt_value,         0, 1, &fullscreen          },
   { "fs",              trs_opt_value,         0, 1, &fullscreen          },
+#ifdef ZBX
+  { "gdb",             trs_opt_string,        1, 0, debug_gdb_socket     },
+#endif
   { "guibackground",   trs_opt_color,         1, 0, &gui_background      },
   { "guibg",           trs_opt_color,         1, 0, &gui_background      },
   { "guifg",           trs_opt_color,         1, 0, &gui_foreground      },
@@ -308,10 +332,12 @@ static const trs_opt options[] = {
   { "hard1",           trs_opt_hard,          1, 1, NULL                 },
   { "hard2",           trs_opt_hard,          1, 2, NULL                 },
   { "hard3",           trs_opt_hard,          1, 3, NULL                 },
+  { "hardcache",       trs_opt_hardcache,     1, 0, NULL                 },
   { "harddir",         trs_opt_dirname,       1, 0, trs_hard_dir         },
   { "hideled",         trs_opt_value,         0, 0, &trs_show_led        },
   { "huffman",         trs_opt_huffman,       0, 1, NULL                 },
   { "hypermem",        trs_opt_hypermem,      0, 1, NULL                 },
+  { "iostats",         trs_opt_iostats,       1, 0, NULL                 },
   { "joyaxismapped",   trs_opt_value,         0, 1, &jaxis_mapped        },
   { "joybuttonmap",    trs_opt_joybuttonmap,  1, 0, NULL                 },
   { "joysticknum",     trs_opt_joysticknum,   1, 0, NULL                 },
@@ -327,6 +353,7 @@ static const trs_opt options[] = {
   { "m4p",             trs_opt_value,         0, 5, &trs_model           },
   { "model",           trs_opt_model,         1, 0, NULL                 },
   { "mousepointer",    trs_opt_value,         0, 1, &mousepointer        },
+  { "nocassdecode",    trs_opt_value,         0, 0, &cassette_decode     },
 #ifdef ZBX
   { "nodebug",         trs_opt_value,         0, 0, &debugger            },
 #endif
@@ -334,6 +361,7 @@ static const trs_opt options[] = {
   { "nodoublestep",    trs_opt_doublestep,    0, 1, NULL                 },
 #endif
   { "noemtsafe",       trs_opt_value,         0, 0, &trs_emtsafe         },
+  { "nofastload",      trs_opt_value,         0, 0, &cassette_fastload   },
   { "nofullscreen",    trs_opt_value,         0, 0, &fullscreen          },
   { "nofs",            trs_opt_value,         0, 0, &fullscreen          },
   { "nohuffman",       trs_opt_huffman,       0, 0, NULL                 },
@@ -345,6 +373,7 @@ static const trs_opt options[] = {
   { "nolowercase",     trs_opt_value,         0, 0, &lowercase           },
   { "nomicrolabs",     trs_opt_microlabs,     0, 0, NULL                 },
   { "nomousepointer",  trs_opt_value,         0, 0, &mousepointer        },
+  { "noperfoverlay",   trs_opt_value,         0, 0, &trs_perf_overlay    },
   { "noresize3",       trs_opt_value,         0, 0, &resize3             },
   { "noresize4",       trs_opt_value,         0, 0, &resize4             },
   { "noscanlines",     trs_opt_value,         0, 0, &scanlines           },
@@ -358,11 +387,17 @@ static const trs_opt options[] = {
 #if defined(SDL2) || !defined(NOX)
   { "noturbopaste",    trs_opt_value,         0, 0, &turbo_paste         },
 #endif
+  { "perfoverlay",     trs_opt_value,         0, 1, &trs_perf_overlay    },
+  { "perfstats",       trs_opt_string,        1, 0, trs_perf_file        },
   { "printer",         trs_opt_printer,       1, 0, NULL                 },
   { "printercmd",      trs_opt_string,        1, 0, trs_printer_command  },
   { "printerdir",      trs_opt_dirname,       1, 0, trs_printer_dir      },
   { "resize3",         trs_opt_value,         0, 1, &resize3             },
   { "resize4",         trs_opt_value,         0, 1, &resize4             },
+  { "retrostore",      trs_opt_string,        1, 0, trs_retrostore_host  },
+  { "retrostorecache", trs_opt_dirname,       1, 0, trs_retrostore_cache },
+  { "retrostorecachesize", trs_opt_retrostorecachesize, 1, 0, NULL       },
+  { "rewind",          trs_opt_rewind,        1, 0, NULL                 },
   { "rom",             trs_opt_rom,           1, 0, NULL                 },
   { "romfile",         trs_opt_string,        1, 0, romfile              },
   { "romfile1",        trs_opt_string,        1, 0, romfile              },
@@ -391,6 +426,7 @@ static const trs_opt options[] = {
 #if defined(SDL2) || !defined(NOX)
   { "turbopaste",      trs_opt_value,         0, 1, &turbo_paste         },
 #endif
+  { "turbofps",        trs_opt_turbofps,      1, 0, NULL                 },
   { "turborate",       trs_opt_turborate,     1, 0, NULL                 },
   { "wafer0",          trs_opt_wafer,         1, 0, NULL                 },
   { "wafer1",          trs_opt_wafer,         1, 1, NULL                 },
@@ -533,6 +569,11 @@ static void trs_opt_charset(char *arg, int intarg, int *stringarg)
   }
 }
 
+static void trs_opt_checkpoint(char *arg, int intarg, int *stringarg)
+{
+  trs_forkserver_pc = strtol(arg, NULL, 16) & 0xFFFF;
+}
+
 static void trs_opt_clock(char *arg, int intarg, int *stringarg)
 {
   float clock_mhz = atof(arg);
@@ -571,6 +612,9 @@ static void trs_opt_dirname(char *arg, int intarg, int *stringarg)
 {
   struct stat st;
 
+  /* Keep the current setting, as an unset directory is saved empty */
+  if (*arg == '\0')
+    return;
   if (arg[strlen(arg) - 1] == DIR_SLASH)
     snprintf((char *)stringarg, FILENAME_MAX, "%s", arg);
   else
@@ -621,6 +665,13 @@ static void trs_opt_hard(char *arg, int intarg, int *stringarg)
   trs_hard_attach(intarg, arg);
 }
 
+static void trs_opt_hardcache(char *arg, int intarg, int *stringarg)
+{
+  trs_hard_cachesize = atoi(arg);
+  if (trs_hard_cachesize < 0)
+    trs_hard_cachesize = 0;
+}
+
 static void trs_opt_huffman(char *arg, int intarg, int *stringarg)
 {
   huffman_ram = intarg;
@@ -659,6 +710,12 @@ static void trs_opt_joysticknum(char *arg, int intarg, int *stringarg)
     trs_joystick_num = atoi(arg);
 }
 
+static void trs_opt_iostats(char *arg, int intarg, int *stringarg)
+{
+  snprintf(trs_iostats_file, FILENAME_MAX, "%s", arg);
+  trs_iostats = trs_iostats_file[0] != 0;
+}
+
 static void trs_opt_keystretch(char *arg, int intarg, int *stringarg)
 {
   stretch_amount = atol(arg);
@@ -689,6 +746,20 @@ static void trs_opt_model(char *arg, int intarg, int *stringarg)
     error("TRS-80 Model %s not supported", arg);
 }
 
+static void trs_opt_retrostorecachesize(char *arg, int intarg, int *stringarg)
+{
+  trs_retrostore_cache_size = atoi(arg);
+  if (trs_retrostore_cache_size < 0)
+    trs_retrostore_cache_size = 0;
+}
+
+static void trs_opt_rewind(char *arg, int intarg, int *stringarg)
+{
+  trs_rewind = atoi(arg);
+  if (trs_rewind < 0)
+    trs_rewind = 0;
+}
+
 static void trs_opt_rom(char *arg, int intarg, int *stringarg)
 {
   switch (trs_model) {
@@ -804,10 +875,17 @@ static void trs_opt_switches(char *arg, int intarg, int *stringarg)
   trs_uart_switches = strtol(arg, NULL, base);
 }
 
+static void trs_opt_turbofps(char *arg, int intarg, int *stringarg)
+{
+  trs_turbo_fps = atoi(arg);
+  if (trs_turbo_fps <= 0)
+    trs_turbo_fps = 10;
+}
+
 static void trs_opt_turborate(char *arg, int intarg, int *stringarg)
 {
   timer_overclock_rate = atoi(arg);
-  if (timer_overclock_rate <= 0)
+  if (timer_overclock_rate < 0)
     timer_overclock_rate = 1;
 }
 
@@ -910,12 +988,16 @@ int trs_load_config_file(void)
   strcpy(trs_disk_dir, ".");
   strcpy(trs_disk_set_dir, ".");
   strcpy(trs_hard_dir, ".");
+  trs_hard_cachesize = TRS_HARD_CACHE_DEFAULT;
 #ifdef _WIN32
   strcpy(trs_printer_command, "notepad %s");
 #else
   strcpy(trs_printer_command, "lpr %s");
 #endif
   strcpy(trs_printer_dir, ".");
+  strcpy(trs_retrostore_host, "retrostore.org");
+  trs_retrostore_cache[0] = 0;
+  trs_retrostore_cache_size = 64;
   strcpy(trs_state_dir, ".");
   stretch_amount = STRETCH_AMOUNT;
   trs_charset = 3;
@@ -925,11 +1007,16 @@ int trs_load_config_file(void)
   trs_disk_doubler = TRSDISK_BOTH;
   trs_disk_truedam = 0;
   trs_emtsafe = 1;
+  cassette_decode = 1;
+  cassette_fastload = 0;
+  trs_rewind = 0;
   trs_joystick_num = 0;
   trs_kb_bracket(FALSE);
   trs_keypad_joystick = TRUE;
   trs_model = 1;
   trs_show_led = TRUE;
+  trs_perf_overlay = FALSE;
+  trs_turbo_fps = 10;
   trs_uart_switches = 0x7 | TRS_UART_NOPAR | TRS_UART_WORD8;
   window_border_width = 2;
 
@@ -1049,6 +1136,7 @@ int trs_write_config_file(const char *filename)
 
   fprintf(config_file, "background=0x%x\n", background);
   fprintf(config_file, "borderwidth=%d\n", window_border_width);
+  fprintf(config_file, "%scassdecode\n", cassette_decode ? "" : "no");
   fprintf(config_file, "cassdir=%s\n", trs_cass_dir);
   {
     const char *cassname = trs_cassette_getfilename();
@@ -1086,6 +1174,7 @@ int trs_write_config_file(const char *filename)
       break;
   }
   fprintf(config_file, "%semtsafe\n", trs_emtsafe ? "" : "no");
+  fprintf(config_file, "%sfastload\n", cassette_fastload ? "" : "no");
   fprintf(config_file, "%sfullscreen\n", fullscreen ? "" : "no");
   fprintf(config_file, "foreground=0x%x\n", foreground);
   fprintf(config_file, "guibackground=0x%x\n", gui_background);
@@ -1096,6 +1185,7 @@ int trs_write_config_file(const char *filename)
     if (diskname[0])
       fprintf(config_file, "hard%d=%s\n", i, diskname);
   }
+  fprintf(config_file, "hardcache=%d\n", trs_hard_cachesize);
   fprintf(config_file, "harddir=%s\n", trs_hard_dir);
   fprintf(config_file, "%shuffman\n", huffman_ram ? "" : "no");
   fprintf(config_file, "%shypermem\n", hypermem ? "" : "no");
@@ -1116,11 +1206,16 @@ int trs_write_config_file(const char *filename)
   fprintf(config_file, "model=%d%s\n",
           trs_model == 5 ? 4 : trs_model, trs_model == 5 ? "P" : "");
   fprintf(config_file, "%smousepointer\n", mousepointer ? "" : "no");
+  fprintf(config_file, "%sperfoverlay\n", trs_perf_overlay ? "" : "no");
   fprintf(config_file, "printer=%d\n", trs_printer);
   fprintf(config_file, "printercmd=%s\n", trs_printer_command);
   fprintf(config_file, "printerdir=%s\n", trs_printer_dir);
   fprintf(config_file, "%sresize3\n", resize3 ? "" : "no");
   fprintf(config_file, "%sresize4\n", resize4 ? "" : "no");
+  fprintf(config_file, "retrostore=%s\n", trs_retrostore_host);
+  fprintf(config_file, "retrostorecache=%s\n", trs_retrostore_cache);
+  fprintf(config_file, "retrostorecachesize=%d\n", trs_retrostore_cache_size);
+  fprintf(config_file, "rewind=%d\n", trs_rewind);
   fprintf(config_file, "romfile=%s\n", romfile);
   fprintf(config_file, "romfile3=%s\n", romfile3);
   fprintf(config_file, "romfile4p=%s\n", romfile4p);
@@ -1164,6 +1259,7 @@ int trs_write_config_file(const char *filename)
 #if defined(SDL2) || !defined(NOX)
   fprintf(config_file, "%sturbopaste\n", turbo_paste ? "" : "no");
 #endif
+  fprintf(config_file, "turbofps=%d\n", trs_turbo_fps);
   fprintf(config_file, "turborate=%d\n", timer_overclock_rate);
   for (i = 0; i < 8; i++) {
     const char *diskname = stringy_get_name(i);
@@ -1503,6 +1599,40 @@ static void ProcessCopySelection(int selectAll)
 }
 #endif
 
+/*
+ * In unlimited turbo mode, screen writes only update the emulated
+ * screen memory, and trs_sdl_flush draws what changed at most
+ * trs_turbo_fps times per second.  Characters written are listed and
+ * redrawn one by one; anything else redraws the whole screen.
+ */
+static void frame_redraw(void)
+{
+  int i;
+
+  frame_skip = FALSE;
+  if (frame_dirty) {
+    trs_screen_refresh();
+  } else {
+    for (i = 0; i < frame_count; i++)
+      trs_screen_write_char(frame_list[i], trs_screen[frame_list[i]]);
+    trs_sdl_flush();
+  }
+  for (i = 0; i < frame_count; i++)
+    frame_chars[frame_list[i]] = FALSE;
+  frame_count = 0;
+  frame_dirty = FALSE;
+}
+
+void trs_screen_frame_skip(int on)
+{
+  if (frame_skip == on)
+    return;
+  if (on)
+    frame_skip = TRUE;
+  else
+    frame_redraw();
+}
+
 /*
  * Flush SDL output
  */
@@ -1516,9 +1646,30 @@ void trs_sdl_flush(void)
     }
   }
 #endif
+  if (frame_skip) {
+    Uint32 const now = SDL_GetTicks();
+
+    /* Present at most trs_turbo_fps frames per second */
+    if (now - frame_time < 1000 / trs_turbo_fps)
+      return;
+    if (frame_dirty || frame_count) {
+      frame_time = now;
+      frame_redraw();
+      frame_skip = TRUE;
+      return;
+    }
+    /* Otherwise present the LEDs, if they changed */
+    if (drawnRectCount == 0)
+      return;
+    frame_time = now;
+  }
+
   if (drawnRectCount == 0)
     return;
 
+  if (trs_perf_overlay)
+    trs_perf_overlay_draw();
+
   if (scanlines) {
 #ifdef OLD_SCANLINES
     SDL_Rect rect;
@@ -1577,6 +1728,8 @@ void trs_exit(int confirm)
       return;
     }
   }
+  if (trs_forkserver_socket[0])
+    trs_forkserver_exit(0);
   trs_sdl_cleanup();
   exit(0);
 }
@@ -1909,6 +2062,9 @@ void trs_get_event(int wait)
             case SDLK_DELETE:
               trs_reset(0);
               break;
+            case SDLK_BACKSPACE:
+              trs_rewind_back(1);
+              break;
             case SDLK_RETURN:
               trs_flip_fullscreen();
               break;
@@ -1947,6 +2103,13 @@ void trs_get_event(int wait)
                 trs_screen_caption();
               }
               break;
+            case SDLK_COMMA:
+              trs_perf_overlay = !trs_perf_overlay;
+              if (trs_perf_overlay)
+                trs_perf_overlay_draw();
+              else
+                trs_screen_refresh();
+              break;
             case SDLK_PERIOD:
               mousepointer = !mousepointer;
 #ifdef SDL2
@@ -2576,6 +2739,10 @@ void trs_screen_refresh(void)
 #if XDEBUG
   debug("trs_screen_refresh\n");
 #endif
+  if (frame_skip) {
+    frame_dirty = TRUE;
+    return;
+  }
   if (grafyx_enable && !grafyx_overlay) {
     int const srcx   = cur_char_width * grafyx_xoffset;
     int const srcy   = (scale * 2) * grafyx_yoffset;
@@ -2723,6 +2890,33 @@ void trs_hard_led(int drive, int on_off)
   }
 }
 
+/* Draw the performance overlay over the top line of the screen */
+void trs_perf_overlay_draw(void)
+{
+  int const x = (row_chars != 64) ? -8 : 0;
+  int const y = (row_chars != 64) ? -4 : 0;
+  int const len = strlen(trs_perf_text);
+  int i;
+  SDL_Rect rect;
+
+  if (len == 0)
+    return;
+  for (i = 0; i < row_chars; i++) {
+    int c = i < len ? trs_perf_text[i] : ' ';
+
+    /* Mark a line too long for the screen where it gets cut */
+    if (len > row_chars && i >= row_chars - 3)
+      c = '.';
+    trs_gui_write_char(x + i, y, c, 1);
+  }
+
+  rect.x = left_margin;
+  rect.y = top_margin;
+  rect.w = i * cur_char_width;
+  rect.h = cur_char_height;
+  addToDrawList(&rect);
+}
+
 void trs_turbo_led(void)
 {
   SDL_Rect rect;
@@ -2745,6 +2939,13 @@ void trs_screen_write_char(unsigned int position, unsigned char char_index)
   if (position >= (unsigned int)screen_chars)
     return;
   trs_screen[position] = char_index;
+  if (frame_skip) {
+    if (!frame_chars[position]) {
+      frame_chars[position] = TRUE;
+      frame_list[frame_count++] = position;
+    }
+    return;
+  }
   if ((currentmode & EXPANDED) && (position & 1))
     return;
   if (grafyx_enable && !grafyx_overlay)
@@ -2890,6 +3091,13 @@ static void grafyx_write_byte(int x, int y, char byte)
     screen_y < col_chars * cur_char_height / (scale * 2);
   SDL_Rect srcRect, dstRect;
 
+  if (frame_skip) {
+    grafyx_unscaled[y][x] = byte;
+    grafyx_rescale(y, x, byte);
+    frame_dirty = TRUE;
+    return;
+  }
+
   if (grafyx_enable && grafyx_overlay && on_screen) {
     srcRect.x = x * cur_char_width;
     srcRect.y = y * (scale * 2);
@@ -3279,6 +3487,10 @@ hrg_write_data(int data)
   hrg_screen[hrg_addr] = data;
 
   if (!hrg_enable) return;
+  if (frame_skip) {
+    frame_dirty = TRUE;
+    return;
+  }
   if ((currentmode & EXPANDED) && (hrg_addr & 1)) return;
   if ((data &= 0x3f) == (old_data &= 0x3f)) return;
 
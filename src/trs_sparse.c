@@ -0,0 +1,594 @@
+/*
+ * Copyright (C) 2006-2011, Mark Grebe
+ * Copyright (C) 2018-2021, Jens Guenther
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Sparse hard disk image container, see trs_sparse.h for the format.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "error.h"
+#include "trs_sparse.h"
+
+typedef unsigned char Uchar;
+#include "reed.h"
+
+static void put_le(Uchar *p, unsigned long value, int bytes)
+{
+  while (bytes--) {
+    *p++ = value & 0xff;
+    value >>= 8;
+  }
+}
+
+static unsigned long get_le(const Uchar *p, int bytes)
+{
+  unsigned long value = 0;
+
+  while (bytes--)
+    value = (value << 8) | p[bytes];
+  return value;
+}
+
+/*
+ * PackBits encoding: a header byte n of 0..127 is followed by n + 1
+ * literal bytes, n of 129..255 by one byte to be repeated 257 - n
+ * times.  Return the encoded length, or -1 if it exceeds max.
+ * Also used for memory pages in state files.
+ */
+int trs_packbits(const Uchar *src, int len, Uchar *dst, int max)
+{
+  int i = 0, out = 0;
+
+  while (i < len) {
+    int run = 1;
+
+    while (i + run < len && run < 128 && src[i + run] == src[i])
+      run++;
+    if (run >= 3) {
+      if (out + 2 > max)
+        return -1;
+      dst[out++] = 257 - run;
+      dst[out++] = src[i];
+      i += run;
+    } else {
+      int start = i, lit = 0;
+
+      /* Collect literals up to the start of the next run of three */
+      while (i < len && lit < 128) {
+        if (i + 2 < len && src[i] == src[i + 1] && src[i] == src[i + 2])
+          break;
+        i++;
+        lit++;
+      }
+      if (out + 1 + lit > max)
+        return -1;
+      dst[out++] = lit - 1;
+      memcpy(dst + out, src + start, lit);
+      out += lit;
+    }
+  }
+  return out;
+}
+
+int trs_unpackbits(const Uchar *src, int len, Uchar *dst, int dstlen)
+{
+  int i = 0, out = 0;
+
+  while (i < len) {
+    int n = src[i++];
+
+    if (n < 128) {
+      n++;
+      if (i + n > len || out + n > dstlen)
+        return -1;
+      memcpy(dst + out, src + i, n);
+      i += n;
+      out += n;
+    } else if (n > 128) {
+      n = 257 - n;
+      if (i >= len || out + n > dstlen)
+        return -1;
+      memset(dst + out, src[i++], n);
+      out += n;
+    }
+  }
+  return out == dstlen ? 0 : -1;
+}
+
+/* Number of sectors addressable with the geometry in a Reed header;
+   the controller emulation ignores the cylinder limit, so allow for
+   the maximum of 256 cylinders. */
+static unsigned long reed_max_secs(const Uchar *reed)
+{
+  const ReedHardHeader *rhh = (const ReedHardHeader *) reed;
+
+  return 256UL * (rhh->sec ? rhh->sec : 256);
+}
+
+int trs_sparse_check(FILE *f)
+{
+  char magic[TRS_SPARSE_MAGICLEN];
+
+  if (fseek(f, 0, 0) < 0 || fread(magic, TRS_SPARSE_MAGICLEN, 1, f) != 1)
+    return 0;
+  return memcmp(magic, TRS_SPARSE_MAGIC, TRS_SPARSE_MAGICLEN) == 0;
+}
+
+/* Return an extent to the free list, merging it with its neighbours */
+static void free_extent(SparseImage *s, unsigned long offset,
+                        unsigned long size)
+{
+  SparseExtent *e;
+  int i;
+
+  if (offset + size == s->file_end) {
+    s->file_end = offset;
+    if (s->nfree > 0 &&
+        s->free[s->nfree - 1].offset + s->free[s->nfree - 1].size == offset)
+      s->file_end = s->free[--s->nfree].offset;
+    return;
+  }
+  for (i = 0; i < s->nfree && s->free[i].offset < offset; i++)
+    ;
+  if (i > 0 && s->free[i - 1].offset + s->free[i - 1].size == offset) {
+    s->free[i - 1].size += size;
+    if (i < s->nfree && offset + size == s->free[i].offset) {
+      s->free[i - 1].size += s->free[i].size;
+      memmove(&s->free[i], &s->free[i + 1],
+              (s->nfree - i - 1) * sizeof(SparseExtent));
+      s->nfree--;
+    }
+    return;
+  }
+  if (i < s->nfree && offset + size == s->free[i].offset) {
+    s->free[i].offset = offset;
+    s->free[i].size += size;
+    return;
+  }
+  if (s->nfree == s->free_alloc) {
+    int const n = s->free_alloc ? s->free_alloc * 2 : 16;
+
+    /* Without memory the space is only lost until the next open */
+    if ((e = realloc(s->free, n * sizeof(SparseExtent))) == NULL)
+      return;
+    s->free = e;
+    s->free_alloc = n;
+  }
+  memmove(&s->free[i + 1], &s->free[i], (s->nfree - i) * sizeof(SparseExtent));
+  s->free[i].offset = offset;
+  s->free[i].size = size;
+  s->nfree++;
+}
+
+/* Find space for size bytes, first fit, else at the end of the file */
+static unsigned long alloc_extent(SparseImage *s, unsigned long size)
+{
+  unsigned long offset;
+  int i;
+
+  for (i = 0; i < s->nfree; i++) {
+    if (s->free[i].size >= size) {
+      offset = s->free[i].offset;
+      s->free[i].offset += size;
+      s->free[i].size -= size;
+      if (s->free[i].size == 0) {
+        memmove(&s->free[i], &s->free[i + 1],
+                (s->nfree - i - 1) * sizeof(SparseExtent));
+        s->nfree--;
+      }
+      return offset;
+    }
+  }
+  offset = s->file_end;
+  s->file_end += size;
+  return offset;
+}
+
+static int extent_cmp(const void *a, const void *b)
+{
+  const SparseExtent *x = a, *y = b;
+
+  return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/* Collect the space not used by any block into the free list */
+static void find_free(SparseImage *s)
+{
+  SparseExtent *used;
+  unsigned long i, n = 0;
+  unsigned long pos = TRS_SPARSE_INDEX + s->nblocks * TRS_SPARSE_ENTRYSIZE;
+
+  used = (SparseExtent *) malloc((s->nblocks + 1) * sizeof(SparseExtent));
+  if (used == NULL)
+    return;
+  for (i = 0; i < s->nblocks; i++) {
+    if (s->index[i].offset != 0) {
+      used[n].offset = s->index[i].offset;
+      used[n].size = s->index[i].alloc;
+      n++;
+    }
+  }
+  qsort(used, n, sizeof(SparseExtent), extent_cmp);
+  for (i = 0; i < n; i++) {
+    if (used[i].offset > pos)
+      free_extent(s, pos, used[i].offset - pos);
+    if (used[i].offset + used[i].size > pos)
+      pos = used[i].offset + used[i].size;
+  }
+  /* Anything after the last block is appended over */
+  if (pos < s->file_end)
+    s->file_end = pos;
+  free(used);
+}
+
+SparseImage *trs_sparse_open(FILE *f)
+{
+  SparseImage *s;
+  Uchar hdr[TRS_SPARSE_HDRSIZE];
+  Uchar *index;
+  unsigned long i;
+
+  if (fseek(f, 0, 0) < 0 || fread(hdr, sizeof(hdr), 1, f) != 1 ||
+      memcmp(hdr, TRS_SPARSE_MAGIC, TRS_SPARSE_MAGICLEN) != 0)
+    return NULL;
+  if (hdr[8] != TRS_SPARSE_VERSION || hdr[11] != TRS_SPARSE_BLOCKSHIFT) {
+    error("unsupported sparse hard disk version %d", hdr[8]);
+    return NULL;
+  }
+
+  s = (SparseImage *) calloc(1, sizeof(SparseImage));
+  if (s == NULL)
+    return NULL;
+  s->file = f;
+  s->flags = hdr[9];
+  s->fill = hdr[10];
+  s->nblocks = get_le(hdr + 12, 4);
+  s->nsecs = get_le(hdr + 16, 4);
+  s->cur_block = -1;
+
+  index = (Uchar *) malloc(s->nblocks * TRS_SPARSE_ENTRYSIZE);
+  s->index = (SparseBlock *) malloc(s->nblocks * sizeof(SparseBlock));
+  if (index == NULL || s->index == NULL ||
+      fread(s->reed, TRS_SPARSE_REEDSIZE, 1, f) != 1 ||
+      fread(index, TRS_SPARSE_ENTRYSIZE, s->nblocks, f) != s->nblocks) {
+    error("failed to read sparse hard disk index");
+    free(index);
+    free(s->index);
+    free(s);
+    return NULL;
+  }
+  for (i = 0; i < s->nblocks; i++) {
+    Uchar *e = index + i * TRS_SPARSE_ENTRYSIZE;
+
+    s->index[i].offset = get_le(e, 4);
+    s->index[i].length = get_le(e + 4, 2);
+    s->index[i].alloc = get_le(e + 6, 2);
+  }
+  free(index);
+
+  fseek(f, 0, SEEK_END);
+  s->file_end = ftell(f);
+  find_free(s);
+  return s;
+}
+
+static int write_entry(SparseImage *s, unsigned long block)
+{
+  Uchar e[TRS_SPARSE_ENTRYSIZE];
+
+  put_le(e, s->index[block].offset, 4);
+  put_le(e + 4, s->index[block].length, 2);
+  put_le(e + 6, s->index[block].alloc, 2);
+  if (fseek(s->file, TRS_SPARSE_INDEX + block * TRS_SPARSE_ENTRYSIZE, 0) < 0
+      || fwrite(e, sizeof(e), 1, s->file) != 1)
+    return -1;
+  return 0;
+}
+
+/* Write the current block back if it was modified */
+static int store_block(SparseImage *s)
+{
+  SparseBlock *b;
+  Uchar packed[TRS_SPARSE_BLOCKSIZE];
+  const Uchar *data = s->cur;
+  int i, len = TRS_SPARSE_BLOCKSIZE;
+
+  if (!s->cur_dirty)
+    return 0;
+  s->cur_dirty = 0;
+  b = &s->index[s->cur_block];
+
+  for (i = 0; i < TRS_SPARSE_BLOCKSIZE; i++) {
+    if (s->cur[i] != s->fill)
+      break;
+  }
+  if (i == TRS_SPARSE_BLOCKSIZE) {
+    /* Only fill bytes: the block need not be stored at all */
+    if (b->offset == 0)
+      return 0;
+    free_extent(s, b->offset, b->alloc);
+    b->offset = b->length = b->alloc = 0;
+    return write_entry(s, s->cur_block);
+  }
+
+  if (s->flags & TRS_SPARSE_COMPRESS) {
+    int n = trs_packbits(s->cur, TRS_SPARSE_BLOCKSIZE, packed,
+                         TRS_SPARSE_BLOCKSIZE - 1);
+    if (n > 0) {
+      data = packed;
+      len = n;
+    }
+  }
+
+  if (b->offset == 0 || len > b->alloc) {
+    /* Move, leaving room to grow in place up to the next sector size */
+    unsigned long const old = b->offset, old_alloc = b->alloc;
+
+    b->alloc = (len + TRS_SPARSE_SECSIZE - 1) & ~(TRS_SPARSE_SECSIZE - 1);
+    b->offset = alloc_extent(s, b->alloc);
+    if (old != 0)
+      free_extent(s, old, old_alloc);
+  }
+  b->length = len;
+  if (fseek(s->file, b->offset, 0) < 0 ||
+      fwrite(data, len, 1, s->file) != 1)
+    return -1;
+  return write_entry(s, s->cur_block);
+}
+
+static int load_block(SparseImage *s, unsigned long block)
+{
+  SparseBlock *b = &s->index[block];
+  Uchar packed[TRS_SPARSE_BLOCKSIZE];
+
+  if (s->cur_block == (long) block)
+    return 0;
+  if (store_block(s) < 0)
+    return -1;
+  s->cur_block = -1;
+
+  if (b->offset == 0) {
+    memset(s->cur, s->fill, TRS_SPARSE_BLOCKSIZE);
+  } else {
+    if (fseek(s->file, b->offset, 0) < 0 ||
+        fread(packed, b->length, 1, s->file) != 1)
+      return -1;
+    if (b->length == TRS_SPARSE_BLOCKSIZE) {
+      memcpy(s->cur, packed, TRS_SPARSE_BLOCKSIZE);
+    } else if (trs_unpackbits(packed, b->length, s->cur,
+                              TRS_SPARSE_BLOCKSIZE) < 0) {
+      error("corrupt block %lu in sparse hard disk", block);
+      return -1;
+    }
+  }
+  s->cur_block = block;
+  return 0;
+}
+
+int trs_sparse_read(SparseImage *s, unsigned long lsn, Uchar *buf)
+{
+  unsigned long block = lsn >> TRS_SPARSE_BLOCKSHIFT;
+
+  if (block >= s->nblocks) {
+    memset(buf, s->fill, TRS_SPARSE_SECSIZE);
+    return 0;
+  }
+  if (load_block(s, block) < 0)
+    return -1;
+  memcpy(buf, s->cur + (lsn & (TRS_SPARSE_BLOCK_SECS - 1)) *
+         TRS_SPARSE_SECSIZE, TRS_SPARSE_SECSIZE);
+  return 0;
+}
+
+int trs_sparse_write(SparseImage *s, unsigned long lsn, const Uchar *buf)
+{
+  unsigned long block = lsn >> TRS_SPARSE_BLOCKSHIFT;
+
+  if (block >= s->nblocks || load_block(s, block) < 0)
+    return -1;
+  memcpy(s->cur + (lsn & (TRS_SPARSE_BLOCK_SECS - 1)) * TRS_SPARSE_SECSIZE,
+         buf, TRS_SPARSE_SECSIZE);
+  s->cur_dirty = 1;
+  if (lsn >= s->nsecs) {
+    Uchar n[4];
+
+    s->nsecs = lsn + 1;
+    put_le(n, s->nsecs, 4);
+    if (fseek(s->file, 16, 0) < 0 || fwrite(n, 4, 1, s->file) != 1)
+      return -1;
+  }
+  return 0;
+}
+
+int trs_sparse_flush(SparseImage *s)
+{
+  if (store_block(s) < 0)
+    return -1;
+  return fflush(s->file) == EOF ? -1 : 0;
+}
+
+int trs_sparse_set_header(SparseImage *s, int offset, int value)
+{
+  s->reed[offset] = value;
+  if (fseek(s->file, TRS_SPARSE_HDRSIZE + offset, 0) < 0 ||
+      putc(value, s->file) == EOF)
+    return -1;
+  return 0;
+}
+
+void trs_sparse_close(SparseImage *s)
+{
+  if (s == NULL)
+    return;
+  trs_sparse_flush(s);
+  free(s->index);
+  free(s->free);
+  free(s);
+}
+
+int trs_sparse_create(const char *fname, const Uchar *reed,
+                      unsigned long nsecs, int fill, int flags)
+{
+  FILE *f;
+  Uchar hdr[TRS_SPARSE_HDRSIZE];
+  Uchar e[TRS_SPARSE_ENTRYSIZE];
+  unsigned long i, nblocks, maxsecs = reed_max_secs(reed);
+
+  if (nsecs > maxsecs)
+    maxsecs = nsecs;
+  nblocks = (maxsecs + TRS_SPARSE_BLOCK_SECS - 1) >> TRS_SPARSE_BLOCKSHIFT;
+
+  memset(hdr, 0, sizeof(hdr));
+  memcpy(hdr, TRS_SPARSE_MAGIC, TRS_SPARSE_MAGICLEN);
+  hdr[8] = TRS_SPARSE_VERSION;
+  hdr[9] = flags;
+  hdr[10] = fill;
+  hdr[11] = TRS_SPARSE_BLOCKSHIFT;
+  put_le(hdr + 12, nblocks, 4);
+  put_le(hdr + 16, nsecs, 4);
+  memset(e, 0, sizeof(e));
+
+  f = fopen(fname, "wb");
+  if (f == NULL) {
+    error("failed to create hard disk %s: %s", fname, strerror(errno));
+    return -1;
+  }
+  fwrite(hdr, sizeof(hdr), 1, f);
+  fwrite(reed, TRS_SPARSE_REEDSIZE, 1, f);
+  for (i = 0; i < nblocks; i++)
+    fwrite(e, sizeof(e), 1, f);
+  if (fclose(f) == EOF) {
+    error("failed to write hard disk %s: %s", fname, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int trs_sparse_from_reed(const char *reedname, const char *sparsename,
+                         int fill, int flags)
+{
+  FILE *in, *out;
+  SparseImage *s;
+  ReedHardHeader rhh;
+  Uchar buf[TRS_SPARSE_SECSIZE];
+  unsigned long lsn, nsecs;
+  long size;
+  int ret = 0;
+
+  in = fopen(reedname, "rb");
+  if (in == NULL) {
+    error("failed to open hard disk %s: %s", reedname, strerror(errno));
+    return -1;
+  }
+  if (fread(&rhh, sizeof(rhh), 1, in) != 1 ||
+      rhh.id1 != 0x56 || rhh.id2 != 0xcb || rhh.ver != 0x10) {
+    error("unrecognized hard drive image %s", reedname);
+    fclose(in);
+    return -1;
+  }
+  fseek(in, 0, SEEK_END);
+  size = ftell(in) - sizeof(rhh);
+  nsecs = (size + TRS_SPARSE_SECSIZE - 1) / TRS_SPARSE_SECSIZE;
+  fseek(in, sizeof(rhh), 0);
+
+  if (trs_sparse_create(sparsename, (Uchar *) &rhh, nsecs, fill, flags) < 0) {
+    fclose(in);
+    return -1;
+  }
+  out = fopen(sparsename, "rb+");
+  if (out == NULL || (s = trs_sparse_open(out)) == NULL) {
+    error("failed to open hard disk %s", sparsename);
+    if (out)
+      fclose(out);
+    fclose(in);
+    return -1;
+  }
+  for (lsn = 0; lsn < nsecs; lsn++) {
+    size_t n = fread(buf, 1, TRS_SPARSE_SECSIZE, in);
+
+    /* A short last sector reads back as 0xff, like the emulator does */
+    memset(buf + n, 0xff, TRS_SPARSE_SECSIZE - n);
+    if (trs_sparse_write(s, lsn, buf) < 0) {
+      ret = -1;
+      break;
+    }
+  }
+  if (trs_sparse_flush(s) < 0)
+    ret = -1;
+  trs_sparse_close(s);
+  if (fclose(out) == EOF)
+    ret = -1;
+  fclose(in);
+  if (ret < 0)
+    error("failed to write hard disk %s: %s", sparsename, strerror(errno));
+  return ret;
+}
+
+int trs_sparse_to_reed(const char *sparsename, const char *reedname)
+{
+  FILE *in, *out;
+  SparseImage *s;
+  Uchar buf[TRS_SPARSE_SECSIZE];
+  unsigned long lsn;
+  int ret = 0;
+
+  in = fopen(sparsename, "rb");
+  if (in == NULL) {
+    error("failed to open hard disk %s: %s", sparsename, strerror(errno));
+    return -1;
+  }
+  if ((s = trs_sparse_open(in)) == NULL) {
+    error("unrecognized sparse hard disk %s", sparsename);
+    fclose(in);
+    return -1;
+  }
+  out = fopen(reedname, "wb");
+  if (out == NULL) {
+    error("failed to create hard disk %s: %s", reedname, strerror(errno));
+    trs_sparse_close(s);
+    fclose(in);
+    return -1;
+  }
+  if (fwrite(s->reed, TRS_SPARSE_REEDSIZE, 1, out) != 1)
+    ret = -1;
+  for (lsn = 0; ret == 0 && lsn < s->nsecs; lsn++) {
+    if (trs_sparse_read(s, lsn, buf) < 0 ||
+        fwrite(buf, TRS_SPARSE_SECSIZE, 1, out) != 1)
+      ret = -1;
+  }
+  trs_sparse_close(s);
+  fclose(in);
+  if (fclose(out) == EOF)
+    ret = -1;
+  if (ret < 0)
+    error("failed to convert hard disk %s: %s", sparsename, strerror(errno));
+  return ret;
+}
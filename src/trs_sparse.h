@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2006-2011, Mark Grebe
+ * Copyright (C) 2018-2021, Jens Guenther
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Sparse hard disk image container.
+ *
+ * The image is split into blocks of TRS_SPARSE_BLOCK_SECS sectors.
+ * A block index maps each block to its data in the file; blocks that
+ * were never written are not stored and read back as the fill byte.
+ * Blocks may optionally be stored PackBits compressed.
+ *
+ * File layout (all numbers little endian):
+ *   0 - 7     magic "TRSSPHD\032"
+ *   8         version (1)
+ *   9         flags: bit 0 = compress written blocks
+ *   10        fill byte for unwritten sectors
+ *   11        log2 of sectors per block
+ *   12 - 15   number of blocks in the index
+ *   16 - 19   logical size of the image in sectors
+ *   20 - 31   reserved
+ *   32 - 287  Reed hard disk header (see reed.h)
+ *   288 -     block index, 8 bytes per block:
+ *               offset (4), stored length (2), allocated length (2);
+ *               offset 0 = block not stored, stored length smaller
+ *               than the block size = block is compressed
+ *   ...       block data
+ *
+ * Space given up by a block that outgrew its allocation or became
+ * empty is kept on a list of free extents and reused.
+ */
+
+#ifndef _TRS_SPARSE_H
+#define _TRS_SPARSE_H
+
+#include <stdio.h>
+
+#define TRS_SPARSE_MAGIC       "TRSSPHD\032"
+#define TRS_SPARSE_MAGICLEN    8
+#define TRS_SPARSE_VERSION     1
+#define TRS_SPARSE_COMPRESS    0x01
+#define TRS_SPARSE_HDRSIZE     32
+#define TRS_SPARSE_REEDSIZE    256
+#define TRS_SPARSE_SECSIZE     256
+#define TRS_SPARSE_BLOCKSHIFT  4
+#define TRS_SPARSE_BLOCK_SECS  (1 << TRS_SPARSE_BLOCKSHIFT)
+#define TRS_SPARSE_BLOCKSIZE   (TRS_SPARSE_BLOCK_SECS * TRS_SPARSE_SECSIZE)
+#define TRS_SPARSE_ENTRYSIZE   8
+#define TRS_SPARSE_INDEX       (TRS_SPARSE_HDRSIZE + TRS_SPARSE_REEDSIZE)
+
+typedef struct {
+  unsigned long offset;   /* 0 if the block is not stored */
+  unsigned short length;  /* stored length */
+  unsigned short alloc;   /* space allocated in the file */
+} SparseBlock;
+
+typedef struct {
+  unsigned long offset;
+  unsigned long size;
+} SparseExtent;
+
+typedef struct {
+  FILE *file;
+  int flags;
+  int fill;
+  unsigned long nblocks;
+  unsigned long nsecs;
+  unsigned long file_end;
+  SparseBlock *index;
+  /* Unused space in the file, sorted by offset; none ends at file_end */
+  SparseExtent *free;
+  int nfree;
+  int free_alloc;
+  unsigned char reed[TRS_SPARSE_REEDSIZE];
+  /* Most recently used block, decoded */
+  long cur_block;
+  int cur_dirty;
+  unsigned char cur[TRS_SPARSE_BLOCKSIZE];
+} SparseImage;
+
+int trs_sparse_check(FILE *f);
+SparseImage *trs_sparse_open(FILE *f);
+void trs_sparse_close(SparseImage *s);
+int trs_sparse_read(SparseImage *s, unsigned long lsn, unsigned char *buf);
+int trs_sparse_write(SparseImage *s, unsigned long lsn,
+                     const unsigned char *buf);
+int trs_sparse_flush(SparseImage *s);
+int trs_sparse_set_header(SparseImage *s, int offset, int value);
+int trs_sparse_create(const char *fname, const unsigned char *reed,
+                      unsigned long nsecs, int fill, int flags);
+int trs_sparse_from_reed(const char *reedname, const char *sparsename,
+                         int fill, int flags);
+int trs_sparse_to_reed(const char *sparsename, const char *reedname);
+
+int trs_packbits(const unsigned char *src, int len, unsigned char *dst,
+                 int max);
+int trs_unpackbits(const unsigned char *src, int len, unsigned char *dst,
+                   int dstlen);
+
+#endif /* _TRS_SPARSE_H */
@@ -28,34 +28,98 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "error.h"
+#include "trs.h"
+#include "trs_sparse.h"
 #include "trs_state_save.h"
 
+/*
+ * Version 1 files are the subsystem states written back to back.
+ * Version 2 files store each subsystem in a chunk: a 4-character tag,
+ * the length of the data (uint32) and the data, ending with an "END "
+ * chunk.  Unknown chunks are skipped on loading.  Memory is written
+ * as a list of non-zero pages, see trs_save_pages.
+ */
 static const char stateFileBanner[] = "sldtrs State Save File";
 static int const stateFileBannerLen = sizeof(stateFileBanner) - 1;
-static unsigned stateVersionNumber = 1;
+static unsigned stateVersionNumber = 2;
+#define STATE_TAGLEN 4
+#define STATE_END "END "
+
+/* Version of the file being loaded */
+unsigned trs_state_version;
+
+/* Stdio buffer for State files, large enough for most of them to be
+   read in one go and written with one call per chunk */
+#define STATE_ARENA_SIZE 0x40000
+static char state_arena[STATE_ARENA_SIZE];
+
+static const struct {
+  char tag[STATE_TAGLEN + 1];
+  void (*save)(FILE *file);
+  void (*load)(FILE *file);
+} state_chunks[] = {
+  { "MAIN", trs_main_save,      trs_main_load      },
+  { "CASS", trs_cassette_save,  trs_cassette_load  },
+  { "DISK", trs_disk_save,      trs_disk_load      },
+  { "HARD", trs_hard_save,      trs_hard_load      },
+  { "STRG", trs_stringy_save,   trs_stringy_load   },
+  { "INTR", trs_interrupt_save, trs_interrupt_load },
+  { "IO  ", trs_io_save,        trs_io_load        },
+  { "MEM ", trs_mem_save,       trs_mem_load       },
+  { "KEYB", trs_keyboard_save,  trs_keyboard_load  },
+  { "UART", trs_uart_save,      trs_uart_load      },
+  { "Z80 ", trs_z80_save,       trs_z80_load       },
+  { "IMPX", trs_imp_exp_save,   trs_imp_exp_load   },
+};
+#define NUM_STATE_CHUNKS (int)(sizeof(state_chunks) / sizeof(state_chunks[0]))
+
+/* Write a chunk header with a placeholder length, return its offset */
+static long start_chunk(FILE *file, const char *tag)
+{
+  unsigned length = 0;
+  long start;
+
+  trs_save_uchar(file, (unsigned char *)tag, STATE_TAGLEN);
+  start = ftell(file);
+  trs_save_uint32(file, &length, 1);
+  return start;
+}
+
+static void end_chunk(FILE *file, long start)
+{
+  long const end = ftell(file);
+  unsigned length = end - start - 4;
+
+  fseek(file, start, SEEK_SET);
+  trs_save_uint32(file, &length, 1);
+  fseek(file, end, SEEK_SET);
+}
 
 int trs_state_save(const char *filename)
 {
   FILE *file;
+  int i;
 
   file = fopen(filename, "wb");
   if (file) {
+    setvbuf(file, state_arena, _IOFBF, STATE_ARENA_SIZE);
     trs_save_uchar(file, (unsigned char *)stateFileBanner, stateFileBannerLen);
     trs_save_uint32(file, &stateVersionNumber, 1);
-    trs_main_save(file);
-    trs_cassette_save(file);
-    trs_disk_save(file);
-    trs_hard_save(file);
-    trs_stringy_save(file);
-    trs_interrupt_save(file);
-    trs_io_save(file);
-    trs_mem_save(file);
-    trs_keyboard_save(file);
-    trs_uart_save(file);
-    trs_z80_save(file);
-    trs_imp_exp_save(file);
+    for (i = 0; i < NUM_STATE_CHUNKS; i++) {
+      long const start = start_chunk(file, state_chunks[i].tag);
+
+      state_chunks[i].save(file);
+      end_chunk(file, start);
+    }
+    end_chunk(file, start_chunk(file, STATE_END));
+    if (ferror(file)) {
+      error("failed to save State %s: %s", filename, strerror(errno));
+      fclose(file);
+      return -1;
+    }
     fclose(file);
     return 0;
   }
@@ -63,251 +127,447 @@ int trs_state_save(const char *filename)
   return -1;
 }
 
+static void load_chunks(FILE *file)
+{
+  char tag[STATE_TAGLEN];
+  unsigned length;
+  long start;
+  int i;
+
+  while (fread(tag, STATE_TAGLEN, 1, file) == 1) {
+    trs_load_uint32(file, &length, 1);
+    if (strncmp(tag, STATE_END, STATE_TAGLEN) == 0)
+      break;
+    start = ftell(file);
+    for (i = 0; i < NUM_STATE_CHUNKS; i++) {
+      if (strncmp(tag, state_chunks[i].tag, STATE_TAGLEN) == 0) {
+        state_chunks[i].load(file);
+        break;
+      }
+    }
+    fseek(file, start + length, SEEK_SET);
+  }
+}
+
 int trs_state_load(const char *filename)
 {
   FILE *file;
   char banner[80];
-  unsigned version;
+  int i;
 
   file = fopen(filename, "rb");
   if (file) {
+    setvbuf(file, state_arena, _IOFBF, STATE_ARENA_SIZE);
     trs_load_uchar(file, (unsigned char *)banner, stateFileBannerLen);
     if (strncmp(banner, stateFileBanner, stateFileBannerLen)) {
       error("failed to get State Banner from %s", filename);
       fclose(file);
       return -1;
     }
-    trs_load_uint32(file, &version, 1);
-    if (version != stateVersionNumber) {
-      error("unsupported version %d of State file", version);
+    trs_load_uint32(file, &trs_state_version, 1);
+    trs_io_stop();
+    if (trs_state_version == 1) {
+      for (i = 0; i < NUM_STATE_CHUNKS; i++)
+        state_chunks[i].load(file);
+    } else if (trs_state_version == stateVersionNumber) {
+      load_chunks(file);
+    } else {
+      error("unsupported version %d of State file", trs_state_version);
       fclose(file);
       return -1;
     }
-    trs_main_load(file);
-    trs_cassette_load(file);
-    trs_disk_load(file);
-    trs_hard_load(file);
-    trs_stringy_load(file);
-    trs_interrupt_load(file);
-    trs_io_load(file);
-    trs_mem_load(file);
-    trs_keyboard_load(file);
-    trs_uart_load(file);
-    trs_z80_load(file);
-    trs_imp_exp_load(file);
     fclose(file);
+    trs_rewind_reset();
     return 0;
   }
   error("failed to load State %s: %s", filename, strerror(errno));
   return -1;
 }
 
+/*
+ * Save the machine state without the contents of RAM and ROM, in the
+ * order of the State file chunks but without their headers.  Used for
+ * the in-memory rewind buffer.
+ */
+void trs_state_save_regs(FILE *file)
+{
+  int i;
+
+  for (i = 0; i < NUM_STATE_CHUNKS; i++) {
+    if (state_chunks[i].save == trs_mem_save)
+      trs_mem_save_regs(file);
+    else
+      state_chunks[i].save(file);
+  }
+}
+
+void trs_state_load_regs(FILE *file)
+{
+  int i;
+
+  trs_state_version = stateVersionNumber;
+  trs_io_stop();
+  for (i = 0; i < NUM_STATE_CHUNKS; i++) {
+    if (state_chunks[i].load == trs_mem_load)
+      trs_mem_load_regs(file);
+    else
+      state_chunks[i].load(file);
+  }
+}
+
+/*
+ * Save a buffer as a list of its non-zero pages: for each, the page
+ * number (uint32) and the stored length (uint16) followed by the data,
+ * PackBits compressed if that is shorter.  A page number of
+ * STATE_NO_PAGE ends the list.  Zero pages are not stored at all.
+ */
+#define STATE_PAGE_SIZE 256
+#define STATE_NO_PAGE 0xFFFFFFFF
+
+void trs_save_pages(FILE *file, unsigned char *buffer, int size)
+{
+  unsigned char packed[STATE_PAGE_SIZE];
+  unsigned page, npages = (size + STATE_PAGE_SIZE - 1) / STATE_PAGE_SIZE;
+  unsigned short length;
+
+  for (page = 0; page < npages; page++) {
+    unsigned char *data = buffer + page * STATE_PAGE_SIZE;
+    int n = size - page * STATE_PAGE_SIZE, i, packed_len;
+
+    if (n > STATE_PAGE_SIZE)
+      n = STATE_PAGE_SIZE;
+    for (i = 0; i < n && data[i] == 0; i++)
+      ;
+    if (i == n)
+      continue;
+    packed_len = trs_packbits(data, n, packed, n - 1);
+    trs_save_uint32(file, &page, 1);
+    if (packed_len > 0) {
+      length = packed_len;
+      trs_save_uint16(file, &length, 1);
+      trs_save_uchar(file, packed, length);
+    } else {
+      length = n;
+      trs_save_uint16(file, &length, 1);
+      trs_save_uchar(file, data, n);
+    }
+  }
+  page = STATE_NO_PAGE;
+  trs_save_uint32(file, &page, 1);
+}
+
+/* Return whether the pages saved next in file include any non-zero one */
+int trs_peek_pages(FILE *file)
+{
+  long const pos = ftell(file);
+  unsigned page = STATE_NO_PAGE;
+
+  trs_load_uint32(file, &page, 1);
+  fseek(file, pos, SEEK_SET);
+  return page != STATE_NO_PAGE;
+}
+
+/* Load a buffer saved by trs_save_pages; pages not stored are zero.
+   With a NULL buffer the pages are skipped. */
+void trs_load_pages(FILE *file, unsigned char *buffer, int size)
+{
+  unsigned char packed[STATE_PAGE_SIZE];
+  unsigned page;
+  unsigned short length;
+
+  if (buffer != NULL)
+    memset(buffer, 0, size);
+  for (;;) {
+    int n;
+
+    page = STATE_NO_PAGE;
+    trs_load_uint32(file, &page, 1);
+    if (page == STATE_NO_PAGE)
+      break;
+    trs_load_uint16(file, &length, 1);
+    if (buffer == NULL) {
+      fseek(file, length, SEEK_CUR);
+      continue;
+    }
+    n = size - (int)(page * STATE_PAGE_SIZE);
+    if (n > STATE_PAGE_SIZE)
+      n = STATE_PAGE_SIZE;
+    if (n <= 0 || length > n) {
+      error("bad memory page %u in State file", page);
+      break;
+    }
+    if (length == n) {
+      trs_load_uchar(file, buffer + page * STATE_PAGE_SIZE, n);
+    } else {
+      trs_load_uchar(file, packed, length);
+      if (trs_unpackbits(packed, length, buffer + page * STATE_PAGE_SIZE,
+                         n) < 0)
+        error("bad memory page %u in State file", page);
+    }
+  }
+}
+
 void trs_save_uchar(FILE *file, unsigned char *buffer, int count)
 {
   fwrite(buffer, count, 1, file);
 }
 
-void trs_load_uchar(FILE *file, unsigned char *buffer, int count)
+/*
+ * Numbers are stored little endian, ints and shorts as sign and
+ * magnitude.  Arrays are saved in blocks of STATE_BULK bytes with one
+ * stdio call per block; on little endian hosts unsigned values are
+ * written in place.  An array is loaded with a single read into a
+ * scratch buffer and only then converted, so it is left unchanged
+ * unless all of it could be read.
+ */
+#define STATE_BULK 1024
+
+/* Read count items of size bytes into stack, or into a malloc'ed
+   buffer if they don't fit; NULL if the file ends first */
+static unsigned char *load_raw(FILE *file, int size, int count,
+                               unsigned char *stack)
 {
-  fread(buffer, count, 1, file);
+  unsigned char *bytes = stack;
+
+  if (count <= 0)
+    return NULL;
+  if ((size_t)size * count > STATE_BULK &&
+      (bytes = (unsigned char *)malloc((size_t)size * count)) == NULL)
+    return NULL;
+  if (fread(bytes, size, count, file) != (size_t)count) {
+    if (bytes != stack)
+      free(bytes);
+    return NULL;
+  }
+  return bytes;
 }
 
-void trs_save_uint16(FILE *file, unsigned short *buffer, int count)
+static void load_done(unsigned char *bytes, unsigned char *stack)
 {
-  int i;
-  unsigned short temp;
-  unsigned char byte;
+  if (bytes != stack)
+    free(bytes);
+}
 
-  for (i = 0; i < count; i++) {
-    temp = *buffer++;
-    byte = temp & 0xFF;
-    fwrite(&byte, 1, 1, file);
-    byte = temp >> 8;
-    fwrite(&byte, 1, 1, file);
+void trs_load_uchar(FILE *file, unsigned char *buffer, int count)
+{
+  unsigned char stack[STATE_BULK];
+  unsigned char *bytes = load_raw(file, 1, count, stack);
+
+  if (bytes != NULL) {
+    memcpy(buffer, bytes, count);
+    load_done(bytes, stack);
   }
 }
 
-void trs_load_uint16(FILE *file, unsigned short *buffer, int count)
+static void save_le16(FILE *file, const unsigned short *words, int count)
 {
-  int i;
-  unsigned char byte0, byte1;
+#ifdef big_endian
+  unsigned char bytes[STATE_BULK];
 
-  for (i = 0; i < count; i++) {
-    fread(&byte0, 1, 1, file);
-    fread(&byte1, 1, 1, file);
-    *buffer++ = (byte1 << 8) | byte0;
+  while (count > 0) {
+    int const n = count < STATE_BULK / 2 ? count : STATE_BULK / 2;
+    int i;
+
+    for (i = 0; i < n; i++) {
+      bytes[i * 2]     = words[i];
+      bytes[i * 2 + 1] = words[i] >> 8;
+    }
+    fwrite(bytes, 2, n, file);
+    words += n;
+    count -= n;
   }
+#else
+  fwrite(words, 2, count, file);
+#endif
 }
 
-void trs_save_uint32(FILE *file, unsigned *buffer, int count)
+static int load_le16(FILE *file, unsigned short *words, int count)
 {
+  unsigned char stack[STATE_BULK];
+  unsigned char *bytes = load_raw(file, 2, count, stack);
+#ifdef big_endian
   int i;
-  unsigned temp;
-  unsigned char byte;
+#endif
 
-  for (i = 0; i < count; i++) {
-    temp = *buffer++;
-    byte = temp & 0xFF;
-    fwrite(&byte, 1, 1, file);
-    temp >>= 8;
-    byte = temp & 0xFF;
-    fwrite(&byte, 1, 1, file);
-    temp >>= 8;
-    byte = temp & 0xFF;
-    fwrite(&byte, 1, 1, file);
-    temp >>= 8;
-    byte = temp & 0xFF;
-    fwrite(&byte, 1, 1, file);
+  if (bytes == NULL)
+    return 0;
+#ifdef big_endian
+  for (i = 0; i < count; i++)
+    words[i] = bytes[i * 2] | (bytes[i * 2 + 1] << 8);
+#else
+  memcpy(words, bytes, count * 2);
+#endif
+  load_done(bytes, stack);
+  return count;
+}
+
+static void save_le32(FILE *file, const unsigned *words, int count)
+{
+#ifdef big_endian
+  unsigned char bytes[STATE_BULK];
+
+  while (count > 0) {
+    int const n = count < STATE_BULK / 4 ? count : STATE_BULK / 4;
+    int i;
+
+    for (i = 0; i < n; i++) {
+      unsigned const w = words[i];
+
+      bytes[i * 4]     = w;
+      bytes[i * 4 + 1] = w >> 8;
+      bytes[i * 4 + 2] = w >> 16;
+      bytes[i * 4 + 3] = w >> 24;
+    }
+    fwrite(bytes, 4, n, file);
+    words += n;
+    count -= n;
   }
+#else
+  fwrite(words, 4, count, file);
+#endif
 }
 
-void trs_load_uint32(FILE *file, unsigned *buffer, int count)
+static int load_le32(FILE *file, unsigned *words, int count)
 {
+  unsigned char stack[STATE_BULK];
+  unsigned char *bytes = load_raw(file, 4, count, stack);
+#ifdef big_endian
   int i;
-  unsigned char byte0, byte1, byte2, byte3;
+#endif
 
-  for (i = 0; i < count; i++) {
-    fread(&byte0, 1, 1, file);
-    fread(&byte1, 1, 1, file);
-    fread(&byte2, 1, 1, file);
-    fread(&byte3, 1, 1, file);
-    *buffer++ = (byte3 << 24) | (byte2 << 16) | (byte1 << 8) | byte0;
-  }
+  if (bytes == NULL)
+    return 0;
+#ifdef big_endian
+  for (i = 0; i < count; i++)
+    words[i] = bytes[i * 4] | (bytes[i * 4 + 1] << 8) |
+               (bytes[i * 4 + 2] << 16) | ((unsigned)bytes[i * 4 + 3] << 24);
+#else
+  memcpy(words, bytes, count * 4);
+#endif
+  load_done(bytes, stack);
+  return count;
+}
+
+void trs_save_uint16(FILE *file, unsigned short *buffer, int count)
+{
+  save_le16(file, buffer, count);
+}
+
+void trs_load_uint16(FILE *file, unsigned short *buffer, int count)
+{
+  load_le16(file, buffer, count);
+}
+
+void trs_save_uint32(FILE *file, unsigned *buffer, int count)
+{
+  save_le32(file, buffer, count);
+}
+
+void trs_load_uint32(FILE *file, unsigned *buffer, int count)
+{
+  load_le32(file, buffer, count);
 }
 
 void trs_save_uint64(FILE *file, unsigned long long *buffer, int count)
 {
-  int i, j;
-  unsigned long long temp;
-  unsigned char byte;
+#ifdef big_endian
+  unsigned words[STATE_BULK / 4];
 
-  for (i = 0; i < count; i++) {
-    temp = *buffer++;
-     for (j = 0; j < 8; j++) {
-       byte = temp & 0xFF;
-       fwrite(&byte, 1, 1, file);
-       temp = temp >> 8;
-     }
+  while (count > 0) {
+    int const n = count < STATE_BULK / 8 ? count : STATE_BULK / 8;
+    int i;
+
+    for (i = 0; i < n; i++) {
+      words[i * 2]     = buffer[i];
+      words[i * 2 + 1] = buffer[i] >> 32;
+    }
+    save_le32(file, words, n * 2);
+    buffer += n;
+    count -= n;
   }
+#else
+  fwrite(buffer, 8, count, file);
+#endif
 }
 
 void trs_load_uint64(FILE *file, unsigned long long *buffer, int count)
 {
+  unsigned char stack[STATE_BULK];
+  unsigned char *bytes = load_raw(file, 8, count, stack);
+#ifdef big_endian
   int i, j;
-  unsigned char byte[8];
-  unsigned long long temp;
+#endif
 
+  if (bytes == NULL)
+    return;
+#ifdef big_endian
   for (i = 0; i < count; i++) {
-    for (j = 0; j < 8; j++)
-      fread(&byte[j], 1, 1, file);
-    temp = 0;
-    for (j = 7; j >= 0; j--) {
-      temp |= byte[j];
-      if (j)
-        temp = temp << 8;
-    }
-    *buffer++ = temp;
+    buffer[i] = 0;
+    for (j = 7; j >= 0; j--)
+      buffer[i] = (buffer[i] << 8) | bytes[i * 8 + j];
   }
+#else
+  memcpy(buffer, bytes, count * 8);
+#endif
+  load_done(bytes, stack);
 }
 
 void trs_save_short(FILE *file, short *buffer, int count)
 {
-  int i;
-  short num;
-  unsigned short unum;
-  unsigned char sign;
-  unsigned char byte;
+  unsigned short words[STATE_BULK / 2];
 
-  for (i = 0; i < count; i++) {
-    num = *buffer++;
-    if (num < 0) {
-      sign = 0x80;
-      num = -num;
-    } else {
-      sign = 0;
-    }
+  while (count > 0) {
+    int const n = count < STATE_BULK / 2 ? count : STATE_BULK / 2;
+    int i;
 
-    unum = num;
-
-    byte = unum & 0xFF;
-    fwrite(&byte, 1, 1, file);
-    unum = unum >> 8;
-    byte = (unum & 0x7F) | sign;
-    fwrite(&byte, 1, 1, file);
+    for (i = 0; i < n; i++)
+      words[i] = buffer[i] < 0 ? (-buffer[i] & 0x7FFF) | 0x8000 : buffer[i];
+    save_le16(file, words, n);
+    buffer += n;
+    count -= n;
   }
 }
 
 void trs_load_short(FILE *file, short *buffer, int count)
 {
+  /* Converted in place; short and unsigned short may alias */
+  unsigned short *words = (unsigned short *)buffer;
   int i;
-  short temp;
-  unsigned char byte0, byte1, sign;
 
-  for (i = 0; i < count; i++) {
-    fread(&byte0, 1, 1, file);
-    fread(&byte1, 1, 1, file);
-    sign = byte1 & 0x80;
-    byte1 &= 0x7f;
-
-    temp = (byte1 << 8) | byte0;
-    if (sign)
-      temp = -temp;
-    *buffer++ = temp;
-  }
+  if (load_le16(file, words, count) < count)
+    return;
+  for (i = 0; i < count; i++)
+    buffer[i] = (words[i] & 0x8000) ? -(words[i] & 0x7FFF) : words[i];
 }
 
 void trs_save_int(FILE *file, int *buffer, int count)
 {
-  int i;
-  int num;
-  unsigned int unum;
-  unsigned char sign;
-  unsigned char byte;
-
-  for (i = 0; i < count; i++) {
-    num = *buffer++;
-    if (num < 0) {
-      sign = 0x80;
-      num = -num;
-    } else {
-      sign = 0;
-    }
-
-    unum = num;
-
-    byte = unum & 0xFF;
-    fwrite(&byte, 1, 1, file);
-    unum = unum >> 8;
-    byte = unum & 0xFF;
-    fwrite(&byte, 1, 1, file);
-    unum = unum >> 8;
-    byte = unum & 0xFF;
-    fwrite(&byte, 1, 1, file);
-    unum = unum >> 8;
-    byte = (unum & 0x7F) | sign;
-    fwrite(&byte, 1, 1, file);
+  unsigned words[STATE_BULK / 4];
+
+  while (count > 0) {
+    int const n = count < STATE_BULK / 4 ? count : STATE_BULK / 4;
+    int i;
+
+    for (i = 0; i < n; i++)
+      words[i] = buffer[i] < 0 ?
+          ((0U - buffer[i]) & 0x7FFFFFFF) | 0x80000000 : (unsigned)buffer[i];
+    save_le32(file, words, n);
+    buffer += n;
+    count -= n;
   }
 }
 
 void trs_load_int(FILE *file, int *buffer, int count)
 {
+  /* Converted in place; int and unsigned may alias */
+  unsigned *words = (unsigned *)buffer;
   int i;
-  int temp;
-  unsigned char byte0, byte1, byte2, byte3, sign;
 
-  for (i = 0; i < count; i++) {
-    fread(&byte0, 1, 1, file);
-    fread(&byte1, 1, 1, file);
-    fread(&byte2, 1, 1, file);
-    fread(&byte3, 1, 1, file);
-    sign = byte3 & 0x80;
-    byte3 &= 0x7f;
-
-    temp = (byte3 << 24) | (byte2 << 16) | (byte1 << 8) | byte0;
-    if (sign)
-      temp = -temp;
-    *buffer++ = temp;
-  }
+  if (load_le32(file, words, count) < count)
+    return;
+  for (i = 0; i < count; i++)
+    buffer[i] = (words[i] & 0x80000000) ?
+        -(int)(words[i] & 0x7FFFFFFF) : (int)words[i];
 }
 
 void trs_save_float(FILE *file, float *buffer, int count)
@@ -344,7 +604,7 @@ void trs_save_filename(FILE *file, char *filename)
 
 void trs_load_filename(FILE *file, char *filename)
 {
-  unsigned short length;
+  unsigned short length = 0;
 
   trs_load_uint16(file, &length, 1);
   trs_load_uchar(file, (unsigned char *)filename, length);
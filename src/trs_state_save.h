@@ -24,6 +24,8 @@
 
 int  trs_state_save(const char *filename);
 int  trs_state_load(const char *filename);
+void trs_state_save_regs(FILE *file);
+void trs_state_load_regs(FILE *file);
 void trs_save_uchar(FILE *file, unsigned char *buffer, int count);
 void trs_load_uchar(FILE *file, unsigned char *buffer, int count);
 void trs_save_uint16(FILE *file, unsigned short *buffer, int count);
@@ -40,6 +42,11 @@ void trs_save_float(FILE *file, float *buffer, int count);
 void trs_load_float(FILE *file, float *buffer, int count);
 void trs_save_filename(FILE *file, char *filename);
 void trs_load_filename(FILE *file, char *filename);
+void trs_save_pages(FILE *file, unsigned char *buffer, int size);
+void trs_load_pages(FILE *file, unsigned char *buffer, int size);
+int trs_peek_pages(FILE *file);
+
+extern unsigned trs_state_version;
 
 void trs_main_save(FILE *file);
 void trs_cassette_save(FILE *file);
@@ -49,6 +56,7 @@ void trs_stringy_save(FILE *file);
 void trs_interrupt_save(FILE *file);
 void trs_io_save(FILE *file);
 void trs_mem_save(FILE *file);
+void trs_mem_save_regs(FILE *file);
 void trs_keyboard_save(FILE *file);
 void trs_uart_save(FILE *file);
 void trs_z80_save(FILE *file);
@@ -62,6 +70,7 @@ void trs_stringy_load(FILE *file);
 void trs_interrupt_load(FILE *file);
 void trs_io_load(FILE *file);
 void trs_mem_load(FILE *file);
+void trs_mem_load_regs(FILE *file);
 void trs_keyboard_load(FILE *file);
 void trs_uart_load(FILE *file);
 void trs_z80_load(FILE *file);
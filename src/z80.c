@@ -1179,6 +1179,67 @@ static void do_rrd(void)
  * Input/output instruction support:
  */
 
+/*
+ * INIR and OTIR on a port that takes whole blocks (TRS-IO) move up to
+ * B bytes with a single call, charged as the iterations they replace.
+ * If the port stops short, the instruction repeats for the rest.
+ */
+static void block_io_done(int count)
+{
+    Z80_B -= count;
+    T_COUNT(20 * count);
+    SET_SUBTRACT();
+    if (Z80_B == 0) {
+      SET_ZERO();
+      T_COUNT(-5);
+    } else {
+      CLEAR_ZERO();
+      Z80_PC -= 2;
+    }
+}
+
+static int do_inir_block(void)
+{
+    Uchar buf[256];
+    int count, i;
+
+    if (!z80_block_port(Z80_C, FALSE))
+      return FALSE;
+#ifdef ZBX
+    if (debug_write_watch != NULL)
+      return FALSE;
+#endif
+    count = z80_in_block(Z80_C, buf, Z80_B ? Z80_B : 256);
+    for (i = 0; i < count; i++) {
+      mem_write(Z80_HL, buf[i]);
+      Z80_HL++;
+    }
+    block_io_done(count);
+    return TRUE;
+}
+
+static int do_outir_block(void)
+{
+    Uchar buf[256];
+    int count;
+
+    if (!z80_block_port(Z80_C, TRUE))
+      return FALSE;
+#ifdef ZBX
+    if (debug_read_watch != NULL)
+      return FALSE;
+#endif
+    /* The port may take fewer bytes than offered, so only offer plain
+       RAM, which can be read ahead without side effects */
+    count = mem_read_ram(Z80_HL, buf, Z80_B ? Z80_B : 256);
+    if (count == 0)
+      return FALSE;
+    count = z80_out_block(Z80_C, buf, count);
+    Z80_HL += count;
+    block_io_done(count);
+    return TRUE;
+}
+
 static void do_ind(void)
 {
     mem_write(Z80_HL, z80_in(Z80_C));
@@ -1238,6 +1299,8 @@ static void do_ini(void)
 #ifdef FAST_MOVE
 static void do_inir(void)
 {
+    if (do_inir_block())
+      return;
     do
     {
 	mem_write(Z80_HL, z80_in(Z80_C));
@@ -1253,6 +1316,8 @@ static void do_inir(void)
 #else
 static void do_inir(void)
 {
+    if (do_inir_block())
+      return;
     do_ini();
     if(!ZERO_FLAG) {
       Z80_PC -= 2;
@@ -1350,6 +1415,8 @@ static void do_outi(void)
 #ifdef FAST_MOVE
 static void do_outir(void)
 {
+    if (do_outir_block())
+      return;
     do
     {
 	z80_out(Z80_C, mem_read(Z80_HL));
@@ -1365,6 +1432,8 @@ static void do_outir(void)
 #else
 static void do_outir(void)
 {
+    if (do_outir_block())
+      return;
     do_outi();
     if (!ZERO_FLAG) {
       Z80_PC -= 2;
@@ -3112,7 +3181,21 @@ int z80_run(int continuous)
 	  last_t_count = z80_state.t_count;
 	}
 
+	/* Cassette fast loading traps ROM entry points */
+	if (cassette_fastload_armed && Z80_PC < 0x0300)
+	  trs_cassette_rom_trap();
+
+	/* Fork server checkpoint address */
+	if (trs_forkserver_armed && Z80_PC == trs_forkserver_pc)
+	  trs_forkserver_checkpoint();
+
+#ifdef ZBX
+	if (debug_tracing)
+	  debug_trace_record();
+#endif
+
 	Z80_R++;
+	z80_state.op_pc = Z80_PC;
 	instruction = mem_read(Z80_PC++);
 
 	switch(instruction)
@@ -4426,6 +4509,12 @@ int z80_run(int continuous)
 	        do_int();
 	    }
 	}
+
+#ifdef ZBX
+	/* Stop at debugger traps before fetching the next opcode */
+	if (debug_traps != NULL && debug_traps[Z80_PC])
+	  break;
+#endif
     } while (trs_continuous > 0);
     return ret;
 }
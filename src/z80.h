@@ -142,10 +142,25 @@ struct z80_state_struct
     /* Simple event scheduler.  If nonzero, when t_count passes sched,
      * trs_do_event() is called and sched is set to zero. */
     tstate_t sched;
+
+    /* Address of the instruction being executed */
+    Ushort op_pc;
 };
 
 #define Z80_ADDRESS_LIMIT	(1 << 16)
 
+/* A decoded instruction, see dis.c */
+struct dis_insn
+{
+    Ushort pc;
+    int length;
+    Uchar bytes[4];
+    int target;		/* address of jump, call or rst; -1 if none */
+    char text[40];	/* as printed by disassemble, may have a comment */
+    char mnemonic[16];
+    char operands[24];
+};
+
 /*
  * Register accessors:
  */
@@ -240,12 +255,39 @@ struct z80_state_struct
 #define CARRY_FLAG		(Z80_F & CARRY_MASK)
 
 extern struct z80_state_struct z80_state;
+
+/* Debugger trap flags of each address, NULL if not debugging */
+extern Ushort *debug_traps;
+
+/* Recording the binary instruction trace */
+extern int debug_tracing;
+
+#define BREAKPOINT_FLAG		(0x1)
+#define TRACE_FLAG		(0x2)
+#define DISASSEMBLE_ON_FLAG	(0x4)
+#define DISASSEMBLE_OFF_FLAG	(0x8)
+#define BREAK_ONCE_FLAG		(0x10)
+#define WATCHPOINT_FLAG		(0x20)
+#define GDB_BREAK_FLAG		(0x40)	/* Set by a remote GDB */
+#define RECORD_ON_FLAG		(0x80)
+#define RECORD_OFF_FLAG		(0x100)
+
+/* Debugger watchpoint bitmaps of the address space, NULL if none */
+extern Uchar *debug_read_watch;
+extern Uchar *debug_write_watch;
+
+#define DEBUG_WATCHED(map, address) ((map)[(address) >> 3] & \
+				     (1 << ((address) & 7)))
 extern unsigned int cycles_per_timer;
 
 extern void z80_reset(void);
 extern int z80_run(int continuous);
 extern int mem_read(int address);
 extern void mem_write(int address, int value);
+extern void mem_write_block(int address, const Uchar *buf, int count);
+extern int mem_read_ram(int address, Uchar *buf, int count);
+extern unsigned mem_epoch;
+extern const unsigned *mem_page_gen(int address);
 extern void mem_write_rom(int address, int value);
 extern int mem_read_word(int address);
 extern void mem_write_word(int address, int value);
@@ -253,7 +295,23 @@ extern Uchar *mem_pointer(int address, int writing);
 extern int load_hex(FILE *file); /* returns highest address loaded + 1 */
 extern void z80_out(int port, int value);
 extern int z80_in(int port);
+extern int z80_block_port(int port, int writing);
+extern int z80_in_block(int port, Uchar *buf, int count);
+extern int z80_out_block(int port, const Uchar *buf, int count);
 extern int disassemble(unsigned short pc);
+extern int dis_decode(const Uchar *buf, int pc, struct dis_insn *insn);
+extern int dis_format(const struct dis_insn *insn, char *out, int size);
+extern const struct dis_insn *dis_decode_cached(unsigned short pc);
 extern void debug_init(void);
+extern void debug_watch(int address, int value, int writing);
 extern void debug_shell(void);
+extern char debug_gdb_socket[FILENAME_MAX];
+extern void debug_gdb_serve(void);
+extern void debug_gdb_tick(void);
+extern void debug_trace_record(void);
+extern int debug_trace_start(int entries, int once);
+extern int debug_trace_resume(void);
+extern void debug_trace_stop(void);
+extern void debug_trace_status(void);
+extern int debug_trace_save(const char *filename);
 #endif